@@ -8,10 +8,13 @@
  * COPYING file in the top-level directory.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include "backend.h"
+#include "frame.h"
+#include "trace.h"
 
 #define BACKEND_MAX 10
 
@@ -19,10 +22,31 @@ static struct backend *backends[BACKEND_MAX];
 
 static unsigned int backend_count;
 
+static const struct stats_entry backend_stats[BACKEND_STAT_MAX] = {
+	[BACKEND_STAT_PUSHED]		= STATS_COUNTER("pushed"),
+	[BACKEND_STAT_DROPPED]		= STATS_COUNTER("dropped"),
+	[BACKEND_STAT_ERRORS]		= STATS_COUNTER("errors"),
+	[BACKEND_STAT_BYTES]		= STATS_COUNTER("bytes"),
+	[BACKEND_STAT_LATENCY]		= STATS_GAUGE("latency"),
+	[BACKEND_STAT_QUEUE]		= STATS_GAUGE("queue"),
+	[BACKEND_STAT_RECONNECTS]	= STATS_COUNTER("reconnects"),
+};
+
 void __backend_register(struct backend *backend)
 {
-	if (backend_count < BACKEND_MAX)
-		backends[backend_count++] = backend;
+	if (backend_count >= BACKEND_MAX)
+		return;
+
+	backends[backend_count++] = backend;
+
+	snprintf(backend->push_hist.name, sizeof(backend->push_hist.name),
+		 "push %s", backend->name);
+	hist_register(&backend->push_hist);
+
+	memcpy(backend->stats, backend_stats, sizeof(backend_stats));
+	backend->stats_group.name = backend->name;
+	backend->stats_group.entries = backend->stats;
+	backend->stats_group.count = BACKEND_STAT_MAX;
 }
 
 struct backend *backend_get(const char *name)
@@ -36,38 +60,196 @@ struct backend *backend_get(const char *name)
 	return NULL;
 }
 
+static int __backend_push(const struct frame *frame, int other)
+{
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < backend_count; i++) {
+		struct backend *b = backends[i];
+		unsigned long long start;
+		unsigned long long delay;
+		int err;
+
+		if (!b->enable || !b->ops->push)
+			continue;
+		if (other && !b->ops->all_meters)
+			continue;
+
+		TRACE(push_begin, b->name, frame->num, frame->rx_time);
+		start = clock_nsecs();
+		err = b->ops->push(frame);
+		hist_add(&b->push_hist, clock_nsecs() - start);
+		TRACE(push_end, b->name, frame->num, err);
+
+		/* imported frames have no reception time */
+		if (frame->rx_time) {
+			delay = clock_usecs() - frame->rx_time;
+			latency_update(&b->latency, delay);
+			stats_set(&b->stats[BACKEND_STAT_LATENCY], delay);
+		}
+		if (err)
+			stats_inc(&b->stats[BACKEND_STAT_ERRORS]);
+		ret |= err;
+	}
+	return ret;
+}
+
 int backend_push(const struct frame *frame)
+{
+	return __backend_push(frame, 0);
+}
+
+/*
+ * Frames of the meters which are not aggregated only go to the
+ * backends which can tell them apart. MQTT topics do not carry the
+ * meter.
+ */
+int backend_push_other(const struct frame *frame)
+{
+	return __backend_push(frame, 1);
+}
+
+int backend_push_loadcurve(const struct loadcurve_point *point)
 {
 	unsigned int i;
 	int ret = 0;
 
 	for (i = 0; i < backend_count; i++) {
-		if (backends[i]->enable && backends[i]->ops->push)
-			ret |= backends[i]->ops->push(frame);
+		struct backend *b = backends[i];
+		int err;
+
+		if (!b->enable || !b->ops->push_loadcurve)
+			continue;
+
+		err = b->ops->push_loadcurve(point);
+		if (err)
+			stats_inc(&b->stats[BACKEND_STAT_ERRORS]);
+		ret |= err;
 	}
 	return ret;
 }
 
-int backend_init(void)
+/*
+ * Overload short frames are pushed as soon as they are decoded, to
+ * let load shedding react. Backends which do not handle them are
+ * skipped.
+ */
+int backend_push_overload(const struct frame *frame)
 {
 	unsigned int i;
 	int ret = 0;
 
 	for (i = 0; i < backend_count; i++) {
-		if (backends[i]->enable && backends[i]->ops->init)
-			ret |= backends[i]->ops->init();
+		struct backend *b = backends[i];
+		unsigned long long delay;
+		int err;
+
+		if (!b->enable || !b->ops->push_overload)
+			continue;
+
+		TRACE(push_begin, b->name, frame->num, frame->rx_time);
+		err = b->ops->push_overload(frame);
+		TRACE(push_end, b->name, frame->num, err);
+
+		/* imported frames have no reception time */
+		if (frame->rx_time) {
+			delay = clock_usecs() - frame->rx_time;
+			latency_update(&b->latency, delay);
+			stats_set(&b->stats[BACKEND_STAT_LATENCY], delay);
+		}
+		if (err)
+			stats_inc(&b->stats[BACKEND_STAT_ERRORS]);
+		ret |= err;
 	}
 	return ret;
 }
 
-void backend_fini(void)
+/*
+ * Rule events are rare and pushed immediately
+ */
+int backend_push_event(const struct rule_event *event)
 {
 	unsigned int i;
+	int ret = 0;
 
 	for (i = 0; i < backend_count; i++) {
-		if (backends[i]->enable && backends[i]->ops->fini)
-			backends[i]->ops->fini();
+		struct backend *b = backends[i];
+		int err;
+
+		if (!b->enable || !b->ops->push_event)
+			continue;
+
+		err = b->ops->push_event(event);
+		if (err)
+			stats_inc(&b->stats[BACKEND_STAT_ERRORS]);
+		ret |= err;
 	}
+	return ret;
+}
+
+int backend_print_latency(char *buffer, size_t len)
+{
+	unsigned int i;
+	int n = 0;
+
+	for (i = 0; i < backend_count; i++) {
+		if (backends[i]->enable)
+			n += latency_print(backends[i]->name,
+					   &backends[i]->latency,
+					   buffer + n, len - n);
+	}
+	return n;
+}
+
+int backend_start(struct backend *b)
+{
+	if (!b->enable)
+		return 0;
+
+	stats_register(&b->stats_group);
+	return b->ops->init ? b->ops->init() : 0;
+}
+
+void backend_stop(struct backend *b)
+{
+	if (!b->enable)
+		return;
+
+	if (b->ops->fini)
+		b->ops->fini();
+	stats_unregister(&b->stats_group);
+}
+
+int backend_init(void)
+{
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < backend_count; i++)
+		ret |= backend_start(backends[i]);
+	return ret;
+}
+
+void backend_fini(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < backend_count; i++)
+		backend_stop(backends[i]);
+}
+
+/*
+ * Can option @name be changed without restarting the backend ?
+ */
+int backend_live(struct backend *b, const char *name)
+{
+	const char * const *live;
+
+	for (live = b->ops->live; live && *live; live++)
+		if (!strcmp(*live, name))
+			return 1;
+	return 0;
 }
 
 #define MATCH(n) (strcmp(name, n) == 0)
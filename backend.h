@@ -11,19 +11,59 @@
 #ifndef EDFINFO_BACKEND_H
 #define EDFINFO_BACKEND_H
 
+#include <stddef.h>
+
+#include "stats.h"
+#include "hist.h"
+
 struct frame;
+struct loadcurve_point;
+struct rule_event;
 
 struct backend_ops {
 	int (*configure)(const char *name, const char *value);
 	int (*init)(void);
 	int (*push)(const struct frame *frame);
 	void (*fini)(void);
+	/* optional, called when a load curve interval is closed */
+	int (*push_loadcurve)(const struct loadcurve_point *point);
+	/* optional, called for the short frames of a phase overload */
+	int (*push_overload)(const struct frame *frame);
+	/* optional, called when a rule fires */
+	int (*push_event)(const struct rule_event *event);
+	/* options changed on reload without restarting, NULL terminated */
+	const char * const *live;
+	/* rows carry the ADCO, also push the frames of the other meters */
+	int all_meters;
+};
+
+/*
+ * Common statistics of a backend. push() and errors are accounted
+ * by backend_push(), the others by the backends themselves.
+ */
+enum backend_stat {
+	BACKEND_STAT_PUSHED,
+	BACKEND_STAT_DROPPED,
+	BACKEND_STAT_ERRORS,
+	BACKEND_STAT_BYTES,
+	BACKEND_STAT_LATENCY,		/* usecs */
+	BACKEND_STAT_QUEUE,
+	BACKEND_STAT_RECONNECTS,
+	BACKEND_STAT_MAX,
 };
 
 struct backend {
 	const char *name;
 	int enable;
 	struct backend_ops *ops;
+
+	struct stats_entry stats[BACKEND_STAT_MAX];
+	struct stats_group stats_group;
+
+	/* ETX arrival -> push completion */
+	struct latency latency;
+	/* push op duration */
+	struct hist push_hist;
 };
 
 #define backend_register(bname, bops)					\
@@ -44,7 +84,29 @@ struct backend *backend_get(const char *name);
 int backend_configure(struct backend *backend, const char *name,
 		      const char *value);
 int backend_init(void);
+int backend_start(struct backend *backend);
+void backend_stop(struct backend *backend);
+int backend_live(struct backend *backend, const char *name);
 int backend_push(const struct frame *frame);
+int backend_push_other(const struct frame *frame);
+int backend_push_loadcurve(const struct loadcurve_point *point);
+int backend_push_overload(const struct frame *frame);
+int backend_push_event(const struct rule_event *event);
 void backend_fini(void);
+int backend_print_latency(char *buffer, size_t len);
+
+static inline void backend_stat_add(struct backend *b, enum backend_stat stat,
+				    unsigned long value)
+{
+	if (b)
+		stats_add(&b->stats[stat], value);
+}
+
+static inline void backend_stat_set(struct backend *b, enum backend_stat stat,
+				    unsigned long value)
+{
+	if (b)
+		stats_set(&b->stats[stat], value);
+}
 
 #endif
@@ -15,21 +15,35 @@
 #include <ini.h>
 
 #include "log.h"
+#include "stats.h"
 #include "config.h"
 #include "frame.h"
 #include "backend.h"
+#include "net.h"
+#include "power.h"
+#include "rule.h"
+#include "cost.h"
+#include "loadcurve.h"
+#include "phase.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
 struct config config	= {
 	.logfile	= "",
 	.logpriority	= LOG_NOTICE,
 	.daemonize	= 0,
 	.debug		= 0,
+	.datadir	= "",
+	.meter		= "",
 
 	.serial_port	= "/dev/ttyAMA0",
 	.serial_timeout	= 3,
+	.serial_lowlatency = 0,
 	.serial_lograw	= NULL,
 
-	.control_port   = 54345
+	.control_port   = 54345,
+	.control_lease	= 60,
+	.control_unix	= "",
 };
 
 #define MATCH_SECTION(s) (strcmp(section, s) == 0)
@@ -47,16 +61,49 @@ static int handler(void *user, const char *section, const char *name,
 		pconfig->logpriority = log_name_to_priority(value);
 	} else if (MATCH("", "daemonize")) {
 		pconfig->daemonize = atoi(value);
+	} else if (MATCH("", "datadir")) {
+		pconfig->datadir = strdup(value);
+	} else if (MATCH("", "meter")) {
+		pconfig->meter = strdup(value);
+	} else if (MATCH("", "phases")) {
+		if (frame_set_phases(value)) {
+			fprintf(stderr, "invalid phases '%s'\n", value);
+			return 0;
+		}
 
 	} else if (MATCH("serial", "port")) {
 		pconfig->serial_port = strdup(value);
 	} else if (MATCH("serial", "timeout")) {
 		pconfig->serial_timeout = atoi(value);
+	} else if (MATCH("serial", "lowlatency")) {
+		pconfig->serial_lowlatency = atoi(value);
 	} else if (MATCH("serial", "lograw")) {
 		pconfig->serial_lograw = strdup(value);
 
 	} else if (MATCH("control", "port")) {
 		pconfig->control_port = atoi(value);
+	} else if (MATCH("control", "unix")) {
+		pconfig->control_unix = strdup(value);
+	} else if (MATCH("control", "lease")) {
+		pconfig->control_lease = atoi(value);
+
+	} else if (MATCH_SECTION("power")) {
+		return power_configure(name, value);
+
+	} else if (MATCH_SECTION("phase")) {
+		return phase_configure(name, value);
+	} else if (MATCH_SECTION("loadcurve")) {
+		return loadcurve_configure(name, value);
+	} else if (MATCH_SECTION("cost")) {
+		return cost_configure(name, value);
+
+	/* network sources */
+	} else if (!strncmp(section, "net:", 4)) {
+		return net_configure(section + 4, name, value);
+
+	/* event rules */
+	} else if (!strncmp(section, "rule:", 5)) {
+		return rule_configure(section + 5, name, value);
 
 	/* default frame info values */
 	} else if (MATCH_SECTION("edfinfo")) {
@@ -77,6 +124,74 @@ static int handler(void *user, const char *section, const char *name,
 	return 1;
 }
 
+/*
+ * The values of the last parse are kept to find the options changed
+ * when the configuration is reloaded.
+ */
+struct config_entry {
+	char			*section;
+	char			*name;
+	char			*value;
+	struct config_entry	*next;
+};
+
+static struct config_entry *config_entries;
+static const char *config_file;
+
+static int config_entry_add(void *user, const char *section,
+			    const char *name, const char *value)
+{
+	struct config_entry **pe = user;
+	struct config_entry *e;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return 0;
+
+	e->section = strdup(section);
+	e->name = strdup(name);
+	e->value = strdup(value);
+
+	while (*pe)
+		pe = &(*pe)->next;
+	*pe = e;
+	return 1;
+}
+
+static void config_entry_free(struct config_entry *e)
+{
+	while (e) {
+		struct config_entry *next = e->next;
+
+		free(e->section);
+		free(e->name);
+		free(e->value);
+		free(e);
+		e = next;
+	}
+}
+
+/*
+ * Last value of option @name in @section, NULL if not set
+ */
+static const char *config_entry_get(const struct config_entry *e,
+				    const char *section, const char *name)
+{
+	const char *value = NULL;
+
+	for (; e; e = e->next)
+		if (!strcmp(e->section, section) && !strcmp(e->name, name))
+			value = e->value;
+	return value;
+}
+
+static int config_handler(void *user, const char *section, const char *name,
+			  const char *value)
+{
+	config_entry_add(&config_entries, section, name, value);
+	return handler(user, section, name, value);
+}
+
 int config_init(const char *filename)
 {
 	FILE *file;
@@ -93,7 +208,12 @@ int config_init(const char *filename)
 		return -1;
 	}
 
-	error = ini_parse_file(file, handler, &config);
+	/* daemon() changes the current directory */
+	config_file = realpath(filename, NULL);
+	if (!config_file)
+		config_file = filename;
+
+	error = ini_parse_file(file, config_handler, &config);
 	if (error)
 		ERROR("bogus configuration line at %s[%d]",
 		      filename, error);
@@ -106,3 +226,262 @@ int config_init(const char *filename)
 	NOTICE("Config loaded from '%s'\n", filename);
 	return error ? -1 : 0;
 }
+
+/*
+ * Options which can be changed without a restart, other than the
+ * backend and network source ones. The others hold state which
+ * would be lost.
+ */
+static const struct {
+	const char	*section;
+	const char	*name;		/* NULL for all */
+	int		flags;
+} config_live[] = {
+	{ "",		"logpriority",	0 },
+	{ "serial",	"timeout",	0 },
+	{ "serial",	"port",		CONFIG_RELOAD_SERIAL },
+	{ "serial",	"lowlatency",	CONFIG_RELOAD_SERIAL },
+	{ "control",	"lease",	0 },
+	{ "cost",	NULL,		0 },
+	{ "edfinfo",	NULL,		0 },
+};
+
+static int config_apply(const struct config_entry *e, const char *section,
+			const char *name)
+{
+	for (; e; e = e->next) {
+		if (strcmp(e->section, section))
+			continue;
+		if (name && strcmp(e->name, name))
+			continue;
+		if (!handler(&config, e->section, e->name, e->value)) {
+			ERROR("invalid option %s/%s = %s", e->section,
+			      e->name, e->value);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int config_section_first(const struct config_entry *list,
+				const struct config_entry *e)
+{
+	for (; list != e; list = list->next)
+		if (!strcmp(list->section, e->section))
+			return 0;
+	return 1;
+}
+
+static int config_section_set(const struct config_entry *list,
+			      const char *section)
+{
+	for (; list; list = list->next)
+		if (!strcmp(list->section, section))
+			return 1;
+	return 0;
+}
+
+/*
+ * A backend is restarted with its new options, unless all the
+ * changed options can be applied live. Removing the section
+ * disables it.
+ */
+static int config_reload_backend(struct backend *b,
+				 const struct config_entry *new,
+				 const char **names, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		if (!backend_live(b, names[i]))
+			break;
+
+	if (i == count && config_entry_get(new, b->name, "enable")) {
+		for (i = 0; i < count; i++)
+			if (config_apply(new, b->name, names[i]))
+				return -1;
+		return 0;
+	}
+
+	backend_stop(b);
+	b->enable = 0;
+	if (config_apply(new, b->name, NULL))
+		return -1;
+
+	NOTICE("%s: backend %s", b->name, b->enable ? "restarted" : "disabled");
+	return backend_start(b);
+}
+
+/*
+ * Network sources are closed and opened again
+ */
+static int config_reload_net(const char *section,
+			     const struct config_entry *new)
+{
+	net_remove(section + 4);
+	if (!config_section_set(new, section)) {
+		NOTICE("net: %s: source removed", section + 4);
+		return 0;
+	}
+
+	if (config_apply(new, section, NULL))
+		return -1;
+	return net_start(section + 4);
+}
+
+static int config_reload_section(const char *section,
+				 const struct config_entry *new,
+				 const char **names, unsigned int count,
+				 int *flags)
+{
+	struct backend *b;
+	unsigned int i, j;
+	int ret = 0;
+
+	if (!strncmp(section, "net:", 4))
+		return config_reload_net(section, new);
+
+	b = backend_get(section);
+	if (b)
+		return config_reload_backend(b, new, names, count);
+
+	if (!config_section_set(new, section)) {
+		WARN("[%s] removed, restart to apply", section);
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < ARRAY_SIZE(config_live); j++)
+			if (!strcmp(config_live[j].section, section) &&
+			    (!config_live[j].name ||
+			     !strcmp(config_live[j].name, names[i])))
+				break;
+
+		if (j == ARRAY_SIZE(config_live)) {
+			WARN("%s%s%s changed, restart to apply", section,
+			     *section ? "/" : "", names[i]);
+			continue;
+		}
+
+		INFO("%s%s%s changed", section, *section ? "/" : "",
+		     names[i]);
+		ret |= config_apply(new, section, names[i]);
+		*flags |= config_live[j].flags;
+	}
+	return ret;
+}
+
+/*
+ * Options of @section which were added or changed, at most @max
+ */
+static unsigned int config_diff(const struct config_entry *old,
+				const struct config_entry *new,
+				const char *section, const char **names,
+				unsigned int max)
+{
+	const struct config_entry *e;
+	unsigned int count = 0;
+	unsigned int i;
+
+	for (e = new; e; e = e->next) {
+		const char *value;
+
+		if (strcmp(e->section, section))
+			continue;
+
+		value = config_entry_get(old, section, e->name);
+		if (value && !strcmp(value, config_entry_get(new, section,
+							     e->name)))
+			continue;
+
+		for (i = 0; i < count; i++)
+			if (!strcmp(names[i], e->name))
+				break;
+		if (i == count && count < max)
+			names[count++] = e->name;
+	}
+	return count;
+}
+
+/*
+ * Returns 1 if @section changed
+ */
+static int config_reload_changed(const char *section,
+				 const struct config_entry *new, int *flags)
+{
+	const struct config_entry *e;
+	const char *names[64];
+	unsigned int count;
+
+	count = config_diff(config_entries, new, section, names,
+			    ARRAY_SIZE(names));
+
+	/* removed options keep their value, only report them */
+	if (config_section_set(new, section)) {
+		for (e = config_entries; e; e = e->next)
+			if (!strcmp(e->section, section) &&
+			    !config_entry_get(new, section, e->name))
+				WARN("%s/%s removed, the current value is "
+				     "kept until restart", section, e->name);
+		if (!count)
+			return 0;
+	}
+
+	if (config_reload_section(section, new, names, count, flags))
+		ERROR("failed to reload section [%s]", section);
+	return 1;
+}
+
+/*
+ * Parse the configuration file again and apply the changes. Returns
+ * CONFIG_RELOAD_* flags for the caller, or -1 if the file is bogus,
+ * in which case the running configuration is kept.
+ */
+int config_reload(void)
+{
+	unsigned long long start = clock_usecs();
+	struct config_entry *new = NULL;
+	const struct config_entry *e;
+	unsigned int changed = 0;
+	int flags = 0;
+	FILE *file;
+	int error;
+
+	if (!config_file)
+		return -1;
+
+	file = fopen(config_file, "r");
+	if (!file) {
+		ERROR("failed to open config file '%s' : %s",
+		      config_file, strerror(errno));
+		return -1;
+	}
+
+	error = ini_parse_file(file, config_entry_add, &new);
+	fclose(file);
+	if (error) {
+		ERROR("bogus configuration line at %s[%d], not reloaded",
+		      config_file, error);
+		config_entry_free(new);
+		return -1;
+	}
+
+	for (e = new; e; e = e->next)
+		if (config_section_first(new, e))
+			changed += config_reload_changed(e->section, new,
+							 &flags);
+
+	/* removed sections */
+	for (e = config_entries; e; e = e->next)
+		if (config_section_first(config_entries, e) &&
+		    !config_section_set(new, e->section))
+			changed += config_reload_changed(e->section, new,
+							 &flags);
+
+	config_entry_free(config_entries);
+	config_entries = new;
+
+	NOTICE("config reloaded from '%s' in %llu us : %d sections changed",
+	       config_file, clock_usecs() - start, changed);
+	return flags;
+}
@@ -11,21 +11,36 @@
 #ifndef EDFINFO_CONFIG_H
 #define EDFINFO_CONFIG_H
 
+#include <time.h>
+
 extern struct config {
 	const char	*logfile;
 	int		logpriority;
 	int		daemonize;
 	int		debug;
+	const char	*datadir;
+	const char	*meter;		/* ADCO of the aggregates */
 
 	const char	*serial_port;
 	int		serial_timeout;
+	int		serial_lowlatency;
 
 	int		control_port;
+	int		control_lease;
+	const char	*control_unix;
 
 	/* file to record raw data */
 	const char	*serial_lograw;
+
+	/* raw capture to decode offline, decoding threads, first frame date */
+	const char	*import;
+	unsigned int	import_jobs;
+	time_t		import_start;
 } config;
 
+#define CONFIG_RELOAD_SERIAL	0x1	/* serial line to reopen */
+
 extern int config_init(const char *file);
+extern int config_reload(void);
 
 #endif
@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
@@ -22,9 +23,68 @@
 #include "edfinfo.h"
 #include "frame.h"
 #include "stats.h"
+#include "backend.h"
+#include "hist.h"
+#include "net.h"
+#include "energy.h"
+#include "power.h"
+#include "loadcurve.h"
+#include "phase.h"
+#include "rule.h"
+#include "cost.h"
 #include "control.h"
 
+/* text requests and responses */
+#define CONTROL_TEXT_SIZE	4096
+
 int control_fd = -1;
+int control_unix_fd = -1;
+
+/*
+ * Client address. Requests are received on the UDP or the Unix
+ * socket and responses are sent back on the same socket.
+ */
+struct control_peer {
+	int			sd;
+	struct sockaddr_storage	addr;
+	socklen_t		addrlen;
+};
+
+static const char *peer_name(const struct control_peer *peer)
+{
+	static char name[128];
+	const struct sockaddr_in *sin = (const void *)&peer->addr;
+	const struct sockaddr_un *sun = (const void *)&peer->addr;
+
+	switch (peer->addr.ss_family) {
+	case AF_INET:
+		snprintf(name, sizeof(name), "%s:%d",
+			 inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
+		break;
+	case AF_UNIX:
+		/* autobound clients have an abstract name */
+		if (peer->addrlen <= sizeof(sa_family_t))
+			snprintf(name, sizeof(name), "unix:<unnamed>");
+		else if (!sun->sun_path[0])
+			snprintf(name, sizeof(name), "unix:@%.*s",
+				 (int)(peer->addrlen - sizeof(sa_family_t) - 1),
+				 sun->sun_path + 1);
+		else
+			snprintf(name, sizeof(name), "unix:%s", sun->sun_path);
+		break;
+	default:
+		snprintf(name, sizeof(name), "?");
+		break;
+	}
+	return name;
+}
+
+static int peer_send(const struct control_peer *peer, const void *buffer,
+		     size_t len, int flags)
+{
+	return sendto(peer->sd, buffer, len, flags,
+		      (const struct sockaddr *)&peer->addr, peer->addrlen);
+}
 
 struct command;
 
@@ -42,6 +102,16 @@ static int handle_stats(char *buffer, size_t len, void *data);
 static int handle_average(char *buffer, size_t len, void *data);
 static int handle_energy(char *buffer, size_t len, void *data);
 static int handle_priority(char *buffer, size_t len, void *data);
+static int handle_power(char *buffer, size_t len, void *data);
+static int handle_loadcurve(char *buffer, size_t len, void *data);
+static int handle_phases(char *buffer, size_t len, void *data);
+static int handle_rules(char *buffer, size_t len, void *data);
+static int handle_cost(char *buffer, size_t len, void *data);
+static int handle_latency(char *buffer, size_t len, void *data);
+static int handle_sources(char *buffer, size_t len, void *data);
+static int handle_sub(char *buffer, size_t len, void *data);
+static int handle_hist(char *buffer, size_t len, void *data);
+static int handle_unsub(char *buffer, size_t len, void *data);
 
 static const struct command commands[] = {
 	{ "help",	handle_help,	 "this message"			},
@@ -50,8 +120,25 @@ static const struct command commands[] = {
 	{ "average",	handle_average,
 	  "power averages over the last 1/5/30 minutes"			},
 	{ "energy",	handle_energy,
-	  "energy consumption over the last days and hours"		},
+	  "energy consumption : energy [minute|hour|day|month] [COUNT]"	},
 	{ "priority",	handle_priority, "change the logging priority"  },
+	{ "loadcurve",	handle_loadcurve,
+	  "load curve intervals : loadcurve [COUNT]"			},
+	{ "phases",	handle_phases,
+	  "current per phase and imbalance of three phases meters"	},
+	{ "rules",	handle_rules,	 "event rules and their state"	},
+	{ "cost",	handle_cost,
+	  "cost of the current day and month per tariff"		},
+	{ "power",	handle_power,
+	  "power min/max per window and quantiles per hour"		},
+	{ "latency",	handle_latency,
+	  "latencies from ETX reception (last/min/avg/max)"		},
+	{ "sources",	handle_sources,	 "network sources"		},
+	{ "sub",	handle_sub,
+	  "receive new frames : sub [SECS] [LABEL]..."			},
+	{ "unsub",	handle_unsub,	 "cancel subscription"		},
+	{ "hist",	handle_hist,
+	  "processing time per stage : hist [reset]"			},
 
 	{ NULL,		NULL,		 NULL }
 };
@@ -108,7 +195,53 @@ static int handle_average(char *buffer, size_t len, void *data __unused)
 
 static int handle_energy(char *buffer, size_t len, void *data __unused)
 {
-	return energy_print(buffer, len);
+	char res_name[16];
+	unsigned int count = 0;
+	int res;
+	int n;
+
+	switch (sscanf(buffer, "energy %15s %u", res_name, &count)) {
+	case 1:
+	case 2:
+		res = energy_resolution_lookup(res_name);
+		if (res < 0)
+			return snprintf(buffer, len, "unknown resolution '%s'\n",
+					res_name);
+		return energy_print(res, count, buffer, len);
+	default:
+		n = energy_print(ENERGY_HOUR, 24, buffer, len);
+		if ((size_t)n < len - 1)
+			n += energy_print(ENERGY_DAY, 7, buffer + n, len - n);
+		return n;
+	}
+}
+
+static int handle_loadcurve(char *buffer, size_t len, void *data __unused)
+{
+	unsigned int count = 0;
+
+	sscanf(buffer, "loadcurve %u", &count);
+	return loadcurve_print(count, buffer, len);
+}
+
+static int handle_phases(char *buffer, size_t len, void *data __unused)
+{
+	return phase_print(buffer, len);
+}
+
+static int handle_rules(char *buffer, size_t len, void *data __unused)
+{
+	return rule_print(buffer, len);
+}
+
+static int handle_cost(char *buffer, size_t len, void *data __unused)
+{
+	return cost_print(buffer, len);
+}
+
+static int handle_power(char *buffer, size_t len, void *data __unused)
+{
+	return power_print(buffer, len);
 }
 
 static int handle_priority(char *buffer, size_t len, void *data __unused)
@@ -124,6 +257,210 @@ static int handle_priority(char *buffer, size_t len, void *data __unused)
 			log_priority_to_name(config.logpriority));
 }
 
+static int handle_latency(char *buffer, size_t len, void *data __unused)
+{
+	int n;
+
+	n = snprintf(buffer, len, "mode            : %s\n",
+		     config.serial_lowlatency ? "low latency" : "default");
+	n += latency_print("serial wakeup", &stats.serial_wakeup,
+			   buffer + n, len - n);
+	n += latency_print("frame decode", &stats.frame_decode,
+			   buffer + n, len - n);
+	n += backend_print_latency(buffer + n, len - n);
+	return n;
+}
+
+static int handle_sources(char *buffer, size_t len, void *data __unused)
+{
+	if (!net_count())
+		return snprintf(buffer, len, "no network sources\n");
+
+	return net_print(buffer, len);
+}
+
+static int handle_hist(char *buffer, size_t len, void *data __unused)
+{
+	if (!strncmp(buffer, "hist reset", 10)) {
+		hist_reset_all();
+		return snprintf(buffer, len, "histograms reset\n");
+	}
+
+	return hist_print_all(buffer, len);
+}
+
+/*
+ * Subscriptions. Clients are leased for a few seconds and new frames
+ * are pushed to them until the lease expires, then "EOS" is sent.
+ */
+#define SUBSCRIBERS_MAX		16
+#define SUBSCRIBERS_RENDER_MAX	4 /* distinct label selections per frame */
+
+static struct subscriber {
+	struct control_peer	peer;
+	unsigned long long	expires; /* usecs */
+	unsigned long long	mask;	 /* frame infos, 0 means all */
+	int			active;
+} subscribers[SUBSCRIBERS_MAX];
+
+static struct subscriber *subscriber_get(const struct control_peer *peer)
+{
+	struct subscriber *free_sub = NULL;
+	unsigned int i;
+
+	for (i = 0; i < SUBSCRIBERS_MAX; i++) {
+		struct subscriber *sub = &subscribers[i];
+
+		if (!sub->active) {
+			if (!free_sub)
+				free_sub = sub;
+			continue;
+		}
+
+		if (sub->peer.sd == peer->sd &&
+		    sub->peer.addrlen == peer->addrlen &&
+		    !memcmp(&sub->peer.addr, &peer->addr, peer->addrlen))
+			return sub;
+	}
+	return free_sub;
+}
+
+static void subscriber_send(struct subscriber *sub, const char *buffer,
+			    size_t len)
+{
+	if (peer_send(&sub->peer, buffer, len, MSG_DONTWAIT) < 0) {
+		INFO("sendto(%s) failed: %s", peer_name(&sub->peer),
+		     strerror(errno));
+		stats.control_send_errors++;
+		return;
+	}
+	stats.control_pushed++;
+}
+
+static void subscriber_del(struct subscriber *sub)
+{
+	subscriber_send(sub, "EOS\n", 4);
+	sub->active = 0;
+	stats.control_subscribers--;
+}
+
+static int handle_sub(char *buffer, size_t len, void *data)
+{
+	struct control_peer *peer = data;
+	struct subscriber *sub;
+	unsigned long long mask = 0;
+	int lease = config.control_lease;
+	char *saveptr;
+	char *token;
+
+	strtok_r(buffer, " \n", &saveptr);
+	while ((token = strtok_r(NULL, " \n", &saveptr))) {
+		int index;
+
+		if (*token >= '0' && *token <= '9') {
+			lease = atoi(token);
+			if (lease > config.control_lease)
+				lease = config.control_lease;
+			continue;
+		}
+
+		index = frame_info_lookup(token);
+		if (index < 0)
+			return snprintf(buffer, len, "unknown label '%s'\n",
+					token);
+		mask |= 1ULL << index;
+	}
+
+	/* autobound Unix clients can not be reached */
+	if (peer->addrlen <= sizeof(sa_family_t))
+		return snprintf(buffer, len, "unnamed peer\n");
+
+	sub = subscriber_get(peer);
+	if (!sub)
+		return snprintf(buffer, len, "too many subscribers\n");
+
+	if (!sub->active) {
+		sub->peer = *peer;
+		sub->active = 1;
+		stats.control_subscribers++;
+		INFO("new subscriber %s", peer_name(peer));
+	}
+	sub->mask = mask;
+	sub->expires = clock_usecs() + (unsigned long long)lease *
+		USEC_PER_SEC;
+
+	return snprintf(buffer, len, "subscribed for %d seconds\n", lease);
+}
+
+static int handle_unsub(char *buffer, size_t len, void *data)
+{
+	struct subscriber *sub = subscriber_get(data);
+
+	if (!sub || !sub->active)
+		return snprintf(buffer, len, "not subscribed\n");
+
+	sub->active = 0;
+	stats.control_subscribers--;
+	return snprintf(buffer, len, "EOS\n");
+}
+
+void control_expire(void)
+{
+	unsigned long long now = clock_usecs();
+	unsigned int i;
+
+	for (i = 0; i < SUBSCRIBERS_MAX; i++) {
+		if (subscribers[i].active && subscribers[i].expires <= now)
+			subscriber_del(&subscribers[i]);
+	}
+}
+
+/*
+ * Frames are rendered once for all subscribers sharing the same
+ * selection of labels.
+ */
+void control_publish(const struct frame *frame)
+{
+	static struct {
+		unsigned long long mask;
+		int		len;
+		char		buffer[MAX_FRAME_LENGTH * 2];
+	} renders[SUBSCRIBERS_RENDER_MAX];
+	unsigned int nrenders = 0;
+	unsigned int i, j;
+
+	control_expire();
+
+	for (i = 0; i < SUBSCRIBERS_MAX; i++) {
+		struct subscriber *sub = &subscribers[i];
+
+		if (!sub->active)
+			continue;
+
+		for (j = 0; j < nrenders; j++)
+			if (renders[j].mask == sub->mask)
+				break;
+
+		if (j == nrenders) {
+			/* recycle the last render if too many selections */
+			if (nrenders < SUBSCRIBERS_RENDER_MAX)
+				nrenders++;
+			else
+				j = nrenders - 1;
+
+			renders[j].mask = sub->mask;
+			renders[j].len = sub->mask ?
+				frame_print_mask(frame, sub->mask,
+						 renders[j].buffer,
+						 sizeof(renders[j].buffer)) :
+				frame_print(frame, renders[j].buffer,
+					    sizeof(renders[j].buffer));
+		}
+
+		subscriber_send(sub, renders[j].buffer, renders[j].len);
+	}
+}
+
 int control_open(void)
 {
 	int sd;
@@ -152,40 +489,407 @@ int control_open(void)
 	return sd;
 }
 
+int control_open_unix(const char *path)
+{
+	int sd;
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		ERROR("unix socket path is too long: %s", path);
+		return -1;
+	}
+
+	sd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		ERROR("socket() failed: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	unlink(path);
+	if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		ERROR("bind(%s) failed : %s", path, strerror(errno));
+		close(sd);
+		return -1;
+	}
+
+	control_unix_fd = sd;
+	NOTICE("listening on unix socket '%s'", path);
+	return sd;
+}
+
+static int control_text(char *buffer, size_t len, struct control_peer *peer)
+{
+	const struct command *cmd;
+	int n;
+
+	cmd = command_get(buffer);
+	if (!cmd)
+		return snprintf(buffer, len, "unknown command\n");
+
+	n = cmd->handler(buffer, len, peer);
+	if (n == -1)
+		n = snprintf(buffer, len, "command '%s' failed\n", cmd->key);
+
+	return (size_t)n < len ? n : (int)len - 1;
+}
+
+/*
+ * Binary protocol
+ */
+struct tlv_buffer {
+	uint8_t	*data;
+	size_t	len;
+	size_t	size;
+	int	overflow;
+	int	dropped;	/* the incomplete TLV was removed */
+};
+
+/*
+ * Once the buffer overflows, nothing more is added and the TLV being
+ * built is removed, so that the response stays well formed
+ */
+static struct control_tlv *tlv_start(struct tlv_buffer *b, uint16_t type)
+{
+	struct control_tlv *tlv = (void *)(b->data + b->len);
+
+	if (b->overflow)
+		return NULL;
+
+	if (b->len + sizeof(*tlv) > b->size) {
+		b->overflow = 1;
+		b->dropped = 1;
+		return NULL;
+	}
+
+	tlv->type = htons(type);
+	tlv->len = 0;
+	b->len += sizeof(*tlv);
+	return tlv;
+}
+
+static void tlv_end(struct tlv_buffer *b, struct control_tlv *tlv)
+{
+	size_t len;
+
+	if (!tlv)
+		return;
+
+	len = b->data + b->len - tlv->value;
+	if (len > UINT16_MAX)
+		b->overflow = 1;
+
+	/* innermost open TLV, the one which overflowed */
+	if (b->overflow && !b->dropped) {
+		b->len = (uint8_t *)tlv - b->data;
+		b->dropped = 1;
+		return;
+	}
+
+	tlv->len = htons(len);
+}
+
+static void tlv_put(struct tlv_buffer *b, const void *data, size_t len)
+{
+	if (b->overflow)
+		return;
+
+	if (b->len + len > b->size) {
+		b->overflow = 1;
+		return;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void tlv_put_u8(struct tlv_buffer *b, uint8_t v)
+{
+	tlv_put(b, &v, sizeof(v));
+}
+
+static void tlv_put_u32(struct tlv_buffer *b, uint32_t v)
+{
+	v = htonl(v);
+	tlv_put(b, &v, sizeof(v));
+}
+
+static void tlv_put_u64(struct tlv_buffer *b, uint64_t v)
+{
+	tlv_put_u32(b, v >> 32);
+	tlv_put_u32(b, v & 0xffffffff);
+}
+
+static void tlv_add(struct tlv_buffer *b, uint16_t type, const void *data,
+		    size_t len)
+{
+	struct control_tlv *tlv = tlv_start(b, type);
+
+	tlv_put(b, data, len);
+	tlv_end(b, tlv);
+}
+
+static void bin_stat(const char *name, unsigned long long value, void *data)
+{
+	struct tlv_buffer *b = data;
+	struct control_tlv *tlv = tlv_start(b, CONTROL_T_STAT);
+
+	tlv_put_u64(b, value);
+	tlv_put(b, name, strlen(name));
+	tlv_end(b, tlv);
+}
+
+static void bin_last(struct tlv_buffer *b)
+{
+	struct frame *top = frame_stack_top();
+	struct control_tlv *tlv;
+	unsigned int i;
+
+	if (!top)
+		return;
+
+	tlv = tlv_start(b, CONTROL_T_TIMESTAMP);
+	tlv_put_u64(b, top->timestamp);
+	tlv_end(b, tlv);
+
+	tlv = tlv_start(b, CONTROL_T_POWER);
+	tlv_put_u32(b, top->power);
+	tlv_end(b, tlv);
+
+	for (i = 0; i < top->ninfos; i++) {
+		tlv = tlv_start(b, CONTROL_T_FIELD);
+		tlv_put_u8(b, top->infos[i]->index);
+		tlv_put(b, top->infos[i]->value,
+			strlen(top->infos[i]->value));
+		tlv_end(b, tlv);
+	}
+}
+
+static void bin_average(struct tlv_buffer *b)
+{
+	static const int windows[] = { 1 * 60, 5 * 60, 30 * 60 };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+		struct control_tlv *tlv = tlv_start(b, CONTROL_T_AVG);
+
+		tlv_put_u32(b, windows[i]);
+		tlv_put_u32(b, frame_stack_average(windows[i]));
+		tlv_end(b, tlv);
+	}
+}
+
+static void bin_hist(const struct hist *h, void *data)
+{
+	struct tlv_buffer *b = data;
+	struct control_tlv *tlv = tlv_start(b, CONTROL_T_HISTOGRAM);
+
+	tlv_put_u64(b, h->count);
+	tlv_put_u64(b, hist_quantile(h, 0.50));
+	tlv_put_u64(b, hist_quantile(h, 0.90));
+	tlv_put_u64(b, hist_quantile(h, 0.99));
+	tlv_put_u64(b, h->max);
+	tlv_put(b, h->name, strlen(h->name));
+	tlv_end(b, tlv);
+}
+
+static void bin_energy_slot(const struct energy_slot *slot, uint32_t used,
+			    void *data)
+{
+	struct tlv_buffer *b = data;
+	struct control_tlv *tlv = tlv_start(b, CONTROL_T_ENERGY_SLOT);
+	unsigned int i;
+
+	tlv_put_u64(b, slot->start);
+	for (i = 0; i < ENERGY_TARIFF_MAX; i++) {
+		if (!(used & (1 << i)))
+			continue;
+
+		tlv_put_u8(b, energy_tariff_index(i));
+		tlv_put_u32(b, slot->wh[i]);
+	}
+	tlv_end(b, tlv);
+}
+
+static void bin_energy(struct tlv_buffer *b, const uint8_t *value, size_t len)
+{
+	uint32_t count = 0;
+
+	if (len < 1 || value[0] >= ENERGY_RESOLUTION_MAX) {
+		tlv_add(b, CONTROL_T_ERROR, "bad resolution", 14);
+		return;
+	}
+
+	if (len >= 5) {
+		memcpy(&count, value + 1, sizeof(count));
+		count = ntohl(count);
+	}
+
+	energy_foreach(value[0], count, bin_energy_slot, b);
+}
+
+static void bin_text(struct tlv_buffer *b, const uint8_t *value, size_t len,
+		     struct control_peer *peer)
+{
+	static char text[CONTROL_TEXT_SIZE];
+	int n;
+
+	if (len >= sizeof(text))
+		len = sizeof(text) - 1;
+	memcpy(text, value, len);
+	text[len] = '\0';
+
+	n = control_text(text, sizeof(text), peer);
+	tlv_put(b, text, n);
+}
+
+static void control_bin_command(struct tlv_buffer *b, uint16_t type,
+				const uint8_t *value, size_t len,
+				struct control_peer *peer)
+{
+	struct control_tlv *tlv = tlv_start(b, type);
+
+	switch (type) {
+	case CONTROL_T_STATS:
+		stats_export(&stats, bin_stat, b);
+		break;
+	case CONTROL_T_LAST:
+		bin_last(b);
+		break;
+	case CONTROL_T_AVERAGE:
+		bin_average(b);
+		break;
+	case CONTROL_T_TEXT:
+		bin_text(b, value, len, peer);
+		break;
+	case CONTROL_T_HIST:
+		hist_foreach(bin_hist, b);
+		break;
+	case CONTROL_T_ENERGY:
+		bin_energy(b, value, len);
+		break;
+	default:
+		tlv_add(b, CONTROL_T_ERROR, "unknown command", 15);
+		break;
+	}
+
+	tlv_end(b, tlv);
+}
+
+/*
+ * Parse the commands of a request and build the response payload.
+ * Returns -1 if the request is malformed.
+ */
+static int control_bin(const uint8_t *req, size_t reqlen,
+		       struct tlv_buffer *b, struct control_peer *peer)
+{
+	const struct control_hdr *hdr = (const void *)req;
+	size_t len;
+	size_t off;
+
+	if (reqlen < sizeof(*hdr) || hdr->version != CONTROL_VERSION)
+		return -1;
+
+	len = ntohs(hdr->len);
+	if (len > reqlen - sizeof(*hdr))
+		return -1;
+
+	for (off = sizeof(*hdr); off + sizeof(struct control_tlv) <=
+		     sizeof(*hdr) + len;) {
+		const struct control_tlv *tlv = (const void *)(req + off);
+		size_t vlen = ntohs(tlv->len);
+
+		off += sizeof(*tlv);
+		if (off + vlen > sizeof(*hdr) + len)
+			return -1;
+
+		control_bin_command(b, ntohs(tlv->type), tlv->value, vlen,
+				    peer);
+		off += vlen;
+	}
+
+	return 0;
+}
+
+static int control_bin_send(struct control_peer *peer, uint16_t seq,
+			    uint8_t flags, const uint8_t *data, size_t len)
+{
+	uint8_t dgram[sizeof(struct control_hdr) + CONTROL_DGRAM_SIZE];
+	struct control_hdr *hdr = (void *)dgram;
+	unsigned int frag = 0;
+	size_t off = 0;
+
+	do {
+		size_t n = len - off;
+
+		if (n > CONTROL_DGRAM_SIZE)
+			n = CONTROL_DGRAM_SIZE;
+
+		hdr->magic = CONTROL_MAGIC;
+		hdr->version = CONTROL_VERSION;
+		hdr->flags = flags | (off + n < len ? CONTROL_F_MORE : 0);
+		hdr->frag = frag++;
+		hdr->seq = seq;
+		hdr->len = htons(n);
+		memcpy(dgram + sizeof(*hdr), data + off, n);
+
+		if (peer_send(peer, dgram, sizeof(*hdr) + n, 0) < 0) {
+			ERROR("sendto(%s) failed: %s", peer_name(peer),
+			      strerror(errno));
+			return -1;
+		}
+		off += n;
+	} while (off < len && frag <= UINT8_MAX);
+
+	return 0;
+}
+
 int control_read(int sd)
 {
+	static uint8_t response[CONTROL_RESPONSE_SIZE];
+	struct tlv_buffer b = {
+		.data = response, .size = sizeof(response),
+	};
+	struct control_peer peer = {
+		.sd = sd, .addrlen = sizeof(peer.addr),
+	};
+	static char buffer[CONTROL_TEXT_SIZE];
+	uint8_t flags = 0;
 	int ret;
-	struct sockaddr_in addr;
-	socklen_t addrlen = sizeof(addr);
-	char buffer[1024];
-	int n = 0;
-	const struct command *cmd = commands;
+	int n;
 
 	memset(buffer, 0, sizeof(buffer));
 
-	ret = recvfrom(sd, &buffer, sizeof(buffer), 0,
-		       (struct sockaddr *)&addr, &addrlen);
+	ret = recvfrom(sd, &buffer, sizeof(buffer) - 1, 0,
+		       (struct sockaddr *)&peer.addr, &peer.addrlen);
 	if (ret < 0) {
 		ERROR("recvfrom() failed: %s", strerror(errno));
 		return -1;
 	}
 
-	INFO("received %d bytes from %s:%d", ret, inet_ntoa(addr.sin_addr),
-	     ntohs(addr.sin_port));
+	INFO("received %d bytes from %s", ret, peer_name(&peer));
 
-	cmd = command_get(buffer);
-	if (!cmd)
-		n = snprintf(buffer, sizeof(buffer), "unknown command\n");
-	else
-		n = cmd->handler(buffer, sizeof(buffer), &addr);
+	if ((uint8_t)buffer[0] == CONTROL_MAGIC) {
+		stats.control_bin_requests++;
+		if (control_bin((uint8_t *)buffer, ret, &b, &peer))
+			flags |= CONTROL_F_ERROR;
+		if (b.overflow) {
+			WARN("binary response truncated to %zd bytes", b.len);
+			flags |= CONTROL_F_TRUNCATED;
+		}
 
-	if (n == -1)
-		n = snprintf(buffer, sizeof(buffer), "command '%s' failed\n",
-			     cmd->key);
+		return control_bin_send(&peer,
+					((struct control_hdr *)buffer)->seq,
+					flags, response, b.len);
+	}
 
-	ret = sendto(sd, buffer, n, 0, (struct sockaddr *)&addr, addrlen);
+	n = control_text(buffer, sizeof(buffer), &peer);
+
+	ret = peer_send(&peer, buffer, n, 0);
 	if (ret < 0) {
-		ERROR("sendto(%s) failed: %s", inet_ntoa(addr.sin_addr),
+		ERROR("sendto(%s) failed: %s", peer_name(&peer),
 		      strerror(errno));
 		return -1;
 	}
@@ -195,6 +899,18 @@ int control_read(int sd)
 
 int control_close(int sd)
 {
-	control_fd = -1;
+	unsigned int i;
+
+	for (i = 0; i < SUBSCRIBERS_MAX; i++) {
+		if (subscribers[i].active && subscribers[i].peer.sd == sd)
+			subscriber_del(&subscribers[i]);
+	}
+
+	if (sd == control_unix_fd) {
+		control_unix_fd = -1;
+		unlink(config.control_unix);
+	} else {
+		control_fd = -1;
+	}
 	return close(sd);
 }
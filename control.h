@@ -11,10 +11,84 @@
 #ifndef EDFINFO_CTL_H
 #define EDFINFO_CTL_H
 
+#include <stdint.h>
+#include <sys/socket.h>
+
+struct frame;
+
+/*
+ * Binary control protocol
+ *
+ * Requests and responses start with a header followed by a list of
+ * TLVs, all in network byte order. A request can batch several
+ * command TLVs and the response contains one TLV of the same type
+ * per command, in the same order, which value is a list of TLVs.
+ *
+ * Responses larger than a datagram are split in fragments carrying
+ * the same sequence number. The payloads of the fragments, in
+ * increasing 'frag' order, should be concatenated until a fragment
+ * without CONTROL_F_MORE is received.
+ *
+ * A response which does not fit in CONTROL_RESPONSE_SIZE ends with
+ * the last complete TLV and is flagged CONTROL_F_TRUNCATED.
+ */
+#define CONTROL_MAGIC		0xED	/* not ASCII, text commands are */
+#define CONTROL_VERSION		1
+
+#define CONTROL_F_MORE		0x01	/* more fragments follow */
+#define CONTROL_F_ERROR		0x02	/* bad request */
+#define CONTROL_F_TRUNCATED	0x04	/* response too large */
+
+struct control_hdr {
+	uint8_t		magic;
+	uint8_t		version;
+	uint8_t		flags;
+	uint8_t		frag;
+	uint16_t	seq;	/* chosen by the client, echoed */
+	uint16_t	len;	/* payload length of this datagram */
+} __attribute__((packed));
+
+struct control_tlv {
+	uint16_t	type;
+	uint16_t	len;	/* value length */
+	uint8_t		value[];
+} __attribute__((packed));
+
+enum control_tlv_type {
+	/* commands */
+	CONTROL_T_STATS = 1,	/* CONTROL_T_STAT list */
+	CONTROL_T_LAST,		/* CONTROL_T_TIMESTAMP, _POWER, _FIELD list */
+	CONTROL_T_AVERAGE,	/* CONTROL_T_AVG list */
+	CONTROL_T_TEXT,		/* text command -> text response */
+	CONTROL_T_HIST,		/* CONTROL_T_HISTOGRAM list */
+	CONTROL_T_ENERGY,	/* u8 resolution, [u32 count] ->
+				 * CONTROL_T_ENERGY_SLOT list, oldest first */
+
+	/* response values */
+	CONTROL_T_STAT = 64,	/* u64 value, name */
+	CONTROL_T_TIMESTAMP,	/* u64 seconds since epoch */
+	CONTROL_T_POWER,	/* u32 Watt */
+	CONTROL_T_FIELD,	/* u8 frame info index, value */
+	CONTROL_T_AVG,		/* u32 window seconds, u32 Watt */
+	CONTROL_T_ERROR,	/* error message */
+	CONTROL_T_HISTOGRAM,	/* u64 count, p50, p90, p99, max (ns), name */
+	CONTROL_T_ENERGY_SLOT,	/* u64 period start, then for each tariff,
+				 * u8 frame info index, u32 Wh */
+};
+
+/* payload of a datagram */
+#define CONTROL_DGRAM_SIZE	1400
+/* largest response, all fragments */
+#define CONTROL_RESPONSE_SIZE	(64 * 1024)
+
 extern int control_fd;
+extern int control_unix_fd;
 
 int control_open(void);
+int control_open_unix(const char *path);
 int control_read(int sd);
 int control_close(int sd);
+void control_publish(const struct frame *frame);
+void control_expire(void);
 
 #endif
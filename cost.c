@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "edfinfo.h"
+#include "frame.h"
+#include "energy.h"
+#include "cost.h"
+
+/*
+ * Prices per kWh in 1/100000 of the currency. A Wh then costs the
+ * price in 1/COST_UNIT.
+ */
+#define COST_PRICE_UNIT		100000
+
+static unsigned long prices[ENERGY_TARIFF_MAX];
+static unsigned int tariffs;	/* bitmap of the priced tariffs */
+
+static const enum energy_resolution resolutions[COST_PERIOD_MAX] = {
+	[COST_DAY]	= ENERGY_DAY,
+	[COST_MONTH]	= ENERGY_MONTH,
+};
+
+static const char *period_names[COST_PERIOD_MAX] = {
+	[COST_DAY]	= "day",
+	[COST_MONTH]	= "month",
+};
+
+/*
+ * The consumption of the current energy slot already accounted and
+ * its cost. Only the new Wh are priced on each frame, so a price
+ * change applies to the consumption which follows it.
+ */
+static struct cost {
+	int64_t			start;
+	uint32_t		wh[ENERGY_TARIFF_MAX];
+	unsigned long long	cost[ENERGY_TARIFF_MAX];
+} costs[COST_PERIOD_MAX];
+
+static int current_tariff = -1;
+
+/*
+ * <TARIFF> = <price per kWh>, TARIFF being TH, HC, HP, HN, PM, HCJB,
+ * HPJB, HCJW, HPJW, HCJR or HPJR
+ */
+int cost_configure(const char *name, const char *value)
+{
+	int tariff = energy_tariff_lookup(name);
+	char *end;
+	double price;
+
+	if (tariff < 0) {
+		fprintf(stderr, "unknown config name cost/%s\n", name);
+		return 0;
+	}
+
+	price = strtod(value, &end);
+	if (*end || end == value || price < 0) {
+		fprintf(stderr, "invalid price '%s' for tariff %s\n", value,
+			name);
+		return 0;
+	}
+
+	prices[tariff] = price * COST_PRICE_UNIT + 0.5;
+	tariffs |= 1 << tariff;
+	return 1;
+}
+
+int cost_enabled(void)
+{
+	return tariffs != 0;
+}
+
+static void cost_period_update(struct cost *c, const struct energy_slot *slot)
+{
+	unsigned int i;
+
+	/* new period or startup, the whole slot is priced */
+	if (c->start != slot->start) {
+		memset(c, 0, sizeof(*c));
+		c->start = slot->start;
+	}
+
+	for (i = 0; i < ENERGY_TARIFF_MAX; i++) {
+		if (slot->wh[i] == c->wh[i])
+			continue;
+
+		if (slot->wh[i] > c->wh[i])
+			c->cost[i] += (unsigned long long)
+				(slot->wh[i] - c->wh[i]) * prices[i];
+		c->wh[i] = slot->wh[i];
+	}
+}
+
+/*
+ * Called after energy_update()
+ */
+void cost_update(const struct frame *frame)
+{
+	unsigned int i;
+
+	if (!tariffs)
+		return;
+
+	for (i = 0; i < frame->ninfos; i++) {
+		if (frame->infos[i]->index == FRAME_INFO_PTEC) {
+			current_tariff = energy_tariff_ptec(frame->infos[i]->value);
+			break;
+		}
+	}
+
+	for (i = 0; i < COST_PERIOD_MAX; i++) {
+		const struct energy_slot *slot = energy_current(resolutions[i]);
+
+		if (slot)
+			cost_period_update(&costs[i], slot);
+	}
+}
+
+unsigned long long cost_total(enum cost_period period)
+{
+	unsigned long long total = 0;
+	unsigned int i;
+
+	for (i = 0; i < ENERGY_TARIFF_MAX; i++)
+		total += costs[period].cost[i];
+	return total;
+}
+
+static double cost_value(unsigned long long cost)
+{
+	return (double)cost / COST_UNIT;
+}
+
+int cost_print(char *buffer, size_t len)
+{
+	unsigned int i, p;
+	int n;
+
+	if (!tariffs)
+		return snprintf(buffer, len, "no prices configured\n");
+
+	n = snprintf(buffer, len, "%-8s %-10s", "tariff", "price");
+	for (p = 0; p < COST_PERIOD_MAX && (size_t)n < len; p++)
+		n += snprintf(buffer + n, len - n, " %10s", period_names[p]);
+	if ((size_t)n < len)
+		n += snprintf(buffer + n, len - n, "\n");
+
+	for (i = 0; i < ENERGY_TARIFF_MAX && (size_t)n < len; i++) {
+		if (!(tariffs & (1 << i)))
+			continue;
+
+		n += snprintf(buffer + n, len - n, "%-8s %-10.5f",
+			      energy_tariff_name(i),
+			      (double)prices[i] / COST_PRICE_UNIT);
+		for (p = 0; p < COST_PERIOD_MAX && (size_t)n < len; p++)
+			n += snprintf(buffer + n, len - n, " %10.2f",
+				      cost_value(costs[p].cost[i]));
+		if ((size_t)n < len)
+			n += snprintf(buffer + n, len - n, "%s\n",
+				      (int)i == current_tariff ? " *" : "");
+	}
+
+	if ((size_t)n < len)
+		n += snprintf(buffer + n, len - n, "%-8s %-10s", "total", "");
+	for (p = 0; p < COST_PERIOD_MAX && (size_t)n < len; p++)
+		n += snprintf(buffer + n, len - n, " %10.2f",
+			      cost_value(cost_total(p)));
+	if ((size_t)n < len)
+		n += snprintf(buffer + n, len - n, "\n");
+
+	return (size_t)n < len ? n : (int)len - 1;
+}
@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef EDFINFO_COST_H
+#define EDFINFO_COST_H
+
+#include <stddef.h>
+
+struct frame;
+
+/*
+ * Running cost of the current day and month, from the consumption
+ * of each tariff period and a price per kWh. Costs are in units of
+ * COST_UNIT.
+ */
+#define COST_UNIT	100000000ULL
+
+enum cost_period {
+	COST_DAY,
+	COST_MONTH,
+
+	COST_PERIOD_MAX
+};
+
+extern int cost_configure(const char *name, const char *value);
+extern int cost_enabled(void);
+extern void cost_update(const struct frame *frame);
+extern unsigned long long cost_total(enum cost_period period);
+extern int cost_print(char *buffer, size_t len);
+
+#endif
@@ -0,0 +1,354 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "edfinfo.h"
+#include "frame.h"
+#include "serial.h"
+#include "stats.h"
+#include "scan.h"
+#include "decode.h"
+
+/*
+ * The capture is mapped and split in chunks starting on a STX, so
+ * that no frame straddles two chunks. The workers pick the next chunk
+ * to decode and the caller merges the decoded chunks in order. The
+ * number of chunks in flight is bounded to limit the memory used by
+ * the decoded frames.
+ */
+#define DECODE_CHUNK_SIZE	(1 << 20)
+#define DECODE_INFLIGHT		4	/* chunks per worker */
+#define DECODE_JOBS_MAX		64
+
+struct decode_entry {
+	const char	*raw;	/* in the mapping */
+	size_t		len;
+	struct frame	*frame;	/* NULL if invalid */
+};
+
+struct decode_chunk {
+	const char		*start;
+	size_t			len;
+	struct decode_entry	*entries;
+	unsigned int		count;
+	unsigned int		size;
+	int			done;
+};
+
+/* last frame of the previous buffer, to filter duplicates */
+static char last[MAX_FRAME_LENGTH];
+static size_t last_len;
+
+struct decode_pool {
+	struct decode_chunk	*chunks;
+	unsigned int		nchunks;
+	unsigned int		next;		/* next chunk to decode */
+	unsigned int		merged;		/* chunks merged */
+	unsigned int		inflight;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+};
+
+static int decode_entry_add(struct decode_chunk *c, const char *raw,
+			    size_t len, struct decode_entry *prev)
+{
+	struct decode_entry *e;
+
+	if (c->count == c->size) {
+		unsigned int size = c->size ? 2 * c->size : 1024;
+
+		e = realloc(c->entries, size * sizeof(*e));
+		if (!e) {
+			ERROR("could not allocate frames : %s",
+			      strerror(errno));
+			return -1;
+		}
+		c->entries = e;
+		c->size = size;
+	}
+
+	e = &c->entries[c->count++];
+	e->raw = raw;
+	e->len = len;
+	e->frame = NULL;
+
+	/* duplicates are dropped when merging, do not decode them */
+	if (!serial_overload(raw, len)) {
+		if (len == prev->len && !memcmp(raw, prev->raw, len))
+			return 0;
+		*prev = *e;
+	}
+
+	e->frame = frame_new(raw, len);
+	return 0;
+}
+
+/*
+ * Same framing as the serial decoder, in place
+ */
+static void decode_chunk(struct decode_chunk *c)
+{
+	const char *end = c->start + c->len;
+	const char *p = c->start;
+	const char *frame = NULL;
+	struct decode_entry prev = { NULL, 0, NULL };
+
+	while (p < end) {
+		p += scan_ctrl(p, end - p, EOT);
+		if (p == end)
+			break;
+
+		switch (*p) {
+		case STX:
+			frame = p + 1;
+			break;
+		case ETX:
+			if (!frame)
+				break;
+
+			if (p - frame > MAX_FRAME_LENGTH)
+				ERROR("max buffer len reached : %d. "
+				      "dropping frame", MAX_FRAME_LENGTH);
+			else if (decode_entry_add(c, frame, p - frame, &prev))
+				return;
+			frame = NULL;
+			break;
+		case EOT:
+			ERROR("received an interrupt !? dropping frame");
+			frame = NULL;
+			break;
+		default:
+			break;
+		}
+		p++;
+	}
+}
+
+static void *decode_worker(void *arg)
+{
+	struct decode_pool *pool = arg;
+	struct decode_chunk *c;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->next < pool->nchunks &&
+		       pool->next >= pool->merged + pool->inflight)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+
+		if (pool->next == pool->nchunks) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		c = &pool->chunks[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		decode_chunk(c);
+
+		pthread_mutex_lock(&pool->lock);
+		c->done = 1;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Duplicates are filtered as the serial decoder does, also across
+ * chunks. Returns the number of frames handed to @cb.
+ */
+static unsigned int decode_merge(struct decode_chunk *c,
+				 struct decode_entry *prev,
+				 decode_cb_t cb, void *data)
+{
+	unsigned int count = 0;
+	unsigned int i;
+
+	for (i = 0; i < c->count; i++) {
+		struct decode_entry *e = &c->entries[i];
+
+		if (!serial_overload(e->raw, e->len)) {
+			if (e->len == prev->len &&
+			    !memcmp(e->raw, prev->raw, e->len)) {
+				stats.frame_dup++;
+				frame_destroy(e->frame);
+				continue;
+			}
+			*prev = *e;
+		}
+
+		if (!e->frame) {
+			stats.frame_error++;
+			continue;
+		}
+
+		cb(e->frame, data);
+		count++;
+	}
+
+	free(c->entries);
+	c->entries = NULL;
+	return count;
+}
+
+static unsigned int decode_split(struct decode_pool *pool, const char *buffer,
+				 size_t len)
+{
+	unsigned int n = 0;
+	size_t offset = 0;
+
+	pool->chunks = calloc(len / DECODE_CHUNK_SIZE + 1,
+			      sizeof(*pool->chunks));
+	if (!pool->chunks) {
+		ERROR("could not allocate chunks : %s", strerror(errno));
+		return 0;
+	}
+
+	while (offset < len) {
+		size_t end = offset + DECODE_CHUNK_SIZE;
+		const char *stx;
+
+		if (end >= len) {
+			end = len;
+		} else {
+			stx = memchr(buffer + end, STX, len - end);
+			end = stx ? (size_t)(stx - buffer) : len;
+		}
+
+		pool->chunks[n].start = buffer + offset;
+		pool->chunks[n].len = end - offset;
+		n++;
+		offset = end;
+	}
+	return n;
+}
+
+/*
+ * Captures can be decoded in several buffers, which should then be
+ * split on a STX.
+ */
+int decode_buffer(const char *buffer, size_t len, unsigned int jobs,
+		  decode_cb_t cb, void *data)
+{
+	struct decode_pool pool = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct decode_entry prev = { last, last_len, NULL };
+	pthread_t threads[DECODE_JOBS_MAX];
+	unsigned int nthreads = 0;
+	unsigned int count = 0;
+	unsigned int i;
+
+	pool.nchunks = decode_split(&pool, buffer, len);
+	if (!pool.nchunks) {
+		free(pool.chunks);
+		return 0;
+	}
+
+	if (!jobs)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs > DECODE_JOBS_MAX)
+		jobs = DECODE_JOBS_MAX;
+	pool.inflight = jobs * DECODE_INFLIGHT;
+
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&threads[i], NULL, decode_worker, &pool)) {
+			ERROR("could not create decoding thread");
+			break;
+		}
+		nthreads++;
+	}
+
+	DEBUG("decoding %zd bytes : %d chunks, %d threads", len,
+	      pool.nchunks, nthreads);
+
+	for (i = 0; i < pool.nchunks; i++) {
+		struct decode_chunk *c = &pool.chunks[i];
+
+		/* no worker, decode in place */
+		if (!nthreads) {
+			decode_chunk(c);
+			pool.next++;
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		while (!c->done && nthreads)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		count += decode_merge(c, &prev, cb, data);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.merged++;
+		pthread_cond_broadcast(&pool.cond);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (prev.raw != last) {
+		memcpy(last, prev.raw, prev.len);
+		last_len = prev.len;
+	}
+
+	free(pool.chunks);
+	return count;
+}
+
+int decode_file(const char *path, unsigned int jobs, decode_cb_t cb,
+		void *data)
+{
+	struct stat st;
+	char *buffer;
+	int count;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR("could not open '%s' : %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ERROR("could not stat '%s' : %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (!st.st_size) {
+		close(fd);
+		return 0;
+	}
+
+	buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buffer == MAP_FAILED) {
+		ERROR("could not map '%s' : %s", path, strerror(errno));
+		return -1;
+	}
+	madvise(buffer, st.st_size, MADV_SEQUENTIAL);
+
+	NOTICE("decoding '%s' : %ld bytes", path, st.st_size);
+
+	count = decode_buffer(buffer, st.st_size, jobs, cb, data);
+	munmap(buffer, st.st_size);
+	return count;
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef EDFINFO_DECODE_H
+#define EDFINFO_DECODE_H
+
+#include <stddef.h>
+
+struct frame;
+
+/*
+ * Offline decoding of raw captures. Frames are handed to the callback
+ * in the order of the capture, which then owns them.
+ */
+typedef void (*decode_cb_t)(struct frame *frame, void *data);
+
+extern int decode_buffer(const char *buffer, size_t len, unsigned int jobs,
+			 decode_cb_t cb, void *data);
+extern int decode_file(const char *path, unsigned int jobs, decode_cb_t cb,
+		       void *data);
+
+#endif
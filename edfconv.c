@@ -0,0 +1,436 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <lzma.h>
+
+#include "log.h"
+#include "edfinfo.h"
+#include "frame.h"
+#include "serial.h"
+#include "stats.h"
+#include "decode.h"
+
+const char progname[] = "edfconv";
+const char version[]  = VERSION;
+
+/*
+ * Rows are formatted in a large buffer which is written when full. A
+ * row is always smaller than a frame with all its values quoted.
+ */
+#define CONV_BATCH_SIZE		(1 << 20)
+#define CONV_ROW_MAX		(2 * MAX_FRAME_LENGTH)
+
+/* decompressed data decoded at once */
+#define CONV_XZ_SIZE		(64 << 20)
+
+/*
+ * Same types as the mysql table, the others are integers
+ */
+#define BIT(nr)			(1ULL << (nr))
+#define CONV_STRING_MASK	(BIT(FRAME_INFO_ADCO) |		\
+				 BIT(FRAME_INFO_OPTARIF) |	\
+				 BIT(FRAME_INFO_PEJP) |		\
+				 BIT(FRAME_INFO_PTEC) |		\
+				 BIT(FRAME_INFO_DEMAIN) |	\
+				 BIT(FRAME_INFO_HHPHC) |	\
+				 BIT(FRAME_INFO_MOTDETAT))
+
+struct conv {
+	int fd;
+	enum frame_info_index columns[FRAME_INFO_MAX];
+	unsigned int ncolumns;
+	unsigned long long rows;
+	char *buffer;
+	size_t len;
+	int error;
+};
+
+static int conv_flush(struct conv *conv)
+{
+	size_t n = 0;
+
+	while (n < conv->len) {
+		ssize_t ret = write(conv->fd, conv->buffer + n, conv->len - n);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR("write failed : %s", strerror(errno));
+			conv->error = 1;
+			return -1;
+		}
+		n += ret;
+	}
+	conv->len = 0;
+	return 0;
+}
+
+/*
+ * Leading zeros are dropped. Values which are not numbers are left
+ * empty, like missing values.
+ */
+static char *conv_integer(char *p, const char *value)
+{
+	const char *s;
+
+	for (s = value; *s; s++)
+		if (*s < '0' || *s > '9')
+			return p;
+
+	while (value[0] == '0' && value[1])
+		value++;
+	while (*value)
+		*p++ = *value++;
+	return p;
+}
+
+static char *conv_string(char *p, const char *value)
+{
+	if (!strpbrk(value, ",\"")) {
+		while (*value)
+			*p++ = *value++;
+		return p;
+	}
+
+	*p++ = '"';
+	for (; *value; value++) {
+		if (*value == '"')
+			*p++ = '"';
+		*p++ = *value;
+	}
+	*p++ = '"';
+	return p;
+}
+
+static void conv_frame(struct frame *frame, void *data)
+{
+	struct conv *conv = data;
+	const char *values[FRAME_INFO_MAX] = { NULL };
+	char *p;
+	unsigned int i;
+
+	if (conv->error)
+		goto out;
+
+	if (conv->len > CONV_BATCH_SIZE - CONV_ROW_MAX && conv_flush(conv))
+		goto out;
+
+	for (i = 0; i < frame->ninfos; i++)
+		values[frame->infos[i]->index] = frame->infos[i]->value;
+
+	p = conv->buffer + conv->len;
+	p += sprintf(p, "%llu", conv->rows++);
+
+	for (i = 0; i < conv->ncolumns; i++) {
+		enum frame_info_index index = conv->columns[i];
+
+		*p++ = ',';
+		if (!values[index])
+			continue;
+
+		if (CONV_STRING_MASK & BIT(index))
+			p = conv_string(p, values[index]);
+		else
+			p = conv_integer(p, values[index]);
+	}
+	*p++ = '\n';
+	conv->len = p - conv->buffer;
+out:
+	frame_destroy(frame);
+}
+
+static void conv_header(struct conv *conv)
+{
+	unsigned int i;
+	int n;
+
+	n = sprintf(conv->buffer, "frame");
+	for (i = 0; i < conv->ncolumns; i++)
+		n += sprintf(conv->buffer + n, ",%s",
+			     frame_info_label(conv->columns[i]));
+	n += sprintf(conv->buffer + n, "\n");
+	conv->len = n;
+}
+
+static int conv_columns(struct conv *conv, const char *labels)
+{
+	char *str, *token, *saveptr;
+	unsigned long long mask = 0;
+	unsigned int i;
+
+	if (!labels) {
+		for (i = 0; i < FRAME_INFO_MAX; i++)
+			conv->columns[i] = i;
+		conv->ncolumns = FRAME_INFO_MAX;
+		return 0;
+	}
+
+	str = strdup(labels);
+	if (!str)
+		return -1;
+
+	for (token = strtok_r(str, ",", &saveptr); token;
+	     token = strtok_r(NULL, ",", &saveptr)) {
+		int index = frame_info_lookup(token);
+
+		if (index < 0) {
+			ERROR("unknown label '%s'", token);
+			free(str);
+			return -1;
+		}
+
+		if (mask & BIT(index))
+			continue;
+		mask |= BIT(index);
+		conv->columns[conv->ncolumns++] = index;
+	}
+
+	free(str);
+	return 0;
+}
+
+static int conv_is_xz(const char *path)
+{
+	static const unsigned char magic[6] = { 0xfd, '7', 'z', 'X', 'Z', 0 };
+	unsigned char buffer[sizeof(magic)];
+	int fd;
+	int ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	ret = read(fd, buffer, sizeof(buffer)) == sizeof(buffer) &&
+		!memcmp(buffer, magic, sizeof(magic));
+	close(fd);
+	return ret;
+}
+
+/*
+ * The capture is decompressed in large buffers, which are decoded
+ * up to the last STX. The remaining partial frame is kept for the
+ * next buffer.
+ */
+static int conv_xz(const char *path, unsigned int jobs, struct conv *conv)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_action action = LZMA_RUN;
+	static uint8_t in[1 << 16];
+	char *out;
+	size_t len = 0;
+	int count = 0;
+	lzma_ret ret;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR("could not open '%s' : %s", path, strerror(errno));
+		return -1;
+	}
+
+	out = malloc(CONV_XZ_SIZE);
+	if (!out) {
+		ERROR("could not allocate buffer : %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+	if (ret != LZMA_OK) {
+		ERROR("could not initialize xz decoder : %d", ret);
+		count = -1;
+		goto out;
+	}
+
+	do {
+		if (!strm.avail_in && action == LZMA_RUN) {
+			ssize_t n = read(fd, in, sizeof(in));
+
+			if (n < 0) {
+				ERROR("could not read '%s' : %s", path,
+				      strerror(errno));
+				count = -1;
+				break;
+			}
+			if (!n)
+				action = LZMA_FINISH;
+			strm.next_in = in;
+			strm.avail_in = n;
+		}
+
+		strm.next_out = (uint8_t *)out + len;
+		strm.avail_out = CONV_XZ_SIZE - len;
+		ret = lzma_code(&strm, action);
+		len = CONV_XZ_SIZE - strm.avail_out;
+
+		if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+			ERROR("could not decompress '%s' : %d", path, ret);
+			count = -1;
+			break;
+		}
+
+		if (!strm.avail_out || ret == LZMA_STREAM_END) {
+			size_t end = len;
+
+			if (ret != LZMA_STREAM_END) {
+				char *stx = memrchr(out, STX, len);
+
+				if (stx && stx != out)
+					end = stx - out;
+			}
+
+			count += decode_buffer(out, end, jobs, conv_frame, conv);
+			memmove(out, out + end, len - end);
+			len -= end;
+		}
+	} while (ret != LZMA_STREAM_END);
+
+	lzma_end(&strm);
+out:
+	free(out);
+	close(fd);
+	return count;
+}
+
+static void print_help(int code)
+{
+	fprintf(stderr, "\
+Usage: %s %s [-vh] [-p <PRIORITY>] [-o <FILE>] [-j <N>] [-l <LABELS>] <RAW>\n\
+\n\
+  -v, --version			display version\n\
+  -?, --help			give this help list\n\
+      --usage			give a short usage message\n\
+  -p, --logpriority <PRIORITY>	use log priority <PRIORITY>. between [0-7]\n\
+\n\
+  -o, --output <FILE>		write CSV to <FILE>, default is stdout\n\
+  -j, --jobs <N>		use <N> decoding threads, default is one per CPU\n\
+  -l, --labels <LABELS>		comma separated list of columns, default is all\n\
+\n\
+See the %s man page for further information.\n",
+		progname, version, progname);
+
+	exit(code);
+}
+
+static struct option long_options[] = {
+	{ "help",		no_argument, NULL, 'h' },
+	{ "usage",		no_argument, NULL, 'h' },
+	{ "version",		no_argument, NULL, 'v' },
+
+	{ "logpriority",	required_argument, NULL, 'p' },
+	{ "output",		required_argument, NULL, 'o' },
+	{ "jobs",		required_argument, NULL, 'j' },
+	{ "labels",		required_argument, NULL, 'l' },
+
+	{ 0,			0,	     NULL,  0 }
+};
+
+static const char short_options[] = "vhp:o:j:l:";
+
+static void print_version(void)
+{
+	printf("%s %s\n", progname, version);
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long start = clock_usecs();
+	struct conv conv = { .fd = STDOUT_FILENO };
+	const char *output = NULL;
+	const char *labels = NULL;
+	unsigned int jobs = 0;
+	const char *path;
+	int count;
+	int c;
+
+	while (1) {
+		c = getopt_long(argc, argv, short_options, long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'p':
+			config.logpriority = log_name_to_priority(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'l':
+			labels = optarg;
+			break;
+		case 'v':
+			print_version();
+			break;
+		case 'h':
+			print_help(0);
+			break;
+		default:
+			print_help(1);
+		}
+	}
+
+	if (optind != argc - 1)
+		print_help(1);
+	path = argv[optind];
+
+	log_fd = 2;
+
+	if (conv_columns(&conv, labels))
+		exit(1);
+
+	conv.buffer = malloc(CONV_BATCH_SIZE);
+	if (!conv.buffer) {
+		ERROR("could not allocate buffer : %s", strerror(errno));
+		exit(1);
+	}
+
+	if (output) {
+		conv.fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			       0644);
+		if (conv.fd < 0) {
+			ERROR("could not open '%s' : %s", output,
+			      strerror(errno));
+			exit(1);
+		}
+	}
+
+	conv_header(&conv);
+
+	if (conv_is_xz(path))
+		count = conv_xz(path, jobs, &conv);
+	else
+		count = decode_file(path, jobs, conv_frame, &conv);
+
+	if (count < 0 || conv_flush(&conv) || conv.error)
+		exit(1);
+
+	if (output && close(conv.fd) < 0) {
+		ERROR("could not close '%s' : %s", output, strerror(errno));
+		exit(1);
+	}
+
+	NOTICE("converted %d frames from '%s' in %llu ms", count, path,
+	       (clock_usecs() - start) / 1000);
+	NOTICE("%lu duplicate, %lu invalid frames", stats.frame_dup,
+	       stats.frame_error);
+	free(conv.buffer);
+	return 0;
+}
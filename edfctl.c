@@ -10,6 +10,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -55,7 +56,7 @@ static int read_signal(int sfd)
 static void print_help(int code)
 {
 	fprintf(stderr, "\
-Usage: %s %s [-vhw] [-p <PORT>] [-H <HOSTNAME>] [<COMMAND>]\n\
+Usage: %s %s [-vhw] [-p <PORT>] [-H <HOSTNAME>] [-u <PATH>] [<COMMAND>]\n\
 \n\
   -v, --version			display version\n\
   -?, --help			give this help list\n\
@@ -65,6 +66,7 @@ Usage: %s %s [-vhw] [-p <PORT>] [-H <HOSTNAME>] [<COMMAND>]\n\
 				default is \"localhost\"\n\
   -p, --port <PORT>		connect to <PORT> for UDP requests \n\
 				default port is \":%d\"\n\
+  -u, --unix <PATH>		connect to unix socket <PATH>\n\
 \n\
 See the %s man page for further information.\n",
 		progname, version,
@@ -81,11 +83,12 @@ static struct option long_options[] = {
 
 	{ "port",		required_argument, NULL, 'p' },
 	{ "host",		required_argument, NULL, 'H' },
+	{ "unix",		required_argument, NULL, 'u' },
 
 	{ 0,			0,	     NULL,  0 }
 };
 
-static const char short_options[] = "vhp:H:";
+static const char short_options[] = "vhp:H:u:";
 
 static void print_version(void)
 {
@@ -96,14 +99,11 @@ static void print_version(void)
 static int read_sock(int fd)
 {
 	int ret;
-	struct sockaddr_in addr;
-	socklen_t addrlen = sizeof(addr);
-	char buffer[1024];
+	static char buffer[4096];
 
 	memset(buffer, 0, sizeof(buffer));
 
-	ret = recvfrom(fd, buffer, sizeof(buffer), 0,
-		       (struct sockaddr *)&addr, &addrlen);
+	ret = recv(fd, buffer, sizeof(buffer) - 1, 0);
 	if (ret < 0) {
 		perror("recvfrom()");
 		return -1;
@@ -134,10 +134,12 @@ static int max_fd(void)
 int main(int argc, char *argv[])
 {
 	int ret;
-	struct sockaddr_in addr;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
 	struct hostent *hostp;
 	char buffer[512] = "stats";
 	const char *host = "localhost";
+	const char *path = NULL;
 	int wait = 0;
 	int c;
 	int n = 0;
@@ -159,6 +161,9 @@ int main(int argc, char *argv[])
 		case 'H':
 			host = optarg;
 			break;
+		case 'u':
+			path = optarg;
+			break;
 		case 'v':
 			print_version();
 			break;
@@ -191,26 +196,51 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (sock_fd < 0) {
-		perror("socket()");
-		close(sock_fd);
-		exit(1);
-	}
+	memset(&addr, 0, sizeof(addr));
 
-	memset(&addr, 0, sizeof(struct sockaddr_in));
+	if (path) {
+		struct sockaddr_un *sun = (struct sockaddr_un *)&addr;
+		sa_family_t family = AF_UNIX;
 
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(config.control_port);
+		sock_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+		if (sock_fd < 0) {
+			perror("socket()");
+			exit(1);
+		}
 
-	hostp = gethostbyname(host);
-	if (hostp == (struct hostent *)NULL) {
-		fprintf(stderr, "gethostbyname(%s) failed: %d\n",
-			host, h_errno);
-		ret = 1;
-		goto out;
+		/* autobind an abstract address to receive responses */
+		if (bind(sock_fd, (struct sockaddr *)&family,
+			 sizeof(family)) < 0) {
+			perror("bind()");
+			ret = 1;
+			goto out;
+		}
+
+		sun->sun_family = AF_UNIX;
+		strncpy(sun->sun_path, path, sizeof(sun->sun_path) - 1);
+		addrlen = sizeof(*sun);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+
+		sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (sock_fd < 0) {
+			perror("socket()");
+			exit(1);
+		}
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(config.control_port);
+
+		hostp = gethostbyname(host);
+		if (hostp == (struct hostent *)NULL) {
+			fprintf(stderr, "gethostbyname(%s) failed: %d\n",
+				host, h_errno);
+			ret = 1;
+			goto out;
+		}
+		memcpy(&sin->sin_addr, hostp->h_addr, sizeof(sin->sin_addr));
+		addrlen = sizeof(*sin);
 	}
-	memcpy(&addr.sin_addr, hostp->h_addr, sizeof(addr.sin_addr));
 
 	for (i = 1; i < argc; i++)
 		n += snprintf(buffer + n, sizeof(buffer) - n, "%s ", argv[i]);
@@ -218,11 +248,14 @@ int main(int argc, char *argv[])
 	if (!strncmp(buffer, "sub", 3))
 		wait = 1;
 
-	printf("Sending '%s' request to '%s:%d' ...\n", buffer, host,
-	       config.control_port);
+	if (path)
+		printf("Sending '%s' request to '%s' ...\n", buffer, path);
+	else
+		printf("Sending '%s' request to '%s:%d' ...\n", buffer, host,
+		       config.control_port);
 
 	ret = sendto(sock_fd, buffer, strlen(buffer), 0,
-		     (struct sockaddr *)&addr, sizeof(addr));
+		     (struct sockaddr *)&addr, addrlen);
 	if (ret < 0) {
 		perror("sendto()");
 		goto out;
@@ -16,15 +16,28 @@
 #include <string.h>
 #include <signal.h>
 #include <getopt.h>
+#include <time.h>
 #include <sys/signalfd.h>
+#include <sys/stat.h>
 
 #include "serial.h"
+#include "net.h"
 #include "log.h"
 #include "edfinfo.h"
 #include "control.h"
 #include "frame.h"
 #include "backend.h"
 #include "stats.h"
+#include "hist.h"
+#include "energy.h"
+#include "snapshot.h"
+#include "power.h"
+#include "loadcurve.h"
+#include "phase.h"
+#include "rule.h"
+#include "cost.h"
+#include "scan.h"
+#include "decode.h"
 
 const char progname[]	= "edfinfod";
 const char version[]	= VERSION;
@@ -32,17 +45,180 @@ const char version[]	= VERSION;
 static int sig_fd = -1;
 static int serial_fd = -1;
 
-static void push_frame(const char *buffer, size_t len)
+hist_define(hist_serial_read, "serial_read")
+hist_define(hist_frame_new, "frame_new")
+hist_define(hist_frame_stack_add, "frame_stack_add")
+
+/*
+ * The aggregates, frame stack, energy, cost, power, phases, load
+ * curve, snapshot and rules, follow a single meter : the 'meter' of
+ * the configuration or else the first one received. When network
+ * sources carry several meters, the frames of the others only feed
+ * the subscribers and the backends storing the ADCO.
+ */
+static char meter[16];
+
+static int frame_meter(struct frame *frame)
+{
+	const char *adco = frame_get_info(frame, "ADCO");
+
+	if (!*meter) {
+		const char *first = *config.meter ? config.meter : adco;
+
+		if (!first)
+			return 1;
+		snprintf(meter, sizeof(meter), "%s", first);
+		NOTICE("aggregating frames of meter %s", meter);
+	}
+
+	return !adco || !strcmp(adco, meter);
+}
+
+/*
+ * Frames of the other meters are not stacked and only go to the
+ * backends storing the ADCO
+ */
+static void push_other(struct frame *frame)
+{
+	frame->timestamp = time(NULL);
+	stats.frame_other++;
+	frame_log(frame);
+
+	stats.frame_pushed++;
+	backend_push_other(frame);
+	control_publish(frame);
+	frame_destroy(frame);
+}
+
+/*
+ * Short frames of a phase overload carry no power nor index. They are
+ * not stacked and are handed to the backends right away, bypassing
+ * the rate limits.
+ */
+static void push_overload(struct frame *frame, int aggregate)
+{
+	frame->timestamp = time(NULL);
+	stats.frame_overload++;
+
+	NOTICE("phase overload ADIR1-3 : %d/%d/%d A", frame->adir[0],
+	       frame->adir[1], frame->adir[2]);
+	frame_log(frame);
+
+	/* MQTT, the only backend of overloads, follows one meter */
+	if (aggregate) {
+		rule_update(frame);
+		backend_push_overload(frame);
+	}
+	control_publish(frame);
+	frame_destroy(frame);
+}
+
+/*
+ * Frames decoded offline have no reception time, they only feed the
+ * backends. Raw captures carry no date either : frames are dated from
+ * the start of the capture, advanced by their transmission time on
+ * the serial line.
+ */
+struct import {
+	time_t			start;
+	unsigned long long	usecs;	/* since start */
+};
+
+static void import_frame(struct frame *frame, void *data)
+{
+	struct import *import = data;
+
+	frame->timestamp = import->start + import->usecs / USEC_PER_SEC;
+	import->usecs += (frame->len + 2) * SERIAL_CHAR_USEC; /* STX, ETX */
+
+	if (frame->overload) {
+		stats.frame_overload++;
+		backend_push_overload(frame);
+		frame_destroy(frame);
+		return;
+	}
+
+	if (frame->len > stats.frame_maxlen)
+		stats.frame_maxlen = frame->len;
+
+	backend_push(frame);
+	stats.frame_pushed++;
+	frame_destroy(frame);
+}
+
+/*
+ * Without a start date, the capture is taken as ending at the last
+ * modification of the file, and counted back at the line speed.
+ */
+static int import_file(const char *path)
+{
+	unsigned long long start = clock_usecs();
+	struct import import = { config.import_start, 0 };
+	char date[32];
+	int count;
+
+	if (!import.start) {
+		struct stat st;
+
+		if (stat(path, &st) < 0) {
+			ERROR("could not stat '%s' : %s", path,
+			      strerror(errno));
+			return -1;
+		}
+		import.start = st.st_mtime - (unsigned long long)st.st_size *
+			SERIAL_CHAR_USEC / USEC_PER_SEC;
+	}
+
+	strftime(date, sizeof(date), "%F %T", localtime(&import.start));
+	NOTICE("dating frames of '%s' from %s", path, date);
+
+	if (log_start())
+		return -1;
+
+	if (backend_init()) {
+		ERROR("backend initialization failed");
+		return -1;
+	}
+
+	count = decode_file(path, config.import_jobs, import_frame, &import);
+	if (count < 0)
+		return -1;
+
+	NOTICE("imported %d frames from '%s' in %llu ms", count, path,
+	       (clock_usecs() - start) / 1000);
+	return 0;
+}
+
+static void push_frame(const char *buffer, size_t len,
+		       unsigned long long rx_time)
 {
 	struct frame *frame;
+	unsigned long long start = clock_nsecs();
+	int aggregate;
 
 	frame = frame_new(buffer, len);
+	hist_add(&hist_frame_new, clock_nsecs() - start);
 	if (!frame) {
 		ERROR("dropping frame");
 		stats.frame_error++;
 		return;
 	}
 
+	frame->rx_time = rx_time;
+	aggregate = frame_meter(frame);
+
+	if (frame->overload) {
+		push_overload(frame, aggregate);
+		return;
+	}
+
+	if (!aggregate) {
+		push_other(frame);
+		return;
+	}
+
+	rule_update(frame);
+
 	if (frame->len > stats.frame_maxlen)
 		stats.frame_maxlen = frame->len;
 	if (frame->power > stats.power_max)
@@ -52,11 +228,21 @@ static void push_frame(const char *buffer, size_t len)
 
 	frame_log(frame);
 
+	start = clock_nsecs();
 	stats.frame_stack = frame_stack_add(frame);
+	hist_add(&hist_frame_stack_add, clock_nsecs() - start);
 	if (stats.frame_stack > stats.frame_stack_max)
 		stats.frame_stack_max = stats.frame_stack;
 
+	energy_update(frame);
+	cost_update(frame);
+	power_update(frame);
+	phase_update(frame);
+	loadcurve_update(frame);
+	snapshot_save(buffer, len, frame);
+
 	stats.frame_pushed++;
+	latency_update(&stats.frame_decode, clock_usecs() - rx_time);
 
 	/*
 	 * Backend will most likely use network and it could be
@@ -64,6 +250,30 @@ static void push_frame(const char *buffer, size_t len)
 	 * the serial line.
 	 */
 	backend_push(frame);
+
+	control_publish(frame);
+}
+
+/*
+ * Frames keep flowing, only the changed backends and sources are
+ * restarted
+ */
+static void reload_config(void)
+{
+	int flags = config_reload();
+
+	if (flags < 0)
+		return;
+
+	if ((flags & CONFIG_RELOAD_SERIAL) && !config.debug &&
+	    *config.serial_port) {
+		serial_fd = serial_reopen(serial_fd, config.serial_port);
+		if (serial_fd < 0)
+			ERROR("failed to reopen serial port '%s'",
+			      config.serial_port);
+		else
+			NOTICE("reopened serial port '%s'", config.serial_port);
+	}
 }
 
 static int read_signal(int sfd)
@@ -81,6 +291,9 @@ static int read_signal(int sfd)
 	case SIGUSR1:
 		stats_log(&stats);
 		return 0;
+	case SIGHUP:
+		reload_config();
+		return 0;
 	case SIGINT:
 	case SIGQUIT:
 	case SIGTERM:
@@ -104,6 +317,11 @@ Usage: %s %s [-vhd]  [-c <FILE>] [-p <PRIORITY>] [-o <FILE>] [-f <TTY>]...\n\
   -f, --tty <TTY>		read EDF info from serial port device <TTY>\n\
   -r, --raw <RAW>		record raw data in file <RAW>\n\
   -d, --daemon			daemonize program\n\
+\n\
+  -i, --import <RAW>		decode raw data file <RAW> into the backends\n\
+  -j, --jobs <N>		use <N> decoding threads, default is one per CPU\n\
+  -s, --start <TIME>		date the first imported frame <TIME>, seconds\n\
+				since the Epoch or \"YYYY-MM-DD HH:MM:SS\"\n\
 \n\
 See the %s man page for further information.\n",
 		progname, version, progname);
@@ -122,13 +340,35 @@ static struct option long_options[] = {
 	{ "daemon",		no_argument, NULL, 'd' },
 	{ "debug",		no_argument, NULL, 'g' },
 	{ "raw",		required_argument, NULL, 'r' },
+	{ "import",		required_argument, NULL, 'i' },
+	{ "jobs",		required_argument, NULL, 'j' },
+	{ "start",		required_argument, NULL, 's' },
 
 	{ "tty",		required_argument, NULL, 'f' },
 
 	{ 0,			0,	     NULL,  0 }
 };
 
-static const char short_options[] = "hvc:o:p:dgr:f:";
+static const char short_options[] = "hvc:o:p:dgr:f:i:j:s:";
+
+/*
+ * Seconds since the Epoch or a local date
+ */
+static time_t parse_time(const char *str)
+{
+	struct tm tm = { .tm_isdst = -1 };
+	char *end;
+	long long t;
+
+	t = strtoll(str, &end, 10);
+	if (end != str && !*end && t > 0)
+		return t;
+
+	end = strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+	if (!end || *end)
+		return -1;
+	return mktime(&tm);
+}
 
 static void print_version(void)
 {
@@ -142,19 +382,28 @@ static void cleanup(int dumpstats)
 
 	backend_fini();
 
+	/* the exit messages are written synchronously */
+	log_stop();
+
 	if (dumpstats)
 		stats_log(&stats);
 
 	frame_stack_clear(frame_stack);
+	energy_close();
+	snapshot_close();
 
+	net_close();
 	if (serial_fd != -1)
 		serial_close(serial_fd);
 	if (control_fd != -1)
 		control_close(control_fd);
-	if (log_fd != -1)
-		close(log_fd);
+	if (control_unix_fd != -1)
+		control_close(control_unix_fd);
 	if (sig_fd != -1)
 		close(sig_fd);
+
+	if (log_fd != -1)
+		close(log_fd);
 }
 
 static int max_fd(void)
@@ -165,6 +414,8 @@ static int max_fd(void)
 		max = sig_fd;
 	if (control_fd > max)
 		max = control_fd;
+	if (control_unix_fd > max)
+		max = control_unix_fd;
 	if (serial_fd > max)
 		max = serial_fd;
 	return max;
@@ -212,6 +463,20 @@ int main(int argc, char *const argv[])
 		case 'f':
 			config.serial_port = optarg;
 			break;
+		case 'i':
+			config.import = optarg;
+			break;
+		case 'j':
+			config.import_jobs = atoi(optarg);
+			break;
+		case 's':
+			config.import_start = parse_time(optarg);
+			if (config.import_start <= 0) {
+				fprintf(stderr, "%s: invalid start time '%s'\n",
+					progname, optarg);
+				print_help(1);
+			}
+			break;
 
 		case 'o':
 			config.logfile = optarg;
@@ -234,23 +499,59 @@ int main(int argc, char *const argv[])
 
 	WARN("%s %s starting", progname, version);
 
-	/* skip serial initialization and use stdin when testing */
-	serial_fd = (config.debug) ? 0 : serial_open(config.serial_port);
+	if (scan_init(getenv("EDFINFO_SCAN")))
+		goto out;
+
+	if (power_init() || phase_init() || rule_init())
+		goto out;
+
+	if (energy_open(config.datadir))
+		goto out;
+
+	if (snapshot_open(config.datadir))
+		goto out;
+
+	/* offline decoding, no other input */
+	if (config.import) {
+		if (import_file(config.import))
+			goto out;
+		cleanup(1);
+		return 0;
+	}
 
-	if (serial_fd < 0)
+	if (net_open())
 		goto out;
 
-	NOTICE("opened serial port '%s'", config.serial_port);
+	/*
+	 * skip serial initialization and use stdin when testing, which
+	 * is mapped if it is a file. An empty serial port is allowed
+	 * when network sources are used.
+	 */
+	if (config.debug) {
+		serial_fd = 0;
+		if (serial_map_open(serial_fd) < 0)
+			goto out;
+	} else if (*config.serial_port || !net_count()) {
+		serial_fd = serial_open(config.serial_port);
+		if (serial_fd < 0)
+			goto out;
+
+		NOTICE("opened serial port '%s'", config.serial_port);
+	}
 
-	if (config.serial_lograw)
+	if (config.serial_lograw && serial_fd != -1)
 		serial_open_lograw(config.serial_lograw);
 
 	control_fd = control_open();
 	if (control_fd < 0)
 		goto out;
 
+	if (*config.control_unix && control_open_unix(config.control_unix) < 0)
+		goto out;
+
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
 	sigaddset(&mask, SIGINT);
 	sigaddset(&mask, SIGQUIT);
 	sigaddset(&mask, SIGTERM);
@@ -269,6 +570,9 @@ int main(int argc, char *const argv[])
 	if (config.daemonize)
 		daemon(0, 0);
 
+	if (log_start())
+		goto out;
+
 	if (backend_init()) {
 		ERROR("backend initialization failed");
 		goto out;
@@ -276,16 +580,24 @@ int main(int argc, char *const argv[])
 
 	while (1) {
 		int ret;
+		int maxfd;
 		fd_set rfds;
+		fd_set wfds;
 		struct timeval tv = { SERIAL_TIMEOUT, 0 };
 
 		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
 		FD_SET(sig_fd, &rfds);
-		FD_SET(serial_fd, &rfds);
+		if (serial_fd != -1)
+			FD_SET(serial_fd, &rfds);
 		FD_SET(control_fd, &rfds);
+		if (control_unix_fd != -1)
+			FD_SET(control_unix_fd, &rfds);
+
+		maxfd = net_fd_set(&rfds, &wfds, max_fd());
 
-		ret = TEMP_FAILURE_RETRY(select(max_fd() + 1, &rfds,
-						NULL, NULL, &tv));
+		ret = TEMP_FAILURE_RETRY(select(maxfd + 1, &rfds,
+						&wfds, NULL, &tv));
 		if (ret == -1) {
 			ERROR("select() failed: %s", strerror(errno));
 			goto out;
@@ -299,30 +611,47 @@ int main(int argc, char *const argv[])
 				stats.serial_rx_errors++;
 			}
 			stats.serial_data_loss += SERIAL_TIMEOUT;
+			control_expire();
 			continue;
 		}
 
 		stats_update_min_timeout(&stats, &tv);
 
+		/*
+		 * A reload can close and reopen the serial port and the
+		 * network sources, under the same fd numbers. Rebuild the
+		 * fd sets before reading them.
+		 */
 		if (FD_ISSET(sig_fd, &rfds)) {
 			if (read_signal(sig_fd))
 				goto out;
+			continue;
 		}
 
-		if (FD_ISSET(serial_fd, &rfds)) {
+		if (serial_fd != -1 && FD_ISSET(serial_fd, &rfds)) {
 			if (!receiving_data) {
 				NOTICE("receiving data");
 				receiving_data = 1;
 			}
+			unsigned long long start = clock_nsecs();
+
 			ret = serial_read(serial_fd, push_frame);
+			hist_add(&hist_serial_read, clock_nsecs() - start);
 			if (ret == -1 && config.debug)
 				goto out;
 		}
 
+		net_read(&rfds, &wfds, push_frame);
+
 		if (FD_ISSET(control_fd, &rfds)) {
 			control_read(control_fd);
 			stats.control_requests++;
 		}
+
+		if (control_unix_fd != -1 && FD_ISSET(control_unix_fd, &rfds)) {
+			control_read(control_unix_fd);
+			stats.control_requests++;
+		}
 	}
 
 out:
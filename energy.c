@@ -0,0 +1,472 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "edfinfo.h"
+#include "frame.h"
+#include "energy.h"
+
+static const struct {
+	enum frame_info_index	index;
+	const char		*name;
+} tariffs[ENERGY_TARIFF_MAX] = {
+	[ENERGY_TARIFF_BASE]	= { FRAME_INFO_BASE,	"TH"	},
+	[ENERGY_TARIFF_HC]	= { FRAME_INFO_HCHC,	"HC"	},
+	[ENERGY_TARIFF_HP]	= { FRAME_INFO_HCHP,	"HP"	},
+	[ENERGY_TARIFF_EJPHN]	= { FRAME_INFO_EJPHN,	"HN"	},
+	[ENERGY_TARIFF_EJPHPM]	= { FRAME_INFO_EJPHPM,	"PM"	},
+	[ENERGY_TARIFF_HCJB]	= { FRAME_INFO_BBRHCJB,	"HCJB"	},
+	[ENERGY_TARIFF_HPJB]	= { FRAME_INFO_BBRHPJB,	"HPJB"	},
+	[ENERGY_TARIFF_HCJW]	= { FRAME_INFO_BBRHCJW,	"HCJW"	},
+	[ENERGY_TARIFF_HPJW]	= { FRAME_INFO_BBRHPJW,	"HPJW"	},
+	[ENERGY_TARIFF_HCJR]	= { FRAME_INFO_BBRHCJR,	"HCJR"	},
+	[ENERGY_TARIFF_HPJR]	= { FRAME_INFO_BBRHPJR,	"HPJR"	},
+};
+
+/*
+ * Ring files. The header is followed by 'nslots' slots and 'head' is
+ * the slot of the current period. The last index values are saved
+ * to account the consumption during a restart.
+ */
+#define ENERGY_MAGIC		0x45444645 /* "EDFE" */
+#define ENERGY_VERSION		1
+
+struct energy_hdr {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	resolution;
+	uint32_t	nslots;
+	uint32_t	ntariffs;
+	uint32_t	head;
+	uint32_t	used;
+	uint32_t	tariffs;	/* bitmap of tariffs seen */
+	uint32_t	last[ENERGY_TARIFF_MAX];
+	int64_t		updated;
+} __attribute__((packed));
+
+static struct energy_ring {
+	const char		*name;
+	unsigned int		nslots;
+
+	struct energy_hdr	*hdr;
+	struct energy_slot	*slots;
+	size_t			size;
+	time_t			end;	/* of the current slot */
+} rings[ENERGY_RESOLUTION_MAX] = {
+	[ENERGY_MINUTE]	= { .name = "minute",	.nslots = 2 * 24 * 60	},
+	[ENERGY_HOUR]	= { .name = "hour",	.nslots = 100 * 24	},
+	[ENERGY_DAY]	= { .name = "day",	.nslots = 3 * 366	},
+	[ENERGY_MONTH]	= { .name = "month",	.nslots = 10 * 12	},
+};
+
+enum frame_info_index energy_tariff_index(enum energy_tariff tariff)
+{
+	return tariffs[tariff].index;
+}
+
+const char *energy_tariff_name(enum energy_tariff tariff)
+{
+	return tariffs[tariff].name;
+}
+
+int energy_tariff_lookup(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ENERGY_TARIFF_MAX; i++)
+		if (!strcmp(tariffs[i].name, name))
+			return i;
+	return -1;
+}
+
+/*
+ * Tariff of the current period
+ */
+int energy_tariff_ptec(const char *ptec)
+{
+	unsigned int i;
+
+	for (i = 0; i < ENERGY_TARIFF_MAX; i++) {
+		size_t len = strlen(tariffs[i].name);
+
+		/* PTEC values are padded with dots : "HC.." */
+		if (!strncmp(ptec, tariffs[i].name, len) &&
+		    strspn(ptec + len, ".") == strlen(ptec + len))
+			return i;
+	}
+	return -1;
+}
+
+int energy_resolution_lookup(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ENERGY_RESOLUTION_MAX; i++)
+		if (!strcmp(rings[i].name, name))
+			return i;
+	return -1;
+}
+
+static void energy_ring_reset(struct energy_ring *r, unsigned int res)
+{
+	memset(r->hdr, 0, r->size);
+	r->hdr->magic = ENERGY_MAGIC;
+	r->hdr->version = ENERGY_VERSION;
+	r->hdr->resolution = res;
+	r->hdr->nslots = r->nslots;
+	r->hdr->ntariffs = ENERGY_TARIFF_MAX;
+}
+
+static int energy_ring_valid(const struct energy_ring *r, unsigned int res)
+{
+	const struct energy_hdr *hdr = r->hdr;
+
+	return hdr->magic == ENERGY_MAGIC && hdr->version == ENERGY_VERSION &&
+		hdr->resolution == res && hdr->nslots == r->nslots &&
+		hdr->ntariffs == ENERGY_TARIFF_MAX && hdr->head < r->nslots &&
+		hdr->used <= r->nslots;
+}
+
+/*
+ * Without a directory, rings are kept in anonymous memory and are
+ * lost on exit.
+ */
+static int energy_ring_open(struct energy_ring *r, unsigned int res,
+			    const char *dir)
+{
+	char path[256];
+	void *addr;
+	int fd = -1;
+
+	r->size = sizeof(*r->hdr) + r->nslots * sizeof(*r->slots);
+
+	if (*dir) {
+		snprintf(path, sizeof(path), "%s/energy-%s.ring", dir,
+			 r->name);
+
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			ERROR("energy: open(%s) failed: %s", path,
+			      strerror(errno));
+			return -1;
+		}
+
+		if (ftruncate(fd, r->size) < 0) {
+			ERROR("energy: ftruncate(%s) failed: %s", path,
+			      strerror(errno));
+			close(fd);
+			return -1;
+		}
+		addr = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    fd, 0);
+		close(fd);
+	} else {
+		addr = mmap(NULL, r->size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+
+	if (addr == MAP_FAILED) {
+		ERROR("energy: mmap(%s) failed: %s", r->name, strerror(errno));
+		return -1;
+	}
+
+	r->hdr = addr;
+	r->slots = (void *)(r->hdr + 1);
+	r->end = 0;
+
+	if (!energy_ring_valid(r, res)) {
+		if (r->hdr->magic)
+			WARN("energy: %s: invalid ring file. resetting",
+			     r->name);
+		energy_ring_reset(r, res);
+	} else if (r->hdr->used) {
+		INFO("energy: %s: restored %d slots", r->name, r->hdr->used);
+	}
+	return 0;
+}
+
+int energy_open(const char *dir)
+{
+	unsigned int i;
+
+	for (i = 0; i < ENERGY_RESOLUTION_MAX; i++) {
+		if (energy_ring_open(&rings[i], i, dir)) {
+			energy_close();
+			return -1;
+		}
+	}
+
+	if (*dir)
+		NOTICE("energy: ring files in '%s'", dir);
+	return 0;
+}
+
+void energy_close(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ENERGY_RESOLUTION_MAX; i++) {
+		if (!rings[i].hdr)
+			continue;
+
+		msync(rings[i].hdr, rings[i].size, MS_SYNC);
+		munmap(rings[i].hdr, rings[i].size);
+		rings[i].hdr = NULL;
+	}
+}
+
+/*
+ * Local time boundaries of the period containing @t. mktime()
+ * normalizes the overflowing fields.
+ */
+static void energy_period(unsigned int res, time_t t, time_t *start,
+			  time_t *end)
+{
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	tm.tm_sec = 0;
+	switch (res) {
+	case ENERGY_MONTH:
+		tm.tm_mday = 1;
+		/* fall through */
+	case ENERGY_DAY:
+		tm.tm_hour = 0;
+		/* fall through */
+	case ENERGY_HOUR:
+		tm.tm_min = 0;
+		/* fall through */
+	default:
+		break;
+	}
+
+	tm.tm_isdst = -1;
+	*start = mktime(&tm);
+
+	switch (res) {
+	case ENERGY_MONTH:
+		tm.tm_mon++;
+		break;
+	case ENERGY_DAY:
+		tm.tm_mday++;
+		break;
+	case ENERGY_HOUR:
+		tm.tm_hour++;
+		break;
+	default:
+		tm.tm_min++;
+		break;
+	}
+
+	tm.tm_isdst = -1;
+	*end = mktime(&tm);
+}
+
+/*
+ * The period boundaries are only computed when the current period is
+ * over. A new slot is used for each new period and slots are never
+ * reused backwards if the clock goes back.
+ */
+static struct energy_slot *energy_ring_slot(struct energy_ring *r,
+					    unsigned int res, time_t t)
+{
+	struct energy_hdr *hdr = r->hdr;
+	struct energy_slot *slot = &r->slots[hdr->head];
+	time_t start;
+
+	if (hdr->used && t < r->end && t >= slot->start)
+		return slot;
+
+	energy_period(res, t, &start, &r->end);
+	if (hdr->used && start <= slot->start)
+		return slot;
+
+	if (hdr->used) {
+		hdr->head = (hdr->head + 1) % r->nslots;
+		slot = &r->slots[hdr->head];
+	}
+	if (hdr->used < r->nslots)
+		hdr->used++;
+
+	memset(slot, 0, sizeof(*slot));
+	slot->start = start;
+	return slot;
+}
+
+static void energy_ring_update(struct energy_ring *r, unsigned int res,
+			       time_t t, const uint32_t *index,
+			       uint32_t present)
+{
+	struct energy_hdr *hdr = r->hdr;
+	struct energy_slot *slot = energy_ring_slot(r, res, t);
+	unsigned int i;
+
+	for (i = 0; i < ENERGY_TARIFF_MAX; i++) {
+		if (!(present & (1 << i)))
+			continue;
+
+		/* a lower index is a new meter or a bogus value */
+		if (hdr->last[i] && index[i] >= hdr->last[i])
+			slot->wh[i] += index[i] - hdr->last[i];
+
+		hdr->last[i] = index[i];
+	}
+
+	hdr->tariffs |= present;
+	hdr->updated = t;
+}
+
+void energy_update(const struct frame *frame)
+{
+	uint32_t index[ENERGY_TARIFF_MAX];
+	uint32_t present = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < frame->ninfos; i++) {
+		for (j = 0; j < ENERGY_TARIFF_MAX; j++) {
+			if (frame->infos[i]->index == tariffs[j].index) {
+				index[j] = strtoul(frame->infos[i]->value,
+						   NULL, 10);
+				present |= 1 << j;
+				break;
+			}
+		}
+	}
+
+	if (!present)
+		return;
+
+	for (i = 0; i < ENERGY_RESOLUTION_MAX; i++)
+		if (rings[i].hdr)
+			energy_ring_update(&rings[i], i, frame->timestamp,
+					   index, present);
+}
+
+/*
+ * Slot of the current period, NULL if nothing was accounted yet
+ */
+const struct energy_slot *energy_current(enum energy_resolution res)
+{
+	const struct energy_ring *r = &rings[res];
+
+	if (!r->hdr || !r->hdr->used)
+		return NULL;
+	return &r->slots[r->hdr->head];
+}
+
+/*
+ * Calls @cb on the last @count slots, oldest first. A @count of 0
+ * means all slots.
+ */
+unsigned int energy_foreach(enum energy_resolution res, unsigned int count,
+			    energy_cb_t cb, void *data)
+{
+	const struct energy_ring *r = &rings[res];
+	unsigned int i;
+
+	if (!r->hdr)
+		return 0;
+
+	if (!count || count > r->hdr->used)
+		count = r->hdr->used;
+
+	for (i = 0; i < count; i++) {
+		unsigned int slot = (r->hdr->head + r->nslots - count + 1 + i) %
+			r->nslots;
+
+		cb(&r->slots[slot], r->hdr->tariffs, data);
+	}
+	return count;
+}
+
+struct energy_print_data {
+	enum energy_resolution	res;
+	char			*buffer;
+	size_t			len;
+	int			n;
+	uint32_t		total[ENERGY_TARIFF_MAX];
+};
+
+static void energy_print_slot(const struct energy_slot *slot,
+			      uint32_t used, void *data)
+{
+	static const char *formats[ENERGY_RESOLUTION_MAX] = {
+		[ENERGY_MINUTE]	= "%Y-%m-%d %H:%M",
+		[ENERGY_HOUR]	= "%Y-%m-%d %H:%M",
+		[ENERGY_DAY]	= "%Y-%m-%d",
+		[ENERGY_MONTH]	= "%Y-%m",
+	};
+	struct energy_print_data *p = data;
+	time_t start = slot->start;
+	char date[32];
+	struct tm tm;
+	unsigned int i;
+
+	for (i = 0; i < ENERGY_TARIFF_MAX; i++)
+		p->total[i] += slot->wh[i];
+
+	if ((size_t)p->n >= p->len)
+		return;
+
+	localtime_r(&start, &tm);
+	strftime(date, sizeof(date), formats[p->res], &tm);
+	p->n += snprintf(p->buffer + p->n, p->len - p->n, "%-16s", date);
+
+	for (i = 0; i < ENERGY_TARIFF_MAX && (size_t)p->n < p->len; i++) {
+		if (!(used & (1 << i)))
+			continue;
+
+		p->n += snprintf(p->buffer + p->n, p->len - p->n, " %s:%07.3f",
+				 tariffs[i].name, (double)slot->wh[i] / 1000);
+	}
+	if ((size_t)p->n < p->len)
+		p->n += snprintf(p->buffer + p->n, p->len - p->n, "\n");
+}
+
+/*
+ * Consumption in kWh of the last @count periods, followed by the
+ * total
+ */
+int energy_print(enum energy_resolution res, unsigned int count,
+		 char *buffer, size_t len)
+{
+	struct energy_print_data p = {
+		.res = res, .buffer = buffer, .len = len,
+	};
+	unsigned int i;
+
+	if (!energy_foreach(res, count, energy_print_slot, &p)) {
+		p.n = snprintf(buffer, len, "no energy data\n");
+		return (size_t)p.n < len ? p.n : (int)len - 1;
+	}
+
+	if ((size_t)p.n < len)
+		p.n += snprintf(buffer + p.n, len - p.n, "%-16s", "total");
+	for (i = 0; i < ENERGY_TARIFF_MAX && (size_t)p.n < len; i++) {
+		if (!(rings[res].hdr->tariffs & (1 << i)))
+			continue;
+
+		p.n += snprintf(buffer + p.n, len - p.n, " %s:%07.3f",
+				tariffs[i].name, (double)p.total[i] / 1000);
+	}
+	if ((size_t)p.n < len)
+		p.n += snprintf(buffer + p.n, len - p.n, "\n");
+
+	return (size_t)p.n < len ? p.n : (int)len - 1;
+}
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef EDFINFO_ENERGY_H
+#define EDFINFO_ENERGY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "frame.h"
+
+/*
+ * Energy consumption per tariff period. Each tariff has its own index
+ * in the frames and the consumption is accounted from the index
+ * deltas, whatever the current period (PTEC) is.
+ */
+enum energy_tariff {
+	ENERGY_TARIFF_BASE,	/* toutes heures */
+	ENERGY_TARIFF_HC,	/* heures creuses */
+	ENERGY_TARIFF_HP,	/* heures pleines */
+	ENERGY_TARIFF_EJPHN,	/* EJP heures normales */
+	ENERGY_TARIFF_EJPHPM,	/* EJP heures de pointe mobile */
+	ENERGY_TARIFF_HCJB,	/* Tempo, jours bleus */
+	ENERGY_TARIFF_HPJB,
+	ENERGY_TARIFF_HCJW,	/* Tempo, jours blancs */
+	ENERGY_TARIFF_HPJW,
+	ENERGY_TARIFF_HCJR,	/* Tempo, jours rouges */
+	ENERGY_TARIFF_HPJR,
+
+	ENERGY_TARIFF_MAX
+};
+
+enum energy_resolution {
+	ENERGY_MINUTE,
+	ENERGY_HOUR,
+	ENERGY_DAY,
+	ENERGY_MONTH,
+
+	ENERGY_RESOLUTION_MAX
+};
+
+/*
+ * Consumption of one time period, local time aligned. This is also
+ * the layout of the ring files.
+ */
+struct energy_slot {
+	int64_t		start;	/* seconds since epoch */
+	uint32_t	wh[ENERGY_TARIFF_MAX];
+} __attribute__((packed));
+
+typedef void (*energy_cb_t)(const struct energy_slot *slot,
+			    uint32_t tariffs, void *data);
+
+extern int energy_open(const char *dir);
+extern void energy_close(void);
+extern void energy_update(const struct frame *frame);
+extern unsigned int energy_foreach(enum energy_resolution res,
+				   unsigned int count, energy_cb_t cb,
+				   void *data);
+extern const struct energy_slot *energy_current(enum energy_resolution res);
+extern int energy_resolution_lookup(const char *name);
+extern int energy_tariff_lookup(const char *name);
+extern int energy_tariff_ptec(const char *ptec);
+extern enum frame_info_index energy_tariff_index(enum energy_tariff tariff);
+extern const char *energy_tariff_name(enum energy_tariff tariff);
+extern int energy_print(enum energy_resolution res, unsigned int count,
+			char *buffer, size_t len);
+
+#endif
@@ -20,8 +20,11 @@
 #include "edfinfo.h"
 #include "frame.h"
 #include "stats.h"
+#include "trace.h"
+#include "scan.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#define BIT(nr)                 (1ULL << (nr))
 
 static unsigned int myatoi(const char *str, unsigned int count,
 			   unsigned int base)
@@ -134,6 +137,10 @@ static struct edfinfo {
 
 	/* Avertissement de Dépassement De Puissance Souscrite */
 	{ FRAME_INFO_ADPS,	"ADPS",		3,	NULL,	NULL	},
+	/* Avertissement de Dépassement d'intensité de réglage par phase */
+	{ FRAME_INFO_ADIR1,	"ADIR1",	3,	NULL,	NULL	},
+	{ FRAME_INFO_ADIR2,	"ADIR2",	3,	NULL,	NULL	},
+	{ FRAME_INFO_ADIR3,	"ADIR3",	3,	NULL,	NULL	},
 
 	{ FRAME_INFO_MAX,	NULL,		0,	NULL,	NULL	},
 };
@@ -151,6 +158,26 @@ static struct edfinfo *find_einfo(const char *label)
 	return NULL;
 }
 
+int frame_info_lookup(const char *label)
+{
+	struct edfinfo *ei = find_einfo(label);
+
+	return ei ? (int)ei->index : -1;
+}
+
+const char *frame_info_label(enum frame_info_index index)
+{
+	struct edfinfo *einfo = edfinfos;
+
+	while (einfo->label) {
+		if (einfo->index == index)
+			return einfo->label;
+		einfo++;
+	}
+
+	return NULL;
+}
+
 int frame_info_set_default(const char *label, const char *value)
 {
 	struct edfinfo *ei;
@@ -169,7 +196,7 @@ void frame_log(const struct frame *frame)
 {
 	unsigned int i;
 
-	INFO("frame %08d size:%ld bitmap:%08x", frame->num, frame->len,
+	INFO("frame %08d size:%ld bitmap:%010llx", frame->num, frame->len,
 	     frame->infos_bitmap);
 	for (i = 0; i < frame->ninfos; i++)
 		DEBUG("\t%s: '%s'", frame->infos[i]->label,
@@ -187,6 +214,24 @@ int frame_print(const struct frame *frame, char *buffer, size_t len)
 	return n;
 }
 
+/*
+ * Only print the frame infos selected in @mask
+ */
+int frame_print_mask(const struct frame *frame, unsigned long long mask,
+		     char *buffer, size_t len)
+{
+	unsigned int i;
+	int n = 0;
+
+	for (i = 0; i < frame->ninfos; i++) {
+		if (!(mask & BIT(frame->infos[i]->index)))
+			continue;
+		n += snprintf(buffer + n, len - n, "%s:%s\n",
+			      frame->infos[i]->label, frame->infos[i]->value);
+	}
+	return n;
+}
+
 const char *frame_get_info(struct frame *frame, const char *label)
 {
 	unsigned int i;
@@ -228,13 +273,9 @@ const char *frame_get_info(struct frame *frame, const char *label)
  * être non imprimables, on ne conserve que les six bits de poids
  * faible du résultat obtenu. Enfin, on ajoute 20h.
  */
-static unsigned char calc_checksum(const char *buffer)
+static unsigned char calc_checksum(const char *buffer, size_t len)
 {
-	unsigned int csum = 0;
-
-	while (*buffer)
-		csum += *buffer++;
-	return (csum & 0x3f) + 0x20;
+	return (scan_sum(buffer, len) & 0x3f) + 0x20;
 }
 
 /*
@@ -302,11 +343,18 @@ static struct frame_info *frame_info_new(char *buffer, size_t len)
 
 	DEBUG("frame info: '%s' #%d", buffer, len);
 
+	if (len < 3) {
+		ERROR("frame info is too short: #%d", len);
+		return NULL;
+	}
+
 	csum = buffer[len - 1];
 	buffer[len - 2] = '\0';
 
-	if (csum != calc_checksum(buffer)) {
-		stats.badchecksum++;
+	if (csum != calc_checksum(buffer, len - 2)) {
+		TRACE(frame_checksum, buffer, csum,
+		      calc_checksum(buffer, len - 2));
+		__atomic_fetch_add(&stats.badchecksum, 1, __ATOMIC_RELAXED);
 		ERROR("frame info has an invalid checksum: '%s'", buffer);
 		return NULL;
 	}
@@ -333,8 +381,6 @@ static struct frame_info *frame_info_new(char *buffer, size_t len)
 	return frame_info;
 }
 
-#define BIT(nr)                 (1UL << (nr))
-
 static void frame_info_add(struct frame *frame, struct frame_info *finfo)
 {
 	unsigned int i = 0;
@@ -359,8 +405,8 @@ static void frame_info_add(struct frame *frame, struct frame_info *finfo)
 	if (i == frame->ninfos)
 		frame->ninfos++;
 
-	/* update bitmap of collected frame infos. For the moment, we
-	 * are lucky enough to have indexes with values < 31 ...
+	/* update bitmap of collected frame infos. There are more than
+	 * 32 indexes, the bitmap is 64 bits wide
 	 */
 	frame->infos_bitmap |= BIT(finfo->index);
 
@@ -369,8 +415,19 @@ static void frame_info_add(struct frame *frame, struct frame_info *finfo)
 	 */
 	if (finfo->index == FRAME_INFO_PAPP)
 		frame->power = atoi(finfo->value);
-	if (finfo->index == FRAME_INFO_BASE)
-		frame->energy = atoi(finfo->value);
+	if (finfo->index == FRAME_INFO_IINST)
+		frame->current[0] = atoi(finfo->value);
+	if (finfo->index >= FRAME_INFO_IINST1 &&
+	    finfo->index <= FRAME_INFO_IINST3)
+		frame->current[finfo->index - FRAME_INFO_IINST1] =
+			atoi(finfo->value);
+	if (finfo->index >= FRAME_INFO_ADIR1 &&
+	    finfo->index <= FRAME_INFO_ADIR3)
+		frame->adir[finfo->index - FRAME_INFO_ADIR1] =
+			atoi(finfo->value);
+	if (finfo->index >= FRAME_INFO_BASE &&
+	    finfo->index <= FRAME_INFO_BBRHPJR)
+		frame->energy += atoi(finfo->value);
 }
 
 void frame_destroy(struct frame *frame)
@@ -391,9 +448,17 @@ void frame_destroy(struct frame *frame)
  */
 #define FRAME_INFO_COMMON_MASK (					\
 		BIT(FRAME_INFO_ADCO)   | BIT(FRAME_INFO_OPTARIF) |	\
-		BIT(FRAME_INFO_ISOUSC) | BIT(FRAME_INFO_BASE)	 |	\
-		BIT(FRAME_INFO_PTEC)   | BIT(FRAME_INFO_PAPP)	 |	\
-		BIT(FRAME_INFO_MOTDETAT))
+		BIT(FRAME_INFO_ISOUSC) | BIT(FRAME_INFO_PTEC)	 |	\
+		BIT(FRAME_INFO_PAPP)   | BIT(FRAME_INFO_MOTDETAT))
+
+/* at least one of the indexes, depending on the tariff option */
+#define FRAME_INFO_INDEX_MASK (						\
+		BIT(FRAME_INFO_BASE)    | BIT(FRAME_INFO_HCHC)    |	\
+		BIT(FRAME_INFO_HCHP)    | BIT(FRAME_INFO_EJPHN)   |	\
+		BIT(FRAME_INFO_EJPHPM)  | BIT(FRAME_INFO_BBRHCJB) |	\
+		BIT(FRAME_INFO_BBRHPJB) | BIT(FRAME_INFO_BBRHCJW) |	\
+		BIT(FRAME_INFO_BBRHPJW) | BIT(FRAME_INFO_BBRHCJR) |	\
+		BIT(FRAME_INFO_BBRHPJR))
 
 #define FRAME_INFO_MONO_MASK (						\
 		FRAME_INFO_COMMON_MASK | BIT(FRAME_INFO_IINST)	 |	\
@@ -405,37 +470,100 @@ void frame_destroy(struct frame *frame)
 		BIT(FRAME_INFO_IMAX1)  | BIT(FRAME_INFO_IMAX2)	 |	\
 		BIT(FRAME_INFO_IMAX3))
 
+/*
+ * Short frames sent by three phases meters, instead of the normal
+ * cycle, when the current of a phase exceeds the subscribed current.
+ * At least one of the ADIR infos is present.
+ */
+#define FRAME_INFO_SHORT_MASK (						\
+		BIT(FRAME_INFO_ADCO)   | BIT(FRAME_INFO_IINST1)	 |	\
+		BIT(FRAME_INFO_IINST2) | BIT(FRAME_INFO_IINST3))
+
+#define FRAME_INFO_ADIR_MASK (						\
+		BIT(FRAME_INFO_ADIR1)  | BIT(FRAME_INFO_ADIR2)	 |	\
+		BIT(FRAME_INFO_ADIR3))
+
+static enum frame_phases frame_phases = FRAME_PHASES_AUTO;
+
+static const char *frame_phases_names[] = {
+	[FRAME_PHASES_AUTO]	= "auto",
+	[FRAME_PHASES_MONO]	= "mono",
+	[FRAME_PHASES_TRI]	= "tri",
+};
+
+int frame_set_phases(const char *value)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(frame_phases_names); i++) {
+		if (!strcmp(value, frame_phases_names[i])) {
+			frame_phases = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static inline int frame_match(const struct frame *frame,
+			      unsigned long long mask)
+{
+	return (frame->infos_bitmap & mask) == mask;
+}
+
 /*
  * validate the frame by checking that enough frame infos have been
- * collected. Should use a config option ?
+ * collected for the type of meter, mono or three phases, selected by
+ * the 'phases' option.
  */
 static int frame_validate(struct frame *frame)
 {
-	unsigned long bitmask = FRAME_INFO_MONO_MASK;
+	if (frame_phases != FRAME_PHASES_MONO &&
+	    (frame->infos_bitmap & FRAME_INFO_ADIR_MASK) &&
+	    frame_match(frame, FRAME_INFO_SHORT_MASK)) {
+		frame->phases = 3;
+		frame->overload = 1;
+		return 0;
+	}
 
-	if ((frame->infos_bitmap & bitmask) != bitmask) {
-		ERROR("invalid frame info bitmap : %08x", frame->infos_bitmap);
-		return -1;
+	if (!(frame->infos_bitmap & FRAME_INFO_INDEX_MASK))
+		goto invalid;
+
+	if (frame_phases != FRAME_PHASES_TRI &&
+	    frame_match(frame, FRAME_INFO_MONO_MASK)) {
+		frame->phases = 1;
+		return 0;
 	}
 
-	return 0;
+	if (frame_phases != FRAME_PHASES_MONO &&
+	    frame_match(frame, FRAME_INFO_TRI_MASK)) {
+		frame->phases = 3;
+		return 0;
+	}
+
+invalid:
+	ERROR("invalid frame info bitmap : %010llx", frame->infos_bitmap);
+	return -1;
 }
 
 struct frame *frame_new(const char *buffer, size_t len)
 {
-	static int frame_num;
+	static unsigned int frame_num;
 
 	struct frame *frame;
-	unsigned int i;
+	unsigned short delims[MAX_FRAME_LENGTH];
+	unsigned int ndelims;
+	unsigned int i, d;
 	unsigned int start_info = 0;
 
 	if (len > MAX_FRAME_LENGTH) {
 		ERROR("frame buffer is too large: %d", len);
+		TRACE(frame_reject, len);
 		return NULL;
 	}
 
 	if (buffer[0] != '\n' || buffer[len - 1] != '\r') {
 		ERROR("frame buffer is not correctly formatted");
+		TRACE(frame_reject, len);
 		return NULL;
 	}
 
@@ -448,12 +576,15 @@ struct frame *frame_new(const char *buffer, size_t len)
 	memcpy(frame->buffer, buffer, len);
 	frame->len = len;
 
-	/* now loop on the frame buffer and try to decode and collect
-	 * frame infos
+	/* now loop on the group delimiters of the frame buffer and
+	 * try to decode and collect frame infos
 	 */
-	for (i = 0; i < len; i++) {
+	ndelims = scan_delims(frame->buffer, len, '\r', delims,
+			      ARRAY_SIZE(delims));
+	for (d = 0; d < ndelims; d++) {
 		struct frame_info *finfo;
 
+		i = delims[d];
 		if (frame->ninfos == FRAME_INFO_MAX) {
 			WARN("max frame info reached. dropping %d bytes",
 			     len - i);
@@ -469,10 +600,8 @@ struct frame *frame_new(const char *buffer, size_t len)
 
 			finfo = frame_info_new(&frame->buffer[start_info],
 					       i - start_info);
-			if (!finfo) {
-				frame_destroy(frame);
-				return NULL;
-			}
+			if (!finfo)
+				goto reject;
 
 			frame_info_add(frame, finfo);
 			break;
@@ -482,87 +611,40 @@ struct frame *frame_new(const char *buffer, size_t len)
 		}
 	}
 
-	if (frame_validate(frame)) {
-		frame_destroy(frame);
-		return NULL;
-	}
+	if (frame_validate(frame))
+		goto reject;
 
 	/*
 	 * timestamp will be udpated if frame is added to the stack
 	 */
 	frame->timestamp = 0;
-	frame->num = frame_num++;
+	/* frames can be decoded in parallel, see decode.c */
+	frame->num = __atomic_fetch_add(&frame_num, 1, __ATOMIC_RELAXED);
+	TRACE(frame_accept, frame->num, frame->ninfos, frame->power);
 	return frame;
-}
-
-static int energy_days[7];
-static int energy_hours[24];
-
-static inline int mod(int a, int b)
-{
-	int ret = a % b;
-
-	return (ret < 0) ? ret + b : ret;
-}
-
-static void energy_update(struct frame *frame)
-{
-	struct tm tm;
-
-	localtime_r(&frame->timestamp, &tm);
 
-	energy_days[mod(tm.tm_wday, ARRAY_SIZE(energy_days))] =
-		    frame->energy;
-	energy_hours[mod(tm.tm_hour, ARRAY_SIZE(energy_hours))] =
-		     frame->energy;
+reject:
+	TRACE(frame_reject, len);
+	frame_destroy(frame);
+	return NULL;
 }
 
-static double energy_deltas(const int *array, size_t size, double *deltas)
-{
-	unsigned int i;
-	double total = 0;
-
-	for (i = 0; i < size; i++) {
-		unsigned int current = array[i];
-		unsigned int    prev = array[mod(i - 1, size)];
+struct frame *frame_stack;
 
-		if (prev && current > prev) {
-			deltas[i] = (double)(current - prev) / 1000;
-			total += deltas[i];
-		} else {
-			deltas[i] = 0;
-		}
-	}
-	return total;
-}
+/*
+ * Downtime of the daemon, the power is not extrapolated over it
+ */
+static struct {
+	time_t start;
+	time_t end;
+} frame_stack_gap;
 
-int energy_print(char *buffer, size_t len)
+void frame_stack_set_gap(time_t start, time_t end)
 {
-	unsigned int i;
-	int n = 0;
-	double total = 0;
-	double deltas[ARRAY_SIZE(energy_hours)];
-
-	total = energy_deltas(energy_days, ARRAY_SIZE(energy_days), deltas);
-	n += snprintf(buffer + n, len - n, "days [%06.3f]: ", total);
-	for (i = 0; i < ARRAY_SIZE(energy_days); i++)
-		n += snprintf(buffer + n, len - n, "%06.3f ", deltas[i]);
-	n += snprintf(buffer + n, len - n, "\n");
-
-	total = energy_deltas(energy_hours, ARRAY_SIZE(energy_hours),
-			      deltas);
-	n += snprintf(buffer + n, len - n, "hours[%06.3f]: ", total);
-	for (i = 0; i < ARRAY_SIZE(energy_hours); i++)
-		n += snprintf(buffer + n, len - n, "%06.3f ", deltas[i]);
-	n += snprintf(buffer + n, len - n, "\n");
-
-	return n;
+	frame_stack_gap.start = start;
+	frame_stack_gap.end = end;
 }
 
-#define FRAME_STACK_DEPTH (60 * 60) /* seconds */
-
-struct frame *frame_stack;
-
 int frame_stack_clear(struct frame *frame)
 {
 	unsigned int count = 0;
@@ -634,22 +716,30 @@ int frame_stack_add(struct frame *frame)
 {
 	struct timeval now;
 	unsigned int count = 0;
+	unsigned int evicted;
 	struct frame *frame_prev = NULL;
 
-	gettimeofday(&now, NULL);
-	frame->timestamp = now.tv_sec;
+	/* restored frames are already timestamped */
+	if (!frame->timestamp) {
+		gettimeofday(&now, NULL);
+		frame->timestamp = now.tv_sec;
+	}
 
 	frame->next = frame_stack;
 	frame_stack = frame;
 
 	power_average_init(frame);
-	energy_update(frame);
 
 	/* check for aging frames */
 	while (frame) {
-		if (frame_prev)
-			power_average_update(frame->power,
-					     frame_prev->timestamp - frame->timestamp);
+		if (frame_prev) {
+			time_t delta = frame_prev->timestamp - frame->timestamp;
+
+			if (frame->timestamp <= frame_stack_gap.start &&
+			    frame_prev->timestamp >= frame_stack_gap.end)
+				delta = 0;
+			power_average_update(frame->power, delta);
+		}
 
 		if (frame_stack->timestamp - frame->timestamp >
 		    FRAME_STACK_DEPTH)
@@ -659,7 +749,11 @@ int frame_stack_add(struct frame *frame)
 		frame = frame->next;
 	}
 
-	frame_stack_clear(frame);
+	TRACE(stack_add, frame_stack->num, count);
+
+	evicted = frame_stack_clear(frame);
+	if (evicted)
+		TRACE(stack_evict, evicted);
 	if (frame_prev)
 		frame_prev->next = NULL;
 	return count;
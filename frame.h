@@ -52,6 +52,9 @@ enum frame_info_index {
 	FRAME_INFO_PPOT,
 
 	FRAME_INFO_ADPS,
+	FRAME_INFO_ADIR1,
+	FRAME_INFO_ADIR2,
+	FRAME_INFO_ADIR3,
 
 	FRAME_INFO_MAX
 };
@@ -64,15 +67,27 @@ struct frame_info {
 };
 
 #define MAX_FRAME_LENGTH	512 /* should be enough for one frame */
+#define FRAME_STACK_DEPTH	(60 * 60) /* seconds */
+
+enum frame_phases {
+	FRAME_PHASES_AUTO,
+	FRAME_PHASES_MONO,
+	FRAME_PHASES_TRI,
+};
 
 struct frame {
 	unsigned int num;
 	unsigned int ninfos;
 	struct frame_info *infos[FRAME_INFO_MAX];
-	unsigned long infos_bitmap;
+	unsigned long long infos_bitmap;
 	time_t timestamp;	/* seconds is enough */
+	unsigned long long rx_time; /* ETX arrival, monotonic usecs */
 	unsigned int power;	/* Watt */
-	unsigned int energy;	/* Watt x h */
+	unsigned int phases;	/* 1 or 3 */
+	unsigned int current[3]; /* IINST per phase, Ampere */
+	unsigned int overload;	/* short frame of a phase overload */
+	unsigned int adir[3];	/* ADIR per phase, Ampere */
+	unsigned int energy;	/* Watt x h, all tariff indexes */
 	struct frame *next;
 	size_t len;
 	char buffer[/* len */];
@@ -82,8 +97,14 @@ extern void frame_destroy(struct frame *frame);
 extern struct frame *frame_new(const char *buffer, size_t len);
 extern void frame_log(const struct frame *frame);
 extern int frame_print(const struct frame *frame, char *buffer, size_t len);
+extern int frame_print_mask(const struct frame *frame,
+			    unsigned long long mask,
+			    char *buffer, size_t len);
 extern const char *frame_get_info(struct frame *frame, const char *label);
 extern int frame_info_set_default(const char *label, const char *value);
+extern int frame_info_lookup(const char *label);
+extern const char *frame_info_label(enum frame_info_index index);
+extern int frame_set_phases(const char *value);
 
 extern struct frame *frame_stack;
 
@@ -91,7 +112,6 @@ extern struct frame *frame_stack;
 extern int frame_stack_add(struct frame *frame);
 extern int frame_stack_average(time_t seconds);
 extern int frame_stack_clear(struct frame *frame);
-
-extern int energy_print(char *buffer, size_t len);
+extern void frame_stack_set_gap(time_t start, time_t end);
 
 #endif
@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "hist.h"
+
+static struct hist *hists;
+
+unsigned long long clock_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void hist_register(struct hist *h)
+{
+	struct hist **ph = &hists;
+
+	/* keep registration order for printing */
+	while (*ph)
+		ph = &(*ph)->next;
+	*ph = h;
+}
+
+static unsigned int hist_index(unsigned long long value)
+{
+	unsigned int msb;
+
+	if (value < HIST_SUB_COUNT)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+	if (msb >= HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
+
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB_COUNT +
+		((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+/*
+ * Upper bound of the values accounted in a bucket
+ */
+static unsigned long long hist_value(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < HIST_SUB_COUNT)
+		return index;
+
+	shift = index / HIST_SUB_COUNT - 1;
+	return ((unsigned long long)(HIST_SUB_COUNT + index % HIST_SUB_COUNT + 1)
+		<< shift) - 1;
+}
+
+void hist_add(struct hist *h, unsigned long long value)
+{
+	h->buckets[hist_index(value)]++;
+	h->count++;
+	h->total += value;
+	if (value > h->max)
+		h->max = value;
+}
+
+unsigned long long hist_quantile(const struct hist *h, double q)
+{
+	unsigned long rank = q * h->count;
+	unsigned long count = 0;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		count += h->buckets[i];
+		if (count > rank)
+			break;
+	}
+
+	/* the bucket bound can be above the largest value */
+	return hist_value(i) < h->max ? hist_value(i) : h->max;
+}
+
+void hist_reset_all(void)
+{
+	struct hist *h;
+
+	for (h = hists; h; h = h->next) {
+		memset(h->buckets, 0, sizeof(h->buckets));
+		h->count = 0;
+		h->max = 0;
+		h->total = 0;
+	}
+}
+
+void hist_foreach(void (*cb)(const struct hist *h, void *data), void *data)
+{
+	struct hist *h;
+
+	for (h = hists; h; h = h->next)
+		cb(h, data);
+}
+
+int hist_print_all(char *buffer, size_t len)
+{
+	struct hist *h;
+	int n;
+
+	n = snprintf(buffer, len, "%-16s %8s %8s %8s %8s %8s (us)\n",
+		     "stage", "count", "p50", "p90", "p99", "max");
+
+	for (h = hists; h; h = h->next) {
+		n += snprintf(buffer + n, len - n,
+			      "%-16s %8lu %8.1f %8.1f %8.1f %8.1f\n", h->name,
+			      h->count, hist_quantile(h, 0.50) / 1000.,
+			      hist_quantile(h, 0.90) / 1000.,
+			      hist_quantile(h, 0.99) / 1000., h->max / 1000.);
+		if ((size_t)n >= len)
+			return len - 1;
+	}
+	return n;
+}
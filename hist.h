@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef EDFINFO_HIST_H
+#define EDFINFO_HIST_H
+
+#include <stddef.h>
+
+/*
+ * Log-linear (HDR like) histograms of durations in nanoseconds. Each
+ * power of 2 is split in 16 sub-buckets, which gives a relative
+ * error below 6.25%. Values above 2^40 ns (~18 minutes) are clamped.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB_COUNT	(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS	40
+#define HIST_BUCKETS	((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct hist {
+	char			name[32];
+	unsigned long		count;
+	unsigned long long	max;
+	unsigned long long	total;
+	unsigned long		buckets[HIST_BUCKETS];
+	struct hist		*next;
+};
+
+#define hist_define(var, hname)						\
+struct hist var = { .name = hname };					\
+									\
+static void __attribute__((constructor)) __hist_init_ ## var(void)	\
+{									\
+	hist_register(&var);						\
+}
+
+extern unsigned long long clock_nsecs(void);
+extern void hist_register(struct hist *h);
+extern void hist_add(struct hist *h, unsigned long long value);
+extern unsigned long long hist_quantile(const struct hist *h, double q);
+extern void hist_reset_all(void);
+extern int hist_print_all(char *buffer, size_t len);
+extern void hist_foreach(void (*cb)(const struct hist *h, void *data),
+			 void *data);
+
+#endif
@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "edfinfo.h"
+#include "frame.h"
+#include "backend.h"
+#include "energy.h"
+#include "loadcurve.h"
+
+#define LOADCURVE_POINTS	144	/* one day of 10 minutes intervals */
+#define LOADCURVE_GAP		10	/* seconds without frames */
+
+static unsigned int interval = 30 * 60; /* seconds */
+
+static struct loadcurve_point points[LOADCURVE_POINTS];
+static unsigned int points_head;
+static unsigned int points_count;
+
+static struct loadcurve_point current;
+static time_t current_end;
+
+/* last frame */
+static time_t last_timestamp;
+static unsigned int last_power;
+static int last_tariff = -1;
+static uint32_t last_index[ENERGY_TARIFF_MAX];
+
+/* cached local day boundaries */
+static time_t day_start;
+static time_t day_end;
+
+#define MATCH(n) (strcmp(name, n) == 0)
+
+int loadcurve_configure(const char *name, const char *value)
+{
+	if (MATCH("interval")) {
+		interval = atoi(value) * 60;
+		if (interval != 10 * 60 && interval != 30 * 60) {
+			fprintf(stderr, "invalid load curve interval '%s'\n",
+				value);
+			return 0;
+		}
+	} else {
+		fprintf(stderr, "unknown config name loadcurve/%s\n", name);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Intervals are computed from the local midnight. The day boundaries
+ * are only computed when the day changes. UTC offsets are multiples
+ * of 30 minutes, so intervals stay aligned on DST changes.
+ */
+static void loadcurve_interval(time_t t, time_t *start, time_t *end)
+{
+	if (t < day_start || t >= day_end) {
+		struct tm tm;
+
+		localtime_r(&t, &tm);
+		tm.tm_hour = 0;
+		tm.tm_min = 0;
+		tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		day_start = mktime(&tm);
+		tm.tm_mday++;
+		tm.tm_isdst = -1;
+		day_end = mktime(&tm);
+	}
+
+	*start = day_start + (t - day_start) / interval * interval;
+	*end = *start + interval;
+	if (*end > day_end)
+		*end = day_end;
+}
+
+static void loadcurve_close(void)
+{
+	points_head = (points_head + 1) % LOADCURVE_POINTS;
+	points[points_head] = current;
+	if (points_count < LOADCURVE_POINTS)
+		points_count++;
+
+	backend_push_loadcurve(&current);
+}
+
+static void loadcurve_open(time_t t)
+{
+	time_t start;
+
+	loadcurve_interval(t, &start, &current_end);
+	memset(&current, 0, sizeof(current));
+	current.start = start;
+	current.duration = current_end - start;
+}
+
+/*
+ * Apparent power of the previous frame, over [from, to[
+ */
+static void loadcurve_integrate(time_t from, time_t to)
+{
+	if (last_tariff < 0 || to <= from)
+		return;
+
+	current.vas[last_tariff] += (uint64_t)last_power * (to - from);
+	current.secs[last_tariff] += to - from;
+	current.covered += to - from;
+	current.tariffs |= 1 << last_tariff;
+}
+
+void loadcurve_update(const struct frame *frame)
+{
+	time_t t = frame->timestamp;
+	int gap = !last_timestamp || t - last_timestamp > LOADCURVE_GAP;
+	unsigned int i, j;
+
+	if (t < last_timestamp)
+		return;
+
+	if (!current.start) {
+		loadcurve_open(t);
+	} else if (t >= current_end) {
+		if (!gap)
+			loadcurve_integrate(last_timestamp, current_end);
+		loadcurve_close();
+		loadcurve_open(t);
+		if (!gap)
+			loadcurve_integrate(current.start, t);
+	} else if (!gap) {
+		loadcurve_integrate(last_timestamp, t);
+	}
+
+	last_timestamp = t;
+	last_power = frame->power;
+	last_tariff = -1;
+
+	for (i = 0; i < frame->ninfos; i++) {
+		const struct frame_info *finfo = frame->infos[i];
+
+		if (finfo->index == FRAME_INFO_PTEC) {
+			last_tariff = energy_tariff_ptec(finfo->value);
+			continue;
+		}
+
+		for (j = 0; j < ENERGY_TARIFF_MAX; j++) {
+			uint32_t index;
+
+			if (finfo->index != energy_tariff_index(j))
+				continue;
+
+			index = strtoul(finfo->value, NULL, 10);
+			if (last_index[j] && index >= last_index[j]) {
+				current.wh[j] += index - last_index[j];
+				current.tariffs |= 1 << j;
+			}
+			last_index[j] = index;
+			break;
+		}
+	}
+}
+
+/*
+ * Average apparent power (VA) over the covered time
+ */
+unsigned int loadcurve_power(const struct loadcurve_point *p)
+{
+	uint64_t vas = 0;
+	unsigned int i;
+
+	for (i = 0; i < ENERGY_TARIFF_MAX; i++)
+		vas += p->vas[i];
+
+	return p->covered ? vas / p->covered : 0;
+}
+
+uint32_t loadcurve_energy(const struct loadcurve_point *p)
+{
+	uint32_t wh = 0;
+	unsigned int i;
+
+	for (i = 0; i < ENERGY_TARIFF_MAX; i++)
+		wh += p->wh[i];
+	return wh;
+}
+
+static int loadcurve_print_point(const struct loadcurve_point *p,
+				 char *buffer, size_t len)
+{
+	char date[32];
+	struct tm tm;
+	unsigned int i;
+	int n;
+
+	localtime_r(&p->start, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm);
+	n = snprintf(buffer, len, "%-16s %5u %6u %6u", date, p->covered,
+		     loadcurve_power(p), loadcurve_energy(p));
+
+	for (i = 0; i < ENERGY_TARIFF_MAX && (size_t)n < len; i++) {
+		unsigned int va;
+
+		if (!(p->tariffs & (1 << i)))
+			continue;
+
+		va = p->secs[i] ? p->vas[i] / p->secs[i] : 0;
+		n += snprintf(buffer + n, len - n, " %s:%u/%u",
+			      energy_tariff_name(i), p->wh[i], va);
+	}
+	if ((size_t)n < len)
+		n += snprintf(buffer + n, len - n, "\n");
+	return n;
+}
+
+/*
+ * Last @count closed intervals, oldest first, then the current one
+ */
+int loadcurve_print(unsigned int count, char *buffer, size_t len)
+{
+	unsigned int i;
+	int n;
+
+	if (!count || count > points_count)
+		count = points_count;
+
+	n = snprintf(buffer, len, "%-16s %5s %6s %6s %s\n", "interval",
+		     "secs", "VA", "Wh", "tariff:Wh/VA");
+
+	for (i = 0; i < count && (size_t)n < len; i++) {
+		unsigned int slot = (points_head + LOADCURVE_POINTS - count +
+				     1 + i) % LOADCURVE_POINTS;
+
+		n += loadcurve_print_point(&points[slot], buffer + n, len - n);
+	}
+
+	if (current.start && (size_t)n < len)
+		n += loadcurve_print_point(&current, buffer + n, len - n);
+
+	return (size_t)n < len ? n : (int)len - 1;
+}
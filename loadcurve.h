@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef EDFINFO_LOADCURVE_H
+#define EDFINFO_LOADCURVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "energy.h"
+
+struct frame;
+
+/*
+ * Load curve (courbe de charge) point. Intervals are aligned on the
+ * local time and the consumption is split per tariff period (PTEC),
+ * from the index deltas and from the integral of the apparent power.
+ */
+struct loadcurve_point {
+	time_t		start;
+	unsigned int	duration;	/* seconds */
+	unsigned int	covered;	/* seconds with frames */
+	uint32_t	tariffs;	/* bitmap of tariffs seen */
+	uint32_t	wh[ENERGY_TARIFF_MAX];		/* index deltas */
+	uint64_t	vas[ENERGY_TARIFF_MAX];		/* PAPP x seconds */
+	unsigned int	secs[ENERGY_TARIFF_MAX];	/* PTEC time */
+};
+
+extern int loadcurve_configure(const char *name, const char *value);
+extern void loadcurve_update(const struct frame *frame);
+extern unsigned int loadcurve_power(const struct loadcurve_point *point);
+extern uint32_t loadcurve_energy(const struct loadcurve_point *point);
+extern int loadcurve_print(unsigned int count, char *buffer, size_t len);
+
+#endif
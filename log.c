@@ -18,6 +18,9 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/uio.h>
 
 #include <asm/unistd.h>
 
@@ -55,38 +58,254 @@ int log_name_to_priority(const char *name)
 	return c->c_val != -1 ? c->c_val : LOG_WARNING;
 }
 
+#define LOG_LINE_SIZE	512
+#define LOG_RING_SIZE	256 /* power of 2 */
+#define LOG_BATCH	64
+#define LOG_WAIT_USEC	100 /* for a free slot */
+
+/*
+ * Messages are formatted by the caller in a lock-free ring buffer
+ * (bounded MPSC queue, mosquitto callbacks also log) and written in
+ * batches by a background thread. When the ring is full, the caller
+ * waits for the writer to free a slot, messages are only dropped if
+ * they can not be written.
+ */
+static struct log_entry {
+	unsigned long	seq;
+	int		priority;
+	size_t		len;
+	char		line[LOG_LINE_SIZE];
+} log_ring[LOG_RING_SIZE];
+
+static unsigned long log_head;	/* next slot to fill, producers */
+static unsigned long log_tail;	/* next slot to write, writer thread */
+
+static sem_t log_sem;
+static pthread_t log_thread;
+static int log_running;
+static pid_t log_pid;
+
+unsigned long log_dropped;
+unsigned long log_written;
+
+static void log_syslog_open(void)
+{
+	static int opened;
+
+	/* keep the connection to syslog for the daemon lifetime */
+	if (!opened) {
+		openlog(progname, LOG_PID | LOG_CONS | LOG_NDELAY, LOG_USER);
+		opened = 1;
+	}
+}
+
+static size_t log_format(char *buffer, size_t size, int priority,
+			 const char *format, va_list args)
+{
+	size_t n = 0;
+
+	/* syslog adds its own prefix */
+	if (log_fd != -1)
+		n = snprintf(buffer, size, "%s %d: %s - ", progname,
+			     log_pid ? log_pid : getpid(),
+			     log_priority_to_name(priority));
+
+	n += vsnprintf(buffer + n, size - n, format, args);
+
+	/* truncate, keeping room for the newline */
+	if (n >= size - 1)
+		n = size - 2;
+
+	buffer[n++] = '\n';
+	return n;
+}
+
+static struct log_entry *log_ring_reserve(void)
+{
+	unsigned long pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	struct log_entry *e;
+
+	for (;;) {
+		long dif;
+
+		e = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		dif = (long)__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) -
+			(long)pos;
+
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&log_head, &pos,
+							pos + 1, 1,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return NULL; /* full */
+		} else {
+			pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	return e; /* private until committed */
+}
+
+static void log_ring_commit(struct log_entry *e)
+{
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+	sem_post(&log_sem);
+}
+
+static void log_write(struct log_entry **entries, unsigned int count)
+{
+	struct iovec iov[LOG_BATCH];
+	unsigned int i;
+
+	if (log_fd == -1) {
+		for (i = 0; i < count; i++) {
+			entries[i]->line[entries[i]->len - 1] = '\0';
+			syslog(entries[i]->priority, "%s", entries[i]->line);
+		}
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = entries[i]->line;
+		iov[i].iov_len = entries[i]->len;
+	}
+
+	if (writev(log_fd, iov, count) < 0)
+		__atomic_fetch_add(&log_dropped, count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Write all committed entries. Only one consumer at a time.
+ */
+static void log_drain(void)
+{
+	struct log_entry *entries[LOG_BATCH];
+	unsigned long start = log_tail;
+	unsigned int count = 0;
+	unsigned int i;
+
+	for (;;) {
+		struct log_entry *e = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+
+		if (count == LOG_BATCH ||
+		    __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != log_tail + 1) {
+			if (!count)
+				break;
+
+			log_write(entries, count);
+			for (i = 0; i < count; i++)
+				__atomic_store_n(&entries[i]->seq,
+						 start + i + LOG_RING_SIZE,
+						 __ATOMIC_RELEASE);
+			log_written += count;
+			start = log_tail;
+			count = 0;
+			continue;
+		}
+
+		entries[count++] = e;
+		log_tail++;
+	}
+}
+
+static void *log_writer(void *arg __unused)
+{
+	while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		TEMP_FAILURE_RETRY(sem_wait(&log_sem));
+		log_drain();
+	}
+	log_drain();
+	return NULL;
+}
+
 void __log(int priority, const  char *format, ...)
 {
-	char buffer[512];
+	char buffer[LOG_LINE_SIZE];
+	struct log_entry *e;
 	va_list args;
 	size_t n;
 
-	if (log_fd == -1)  {
-		if (config.daemonize) {
-			openlog(progname, LOG_PID | LOG_CONS, LOG_USER);
-			va_start(args, format);
-			vsyslog(priority, format, args);
-			va_end(args);
-			closelog();
+	if (log_fd == -1 && !config.daemonize)
+		return;
+
+	while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		e = log_ring_reserve();
+		if (!e) {
+			usleep(LOG_WAIT_USEC);
+			continue;
 		}
+
+		va_start(args, format);
+		e->len = log_format(e->line, sizeof(e->line), priority,
+				    format, args);
+		va_end(args);
+		e->priority = priority;
+		log_ring_commit(e);
 		return;
 	}
 
-	n = snprintf(buffer, sizeof(buffer), "%s %d: %s - ", progname,
-		     getpid(), log_priority_to_name(priority));
-
+	/* synchronous path, when the writer thread is not running */
 	va_start(args, format);
-	n += vsnprintf(buffer + n, sizeof(buffer) - n, format, args);
+	n = log_format(buffer, sizeof(buffer), priority, format, args);
 	va_end(args);
 
-	if (n >= sizeof(buffer) - 1) {
-		WARN("truncated next event from %d to %zd bytes", n,
-		     sizeof(buffer));
-		n = sizeof(buffer) - 1;
+	if (log_fd == -1) {
+		log_syslog_open();
+		buffer[n - 1] = '\0';
+		syslog(priority, "%s", buffer);
+		return;
+	}
+
+	if (write(log_fd, buffer, n) < 0)
+		log_dropped++;
+}
+
+/*
+ * Start the background writer. Must be called after daemon() since
+ * threads do not survive fork().
+ */
+int log_start(void)
+{
+	unsigned int i;
+	int ret;
+
+	if (log_fd == -1 && !config.daemonize)
+		return 0;
+
+	if (log_fd == -1)
+		log_syslog_open();
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		log_ring[i].seq = i;
+	log_head = log_tail = 0;
+	log_pid = getpid();
+
+	sem_init(&log_sem, 0, 0);
+	log_running = 1;
+
+	ret = pthread_create(&log_thread, NULL, log_writer, NULL);
+	if (ret) {
+		log_running = 0;
+		ERROR("failed to start log writer: %s", strerror(ret));
+		return -1;
 	}
+	return 0;
+}
+
+/*
+ * Flush pending messages and return to synchronous logging
+ */
+void log_stop(void)
+{
+	if (!log_running)
+		return;
 
-	buffer[n] = '\n';
-	write(log_fd, buffer, n + 1);
+	__atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+	sem_post(&log_sem);
+	pthread_join(log_thread, NULL);
+	sem_destroy(&log_sem);
 }
 
 int log_open(const char *filename)
@@ -41,9 +41,13 @@
 	} while (0)
 
 extern int log_fd;
+extern unsigned long log_dropped;
+extern unsigned long log_written;
 
 extern void __log(int priority, const  char *format, ...);
 extern int log_open(const char *name);
+extern int log_start(void);
+extern void log_stop(void);
 extern int log_name_to_priority(const char *name);
 extern const char *log_priority_to_name(int priority);
 
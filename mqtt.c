@@ -11,7 +11,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <mosquitto.h>
+#include <mqtt_protocol.h>
 #include <errno.h>
 
 #include "log.h"
@@ -19,6 +23,11 @@
 #include "frame.h"
 #include "backend.h"
 #include "stats.h"
+#include "power.h"
+#include "loadcurve.h"
+#include "phase.h"
+#include "rule.h"
+#include "cost.h"
 
 static struct mqtt_config {
 	const char	*host;
@@ -28,6 +37,11 @@ static struct mqtt_config {
 	const char	*topic;
 	int             ratelimit;
 	int             threshold;
+	int		labels;
+	int		protocol;
+	int		aliases;
+	int		expiry;
+	int		batch;
 } mqtt_config = {
 	.host		= "localhost",
 	.port		= 1883,
@@ -36,6 +50,11 @@ static struct mqtt_config {
 	.topic		= "sensors/power/edfinfo",
 	.ratelimit	= 60, /* Seconds */
 	.threshold	= 20, /* Watts */
+	.labels		= 0,
+	.protocol	= MQTT_PROTOCOL_V311,
+	.aliases	= 64,
+	.expiry		= 0,
+	.batch		= 0,
 };
 
 #define MATCH(n) (strcmp(name, n) == 0)
@@ -54,6 +73,23 @@ static int mqtt_configure(const char *name, const char *value)
 		mqtt_config.ratelimit = atoi(value);
 	} else if (MATCH("threshold")) {
 		mqtt_config.threshold = atoi(value);
+	} else if (MATCH("labels")) {
+		mqtt_config.labels = atoi(value);
+	} else if (MATCH("protocol")) {
+		if (!strcmp(value, "5")) {
+			mqtt_config.protocol = MQTT_PROTOCOL_V5;
+		} else if (!strcmp(value, "3.1.1")) {
+			mqtt_config.protocol = MQTT_PROTOCOL_V311;
+		} else {
+			fprintf(stderr, "invalid mqtt protocol '%s'\n", value);
+			return 0;
+		}
+	} else if (MATCH("aliases")) {
+		mqtt_config.aliases = atoi(value);
+	} else if (MATCH("expiry")) {
+		mqtt_config.expiry = atoi(value);
+	} else if (MATCH("batch")) {
+		mqtt_config.batch = atoi(value);
 	} else {
 		fprintf(stderr, "unknown config name mqtt/%s\n", name);
 		return 0;  /* unknown section/name, error */
@@ -65,6 +101,64 @@ static int mqtt_configure(const char *name, const char *value)
 
 static struct mosquitto *mqtt_broker;
 static bool mqtt_connected;
+static bool mqtt_loop_started;
+static struct backend *mqtt_backend;
+
+/*
+ * Per label topics, <topic>/<LABEL>, built once for each topic. The
+ * last value sent is kept to only publish the changes.
+ */
+#define BIT(nr)		(1ULL << (nr))
+
+static const char *label_topics_base;
+static char label_topics[FRAME_INFO_MAX][64];
+static char label_values[FRAME_INFO_MAX][16];
+static unsigned long long label_sent;
+static bool label_stale;
+
+/*
+ * MQTT v5 topic aliases. The first publish on a topic carries the
+ * topic and its alias, the next ones only the alias. When all the
+ * aliases allowed by the broker are used, the least recently used one
+ * is mapped to the new topic. Aliases only live as long as the
+ * connection.
+ */
+#define MQTT_ALIAS_MAX		64
+
+static struct mqtt_alias {
+	char			topic[64];
+	mosquitto_property	*props;
+	size_t			props_len;
+	unsigned long		used;
+	bool			sent;
+} aliases[MQTT_ALIAS_MAX];
+static unsigned int naliases;
+static unsigned int alias_max;		/* allowed by the broker */
+static unsigned long alias_clock;
+static bool alias_reset;
+
+/* properties of the publishes without alias */
+static mosquitto_property *props_expiry;
+static size_t props_expiry_len;
+
+/*
+ * Size of the packets sent on the wire, for the last push and the
+ * aliases in use
+ */
+enum {
+	WIRE_STAT_FRAME,
+	WIRE_STAT_ALIASES,
+	WIRE_STAT_MAX,
+};
+
+static struct stats_entry wire_stats[WIRE_STAT_MAX] = {
+	[WIRE_STAT_FRAME]	= STATS_GAUGE("frame_bytes"),
+	[WIRE_STAT_ALIASES]	= STATS_GAUGE("aliases"),
+};
+static struct stats_group wire_group = {
+	.name = "mqtt.wire", .entries = wire_stats, .count = WIRE_STAT_MAX,
+};
+static unsigned long frame_bytes;
 
 /*
  * Callbacks are handled in a different thread (with a mutex). See
@@ -81,6 +175,25 @@ static void on_connect(struct mosquitto *mosq __unused, void *data __unused,
 	NOTICE("mqtt: %s connected to broker %s", mqtt_config.id,
 	       mqtt_config.host);
 	mqtt_connected = true;
+	/* the broker may have lost the retained values */
+	label_stale = true;
+	alias_reset = true;
+	backend_stat_add(mqtt_backend, BACKEND_STAT_RECONNECTS, 1);
+}
+
+static void on_connect_v5(struct mosquitto *mosq, void *data, int rc,
+			  int flags __unused, const mosquitto_property *props)
+{
+	uint16_t max = 0;
+
+	mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM,
+				      &max, false);
+	alias_max = mqtt_config.aliases < max ? mqtt_config.aliases : max;
+	if (alias_max > MQTT_ALIAS_MAX)
+		alias_max = MQTT_ALIAS_MAX;
+	INFO("mqtt: using %d topic aliases, broker allows %d", alias_max, max);
+
+	on_connect(mosq, data, rc);
 }
 
 static void on_disconnect(struct mosquitto *mosq __unused, void *data __unused,
@@ -103,6 +216,8 @@ static int mqtt_init(void)
 	bool clean_session = true;
 	struct mosquitto *mosq = NULL;
 
+	mqtt_backend = backend_get("mqtt");
+
 	mosquitto_lib_init();
 
 	if (!mqtt_config.id) {
@@ -119,14 +234,42 @@ static int mqtt_init(void)
 		return -1;
 	}
 
-	mosquitto_connect_callback_set(mosq, on_connect);
+	if (mqtt_config.protocol == MQTT_PROTOCOL_V5) {
+		mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION,
+				     MQTT_PROTOCOL_V5);
+		mosquitto_connect_v5_callback_set(mosq, on_connect_v5);
+
+		if (mqtt_config.expiry) {
+			mosquitto_property_add_int32(&props_expiry,
+					MQTT_PROP_MESSAGE_EXPIRY_INTERVAL,
+					mqtt_config.expiry);
+			props_expiry_len = 1 + 4;
+		}
+	} else {
+		mosquitto_connect_callback_set(mosq, on_connect);
+	}
 	mosquitto_disconnect_callback_set(mosq, on_disconnect);
 	mosquitto_publish_callback_set(mosq, on_publish);
 
+	/* publishes are queued and written by mqtt_flush() */
+	if (mqtt_config.batch)
+		mosquitto_threaded_set(mosq, true);
+
+	stats_register(&wire_group);
 	mqtt_broker = mosq;
 	return 0;
 }
 
+static void mqtt_alias_clear(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < naliases; i++)
+		mosquitto_property_free_all(&aliases[i].props);
+	naliases = 0;
+	stats_set(&wire_stats[WIRE_STAT_ALIASES], 0);
+}
+
 static void mqtt_fini(void)
 {
 	if (mqtt_broker) {
@@ -135,16 +278,50 @@ static void mqtt_fini(void)
 		mosquitto_destroy(mqtt_broker);
 		mqtt_broker = NULL;
 	}
+	mqtt_connected = false;
+	mqtt_loop_started = false;
+	mqtt_alias_clear();
+	mosquitto_property_free_all(&props_expiry);
+	props_expiry_len = 0;
+	stats_unregister(&wire_group);
 	mosquitto_lib_cleanup();
 }
 
+/*
+ * Batch mode : the publishes of a push are only queued and written
+ * here, on a corked socket, so that they leave in as few segments as
+ * possible. The broker packets are also read and the keepalive pings
+ * sent from here.
+ */
+static int mqtt_flush(void)
+{
+	int sock = mosquitto_socket(mqtt_broker);
+	int on = 1, off = 0;
+	int ret;
+
+	if (sock >= 0)
+		setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	ret = mosquitto_loop(mqtt_broker, 0, 1);
+	if (sock >= 0)
+		setsockopt(sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+
+	if (ret) {
+		ERROR("mqtt: flush failed : %s", mosquitto_strerror(ret));
+		mqtt_connected = false;
+		/* connect again on next push */
+		mqtt_loop_started = false;
+	}
+	return ret;
+}
+
 static int mqtt_connect_loop(struct mosquitto *mosq)
 {
-	static bool loop_started;
 	int ret = 0;
 
-	if (loop_started)
-		return 0;
+	if (mqtt_loop_started) {
+		/* batch mode, wait for the CONNACK */
+		return mqtt_config.batch ? mqtt_flush() : 0;
+	}
 
 	ret = mosquitto_connect(mosq, mqtt_config.host, mqtt_config.port,
 				mqtt_config.keepalive);
@@ -159,13 +336,18 @@ static int mqtt_connect_loop(struct mosquitto *mosq)
 		return ret;
 	}
 
+	if (mqtt_config.batch) {
+		mqtt_loop_started = true;
+		return 0;
+	}
+
 	ret = mosquitto_loop_start(mosq);
 	if (ret) {
 		ERROR("mqtt: unable to start loop : %s",
 		      mosquitto_strerror(ret));
 		return ret;
 	}
-	loop_started = true;
+	mqtt_loop_started = true;
 	return 0;
 }
 
@@ -182,20 +364,271 @@ static int check_ratelimit(int ratelimit)
 	return 1;
 }
 
-static int mqtt_publish(const char *topic, const char *msg, size_t len)
+static struct mqtt_alias *mqtt_alias_get(const char *topic, bool retain)
+{
+	struct mqtt_alias *alias = NULL;
+	unsigned int i;
+
+	if (alias_reset) {
+		alias_reset = false;
+		mqtt_alias_clear();
+	}
+
+	for (i = 0; i < naliases; i++) {
+		if (!strcmp(aliases[i].topic, topic)) {
+			aliases[i].used = ++alias_clock;
+			return &aliases[i];
+		}
+	}
+
+	if (!alias_max || strlen(topic) >= sizeof(alias->topic))
+		return NULL;
+
+	if (naliases < alias_max) {
+		alias = &aliases[naliases++];
+		stats_set(&wire_stats[WIRE_STAT_ALIASES], naliases);
+	} else {
+		alias = &aliases[0];
+		for (i = 1; i < naliases; i++)
+			if (aliases[i].used < alias->used)
+				alias = &aliases[i];
+		mosquitto_property_free_all(&alias->props);
+	}
+
+	if (mosquitto_property_add_int16(&alias->props, MQTT_PROP_TOPIC_ALIAS,
+					 alias - aliases + 1))
+		return NULL;
+	alias->props_len = 1 + 2;
+
+	if (!retain && mqtt_config.expiry &&
+	    !mosquitto_property_add_int32(&alias->props,
+					  MQTT_PROP_MESSAGE_EXPIRY_INTERVAL,
+					  mqtt_config.expiry))
+		alias->props_len += 1 + 4;
+
+	strcpy(alias->topic, topic);
+	alias->used = ++alias_clock;
+	alias->sent = false;
+	return alias;
+}
+
+static size_t mqtt_varint_size(size_t n)
+{
+	return n < 128 ? 1 : n < 16384 ? 2 : n < 2097152 ? 3 : 4;
+}
+
+/*
+ * Size of a QoS 0 PUBLISH packet
+ */
+static size_t mqtt_wire_size(const char *topic, size_t props_len,
+			     size_t len)
 {
+	size_t remaining = 2 + (topic ? strlen(topic) : 0) + len;
+
+	if (mqtt_config.protocol == MQTT_PROTOCOL_V5)
+		remaining += mqtt_varint_size(props_len) + props_len;
+
+	return 1 + mqtt_varint_size(remaining) + remaining;
+}
+
+static int mqtt_publish_retain(const char *topic, const char *msg, size_t len,
+			       bool retain)
+{
+	const mosquitto_property *props = NULL;
+	struct mqtt_alias *alias = NULL;
+	size_t props_len = 0;
+	size_t size;
 	int ret = 0;
 	int msg_id;
 
-	ret = mosquitto_publish(mqtt_broker, &msg_id, topic, len, msg, 0, false);
+	if (mqtt_config.protocol == MQTT_PROTOCOL_V5) {
+		alias = mqtt_alias_get(topic, retain);
+		if (alias) {
+			props = alias->props;
+			props_len = alias->props_len;
+			if (alias->sent)
+				topic = NULL;
+		} else if (!retain) {
+			props = props_expiry;
+			props_len = props_expiry_len;
+		}
+
+		ret = mosquitto_publish_v5(mqtt_broker, &msg_id, topic, len,
+					   msg, 0, retain, props);
+	} else {
+		ret = mosquitto_publish(mqtt_broker, &msg_id, topic, len, msg,
+					0, retain);
+	}
+
 	if (ret) {
 		ERROR("mqtt: publish failed %d %s", ret,
 		      mosquitto_strerror(ret));
 		mosquitto_disconnect(mqtt_broker);
+	} else {
+		if (alias)
+			alias->sent = true;
+
+		size = mqtt_wire_size(topic, props_len, len);
+		backend_stat_add(mqtt_backend, BACKEND_STAT_BYTES, size);
+		frame_bytes += size;
 	}
 	return ret;
 }
 
+/*
+ * Called at the end of each push
+ */
+static int mqtt_push_end(int ret)
+{
+	if (mqtt_config.batch && mqtt_connected)
+		ret |= mqtt_flush();
+
+	if (frame_bytes) {
+		stats_set(&wire_stats[WIRE_STAT_FRAME], frame_bytes);
+		frame_bytes = 0;
+	}
+	return ret;
+}
+
+static int mqtt_publish(const char *topic, const char *msg, size_t len)
+{
+	return mqtt_publish_retain(topic, msg, len, false);
+}
+
+/*
+ * Power min/max over each window : <topic>/window/<secs> "min/max"
+ */
+static int mqtt_publish_windows(void)
+{
+	unsigned int window, min, max;
+	char topic[64];
+	char msg[32];
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < power_nwindows(); i++) {
+		if (power_window(i, &window, &min, &max))
+			continue;
+
+		snprintf(topic, sizeof(topic), "%s/window/%d",
+			 mqtt_config.topic, window);
+		ret = snprintf(msg, sizeof(msg), "%d/%d", min, max);
+		DEBUG("mqtt: msg size=%d \"%s\"", ret, msg);
+
+		ret = mqtt_publish(topic, msg, ret);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Three phases meters : <topic>/phases "I1/I2/I3" and
+ * <topic>/imbalance "percent"
+ */
+static int mqtt_publish_phases(const struct frame *frame)
+{
+	char topic[64];
+	char msg[32];
+	int ret;
+
+	snprintf(topic, sizeof(topic), "%s/phases", mqtt_config.topic);
+	ret = snprintf(msg, sizeof(msg), "%d/%d/%d", frame->current[0],
+		       frame->current[1], frame->current[2]);
+	DEBUG("mqtt: msg size=%d \"%s\"", ret, msg);
+
+	ret = mqtt_publish(topic, msg, ret);
+	if (ret)
+		return ret;
+
+	snprintf(topic, sizeof(topic), "%s/imbalance", mqtt_config.topic);
+	ret = snprintf(msg, sizeof(msg), "%d", phase_imbalance(frame));
+	DEBUG("mqtt: msg size=%d \"%s\"", ret, msg);
+
+	return mqtt_publish(topic, msg, ret);
+}
+
+/*
+ * Running cost : <topic>/cost "day/month"
+ */
+static int mqtt_publish_cost(void)
+{
+	char topic[64];
+	char msg[32];
+	int ret;
+
+	snprintf(topic, sizeof(topic), "%s/cost", mqtt_config.topic);
+	ret = snprintf(msg, sizeof(msg), "%.2f/%.2f",
+		       (double)cost_total(COST_DAY) / COST_UNIT,
+		       (double)cost_total(COST_MONTH) / COST_UNIT);
+	DEBUG("mqtt: msg size=%d \"%s\"", ret, msg);
+
+	return mqtt_publish(topic, msg, ret);
+}
+
+static void mqtt_label_topics(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < FRAME_INFO_MAX; i++)
+		snprintf(label_topics[i], sizeof(label_topics[i]), "%s/%s",
+			 mqtt_config.topic, frame_info_label(i));
+
+	label_topics_base = mqtt_config.topic;
+	label_sent = 0;
+}
+
+/*
+ * Each label : <topic>/<LABEL> "value", retained and only published
+ * when the value changes. The retained value of a label which is gone
+ * from the frames is cleared.
+ */
+static int mqtt_publish_labels(const struct frame *frame)
+{
+	unsigned long long gone;
+	unsigned int i;
+	int ret;
+
+	/* the topic changed on reload */
+	if (label_topics_base != mqtt_config.topic)
+		mqtt_label_topics();
+
+	if (label_stale) {
+		label_stale = false;
+		label_sent = 0;
+	}
+
+	for (i = 0; i < frame->ninfos; i++) {
+		const struct frame_info *finfo = frame->infos[i];
+		unsigned int index = finfo->index;
+
+		if ((label_sent & BIT(index)) &&
+		    !strcmp(label_values[index], finfo->value))
+			continue;
+
+		ret = mqtt_publish_retain(label_topics[index], finfo->value,
+					  strlen(finfo->value), true);
+		if (ret)
+			return ret;
+
+		snprintf(label_values[index], sizeof(label_values[index]),
+			 "%s", finfo->value);
+		label_sent |= BIT(index);
+	}
+
+	gone = label_sent & ~frame->infos_bitmap;
+	while (gone) {
+		i = __builtin_ctzll(gone);
+		gone &= gone - 1;
+
+		ret = mqtt_publish_retain(label_topics[i], "", 0, true);
+		if (ret)
+			return ret;
+		label_sent &= ~BIT(i);
+	}
+	return 0;
+}
+
 /*
  * frame filtering depending on power variations. This drops ~90% of
  * frames.
@@ -223,6 +656,12 @@ static int mqtt_push(const struct frame *frame)
 		return 0;
 	}
 
+	if (mqtt_config.labels) {
+		ret = mqtt_publish_labels(frame);
+		if (ret)
+			goto out;
+	}
+
 	if (check_ratelimit(mqtt_config.ratelimit)) {
 		/* Publish Index */
 		snprintf(topic, sizeof(topic), "%s/index", mqtt_config.topic);
@@ -244,13 +683,41 @@ static int mqtt_push(const struct frame *frame)
 		ret = mqtt_publish(topic, msg, ret);
 		if (ret)
 			goto out;
+
+		/* Publish power quantiles of the current hour */
+		snprintf(topic, sizeof(topic), "%s/quantiles",
+			 mqtt_config.topic);
+		ret = snprintf(msg, sizeof(msg), "%d/%d/%d",
+			       power_quantile(0.50), power_quantile(0.95),
+			       power_quantile(0.99));
+		DEBUG("mqtt: msg size=%d \"%s\"", ret, msg);
+
+		ret = mqtt_publish(topic, msg, ret);
+		if (ret)
+			goto out;
+
+		ret = mqtt_publish_windows();
+		if (ret)
+			goto out;
+
+		if (frame->phases == 3) {
+			ret = mqtt_publish_phases(frame);
+			if (ret)
+				goto out;
+		}
+
+		if (cost_enabled()) {
+			ret = mqtt_publish_cost();
+			if (ret)
+				goto out;
+		}
 	}
 
 	/* Publish Current Power */
 	if (filter_frame(frame)) {
 		INFO("discarding frame with power %d Watts", frame->power);
-		stats.mqtt_dropped++;
-		return 0;
+		backend_stat_add(mqtt_backend, BACKEND_STAT_DROPPED, 1);
+		goto out;
 	}
 
 	snprintf(topic, sizeof(topic), "%s/power", mqtt_config.topic);
@@ -260,16 +727,114 @@ static int mqtt_push(const struct frame *frame)
 	ret = mqtt_publish(topic, msg, ret);
 	if (ret)
 		goto out;
-	stats.mqtt_pushed++;
+	backend_stat_add(mqtt_backend, BACKEND_STAT_PUSHED, 1);
 out:
-	return ret;
+	return mqtt_push_end(ret);
+}
+
+/*
+ * Phase overload : <topic>/overload "ADIR1/ADIR2/ADIR3", published
+ * for every short frame, without rate limit nor filtering
+ */
+static int mqtt_push_overload(const struct frame *frame)
+{
+	char topic[64];
+	char msg[32];
+	int ret;
+
+	if (!mqtt_connected) {
+		mqtt_connect_loop(mqtt_broker);
+		return 0;
+	}
+
+	snprintf(topic, sizeof(topic), "%s/overload", mqtt_config.topic);
+	ret = snprintf(msg, sizeof(msg), "%d/%d/%d", frame->adir[0],
+		       frame->adir[1], frame->adir[2]);
+	DEBUG("mqtt: msg size=%d \"%s\"", ret, msg);
+
+	return mqtt_push_end(mqtt_publish(topic, msg, ret));
+}
+
+/*
+ * <topic>/loadcurve "start/VA/Wh" and for each tariff
+ * <topic>/loadcurve/<TARIFF> "Wh/VA". In batch mode, these are
+ * written with the frame.
+ */
+static int mqtt_push_loadcurve(const struct loadcurve_point *point)
+{
+	char topic[64];
+	char msg[64];
+	unsigned int i;
+	int ret;
+
+	if (!mqtt_connected)
+		return 0;
+
+	snprintf(topic, sizeof(topic), "%s/loadcurve", mqtt_config.topic);
+	ret = snprintf(msg, sizeof(msg), "%ld/%u/%u", (long)point->start,
+		       loadcurve_power(point), loadcurve_energy(point));
+	DEBUG("mqtt: msg size=%d \"%s\"", ret, msg);
+
+	ret = mqtt_publish(topic, msg, ret);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < ENERGY_TARIFF_MAX; i++) {
+		unsigned int va;
+
+		if (!(point->tariffs & (1 << i)))
+			continue;
+
+		va = point->secs[i] ? point->vas[i] / point->secs[i] : 0;
+		snprintf(topic, sizeof(topic), "%s/loadcurve/%s",
+			 mqtt_config.topic, energy_tariff_name(i));
+		ret = snprintf(msg, sizeof(msg), "%u/%u", point->wh[i], va);
+		DEBUG("mqtt: msg size=%d \"%s\"", ret, msg);
+
+		ret = mqtt_publish(topic, msg, ret);
+		if (ret)
+			return ret;
+	}
+	return 0;
 }
 
+/*
+ * Rule event : <topic>/event/<rule> "1/VALUE" when the rule fires
+ * and "0/VALUE" when it is cleared, without rate limit. In batch
+ * mode, these are written with the frame.
+ */
+static int mqtt_push_event(const struct rule_event *event)
+{
+	char topic[64];
+	char msg[32];
+	int ret;
+
+	if (!mqtt_connected)
+		return 0;
+
+	snprintf(topic, sizeof(topic), "%s/event/%s", mqtt_config.topic,
+		 event->rule);
+	ret = snprintf(msg, sizeof(msg), "%d/%s", event->active,
+		       event->value ? event->value : "");
+	DEBUG("mqtt: msg size=%d \"%s\"", ret, msg);
+
+	return mqtt_publish(topic, msg, ret);
+}
+
+/* the broker session is kept when these change */
+static const char * const mqtt_live[] = {
+	"topic", "ratelimit", "threshold", "labels", NULL
+};
+
 static struct backend_ops mqtt_ops = {
 	.configure = mqtt_configure,
 	.init = mqtt_init,
 	.push = mqtt_push,
 	.fini = mqtt_fini,
+	.push_loadcurve = mqtt_push_loadcurve,
+	.push_overload = mqtt_push_overload,
+	.push_event = mqtt_push_event,
+	.live = mqtt_live,
 };
 
 backend_register("mqtt", &mqtt_ops)
@@ -64,11 +64,14 @@ static int mysql_configure(const char *name, const char *value)
 
 static MYSQL my;
 static int mysql_retries;
+static struct backend *mysql_backend;
 
 static int mysql_myinit(void)
 {
 	my_bool my_true = 0;
 
+	mysql_backend = backend_get("mysql");
+
 	if (!mysql_init(&my)) {
 		ERROR("MySQL init failed !");
 		return -1;
@@ -88,6 +91,7 @@ static int mysql_myinit(void)
 	}
 
 	mysql_retries = 0;
+	backend_stat_add(mysql_backend, BACKEND_STAT_RECONNECTS, 1);
 	NOTICE("MySQL: connected to server %s", mysql_config.host);
 out:
 	/*
@@ -138,7 +142,8 @@ static int build_mysql_query(const struct frame *frame, char *query, size_t len)
 			      get_triphase_suffix(frame->infos[i]->label));
 	}
 
-	n += snprintf(query + n, len - n, ") VALUES (NOW()");
+	n += snprintf(query + n, len - n, ") VALUES (FROM_UNIXTIME(%lld)",
+		      (long long)frame->timestamp);
 	for (i = 0; i < frame->ninfos; i++) {
 		n += snprintf(query + n, len - n, ",'%s'",
 			      frame->infos[i]->value);
@@ -186,20 +191,25 @@ static int mysql_push(const struct frame *frame)
 	ret = mysql_query(&my, query);
 	if (ret) {
 		ERROR("MySQL query failed : %s", mysql_error(&my));
-		stats.mysql_error++;
 		mysql_myfini();
 	} else {
-		stats.mysql_pushed++;
+		backend_stat_add(mysql_backend, BACKEND_STAT_PUSHED, 1);
+		backend_stat_add(mysql_backend, BACKEND_STAT_BYTES,
+				 strlen(query));
 	}
 
 	return ret;
 }
 
+static const char * const mysql_live[] = { "table", "ratelimit", NULL };
+
 static struct backend_ops mysql_ops = {
 	.configure = mysql_configure,
 	.init = mysql_myinit,
 	.push = mysql_push,
-	.fini = mysql_myfini
+	.fini = mysql_myfini,
+	.live = mysql_live,
+	.all_meters = 1,
 };
 
 backend_register("mysql", &mysql_ops)
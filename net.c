@@ -0,0 +1,591 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "log.h"
+#include "edfinfo.h"
+#include "stats.h"
+#include "net.h"
+
+#define NET_BUFFER_SIZE		4096
+#define NET_RECONNECT		5 /* seconds */
+#define NET_BACKLOG		8
+#define NET_CLIENTS		16 /* per listener */
+#define NET_PEERS		16 /* per udp source */
+
+enum net_type {
+	NET_TCP,	/* connect to a remote serial server */
+	NET_LISTEN,	/* accept connections from serial servers */
+	NET_UDP,	/* receive datagrams */
+	NET_CLIENT,	/* connection accepted on a NET_LISTEN source */
+};
+
+static const char *net_type_names[] = {
+	[NET_TCP]	= "tcp",
+	[NET_LISTEN]	= "listen",
+	[NET_UDP]	= "udp",
+	[NET_CLIENT]	= "client",
+};
+
+/*
+ * Datagrams of different senders are decoded separately
+ */
+struct net_peer {
+	struct sockaddr_storage	addr;
+	socklen_t		addrlen;
+	unsigned long long	last;	/* usecs */
+	struct serial_parser	parser;
+};
+
+struct net_source {
+	char			*name;
+	enum net_type		type;
+	char			*host;
+	int			port;
+	int			reconnect;
+	int			max_clients;	/* NET_LISTEN only */
+
+	int			fd;
+	int			connecting;
+	unsigned long long	retry;	/* usecs */
+
+	unsigned long		rx_bytes;
+	unsigned long		frames;
+	unsigned long		reconnects;
+
+	struct serial_parser	parser;
+	struct net_peer		*peers;	/* NET_UDP only */
+	unsigned int		clients; /* NET_LISTEN only */
+	struct net_source	*listener; /* NET_CLIENT only */
+	struct net_source	*next;
+};
+
+static struct net_source *sources;
+
+static struct net_source *net_source_new(const char *name, enum net_type type)
+{
+	struct net_source *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		ERROR("could not allocate net source : %s", strerror(errno));
+		return NULL;
+	}
+
+	s->name = strdup(name);
+	s->type = type;
+	s->reconnect = NET_RECONNECT;
+	s->max_clients = NET_CLIENTS;
+	s->fd = -1;
+
+	s->next = sources;
+	sources = s;
+	return s;
+}
+
+static void net_source_free(struct net_source *s)
+{
+	free(s->peers);
+	free(s->name);
+	free(s->host);
+	free(s);
+}
+
+static struct net_source *net_source_find(const char *name)
+{
+	struct net_source *s;
+
+	for (s = sources; s; s = s->next)
+		if (s->type != NET_CLIENT && !strcmp(s->name, name))
+			return s;
+
+	return NULL;
+}
+
+static struct net_source *net_source_get(const char *name)
+{
+	struct net_source *s = net_source_find(name);
+
+	return s ? s : net_source_new(name, NET_TCP);
+}
+
+#define MATCH(n) (strcmp(key, n) == 0)
+
+int net_configure(const char *name, const char *key, const char *value)
+{
+	struct net_source *s = net_source_get(name);
+	unsigned int i;
+
+	if (!s)
+		return 0;
+
+	if (MATCH("type")) {
+		for (i = 0; i < NET_CLIENT; i++) {
+			if (!strcmp(value, net_type_names[i])) {
+				s->type = i;
+				return 1;
+			}
+		}
+		fprintf(stderr, "unknown net source type '%s'\n", value);
+		return 0;
+	} else if (MATCH("host")) {
+		s->host = strdup(value);
+	} else if (MATCH("port")) {
+		s->port = atoi(value);
+	} else if (MATCH("reconnect")) {
+		s->reconnect = atoi(value);
+	} else if (MATCH("clients")) {
+		s->max_clients = atoi(value);
+	} else {
+		fprintf(stderr, "unknown config name net:%s/%s\n", name, key);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int net_socket(struct net_source *s, int socktype, int passive,
+		      struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	char port[16];
+	int fd;
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = socktype;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+	snprintf(port, sizeof(port), "%d", s->port);
+
+	ret = getaddrinfo(s->host, port, &hints, &res);
+	if (ret) {
+		ERROR("net: %s: getaddrinfo(%s): %s", s->name,
+		      s->host ? s->host : "*", gai_strerror(ret));
+		return -1;
+	}
+
+	fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK |
+		    SOCK_CLOEXEC, res->ai_protocol);
+	if (fd < 0) {
+		ERROR("net: %s: socket() failed: %s", s->name,
+		      strerror(errno));
+	} else if (fd >= FD_SETSIZE) {
+		ERROR("net: %s: too many open files for select()", s->name);
+		close(fd);
+		fd = -1;
+	} else {
+		memcpy(addr, res->ai_addr, res->ai_addrlen);
+		*addrlen = res->ai_addrlen;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+static void net_disconnect(struct net_source *s)
+{
+	close(s->fd);
+	s->fd = -1;
+	s->connecting = 0;
+	s->parser.fillbuffer = 0;
+	s->retry = clock_usecs() + (unsigned long long)s->reconnect *
+		USEC_PER_SEC;
+}
+
+static int net_connect(struct net_source *s)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+
+	s->fd = net_socket(s, SOCK_STREAM, 0, &addr, &addrlen);
+	if (s->fd < 0) {
+		s->retry = clock_usecs() + (unsigned long long)s->reconnect *
+			USEC_PER_SEC;
+		return -1;
+	}
+
+	s->reconnects++;
+
+	/* completion is reported by select() on the write fd set */
+	if (connect(s->fd, (struct sockaddr *)&addr, addrlen) < 0 &&
+	    errno != EINPROGRESS) {
+		INFO("net: %s: connect(%s:%d) failed: %s", s->name, s->host,
+		     s->port, strerror(errno));
+		net_disconnect(s);
+		return -1;
+	}
+
+	s->connecting = 1;
+	return 0;
+}
+
+static int net_bind(struct net_source *s, int socktype)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int on = 1;
+
+	s->fd = net_socket(s, socktype, 1, &addr, &addrlen);
+	if (s->fd < 0)
+		return -1;
+
+	setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if (bind(s->fd, (struct sockaddr *)&addr, addrlen) < 0) {
+		ERROR("net: %s: bind(%d) failed: %s", s->name, s->port,
+		      strerror(errno));
+		goto fail;
+	}
+
+	if (socktype == SOCK_STREAM && listen(s->fd, NET_BACKLOG) < 0) {
+		ERROR("net: %s: listen() failed: %s", s->name,
+		      strerror(errno));
+		goto fail;
+	}
+
+	return 0;
+fail:
+	close(s->fd);
+	s->fd = -1;
+	return -1;
+}
+
+static int net_source_open(struct net_source *s)
+{
+	int ret = 0;
+
+	switch (s->type) {
+	case NET_TCP:
+		if (!s->host) {
+			ERROR("net: %s: no host defined", s->name);
+			return -1;
+		}
+		net_connect(s);
+		break;
+	case NET_LISTEN:
+		ret = net_bind(s, SOCK_STREAM);
+		break;
+	case NET_UDP:
+		ret = net_bind(s, SOCK_DGRAM);
+		break;
+	default:
+		break;
+	}
+
+	if (ret)
+		return ret;
+
+	NOTICE("net: %s: %s source on %s:%d", s->name,
+	       net_type_names[s->type], s->host ? s->host : "*", s->port);
+	return 0;
+}
+
+int net_open(void)
+{
+	struct net_source *s;
+
+	for (s = sources; s; s = s->next) {
+		if (s->type == NET_CLIENT)
+			continue;
+		if (net_source_open(s))
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Close a source, and the connections it accepted, before it is
+ * reconfigured or removed
+ */
+void net_remove(const char *name)
+{
+	struct net_source *listener = net_source_find(name);
+	struct net_source **ps = &sources;
+	struct net_source *s;
+
+	if (!listener)
+		return;
+
+	while ((s = *ps)) {
+		if (s == listener || s->listener == listener) {
+			*ps = s->next;
+			if (s->fd != -1)
+				close(s->fd);
+			net_source_free(s);
+		} else {
+			ps = &s->next;
+		}
+	}
+}
+
+int net_start(const char *name)
+{
+	struct net_source *s = net_source_find(name);
+
+	return s ? net_source_open(s) : 0;
+}
+
+/*
+ * Also (re)connects the TCP sources which are due
+ */
+int net_fd_set(fd_set *rfds, fd_set *wfds, int max)
+{
+	unsigned long long now = clock_usecs();
+	struct net_source *s;
+
+	for (s = sources; s; s = s->next) {
+		if (s->fd == -1 && s->type == NET_TCP && now >= s->retry)
+			net_connect(s);
+
+		if (s->fd == -1)
+			continue;
+
+		if (s->connecting)
+			FD_SET(s->fd, wfds);
+		else
+			FD_SET(s->fd, rfds);
+
+		if (s->fd > max)
+			max = s->fd;
+	}
+	return max;
+}
+
+static void net_accept(struct net_source *s)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	char host[NI_MAXHOST];
+	struct net_source *c;
+	int fd;
+
+	fd = accept4(s->fd, (struct sockaddr *)&addr, &addrlen,
+		     SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN)
+			ERROR("net: %s: accept() failed: %s", s->name,
+			      strerror(errno));
+		return;
+	}
+
+	/* select() can not watch more */
+	if (s->clients >= (unsigned int)s->max_clients || fd >= FD_SETSIZE) {
+		WARN("net: %s: too many connections, refusing one", s->name);
+		close(fd);
+		return;
+	}
+
+	c = net_source_new(s->name, NET_CLIENT);
+	if (!c) {
+		close(fd);
+		return;
+	}
+
+	if (getnameinfo((struct sockaddr *)&addr, addrlen, host, sizeof(host),
+			NULL, 0, NI_NUMERICHOST))
+		strcpy(host, "?");
+
+	c->host = strdup(host);
+	c->port = s->port;
+	c->fd = fd;
+	c->listener = s;
+	s->clients++;
+	s->reconnects++;
+	NOTICE("net: %s: accepted connection from %s", s->name, host);
+}
+
+static void net_connected(struct net_source *s)
+{
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	s->connecting = 0;
+	getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+	if (error) {
+		INFO("net: %s: connect(%s:%d) failed: %s", s->name, s->host,
+		     s->port, strerror(error));
+		net_disconnect(s);
+		return;
+	}
+
+	NOTICE("net: %s: connected to %s:%d", s->name, s->host, s->port);
+}
+
+/*
+ * The parser of the sender, a new one replaces the least recently
+ * seen sender when all are in use
+ */
+static struct serial_parser *net_peer_parser(struct net_source *s,
+					     const struct sockaddr_storage *addr,
+					     socklen_t addrlen)
+{
+	struct net_peer *peer, *oldest;
+	unsigned int i;
+
+	if (!s->peers) {
+		s->peers = calloc(NET_PEERS, sizeof(*s->peers));
+		if (!s->peers) {
+			ERROR("net: %s: could not allocate peers : %s",
+			      s->name, strerror(errno));
+			return NULL;
+		}
+	}
+
+	oldest = &s->peers[0];
+	for (i = 0; i < NET_PEERS; i++) {
+		peer = &s->peers[i];
+		if (peer->addrlen == addrlen &&
+		    !memcmp(&peer->addr, addr, addrlen))
+			goto out;
+		if (peer->last < oldest->last)
+			oldest = peer;
+	}
+
+	peer = oldest;
+	memset(peer, 0, sizeof(*peer));
+	memcpy(&peer->addr, addr, addrlen);
+	peer->addrlen = addrlen;
+out:
+	peer->last = clock_usecs();
+	return &peer->parser;
+}
+
+static void net_recv(struct net_source *s, serial_cb_t cb)
+{
+	static char buffer[NET_BUFFER_SIZE];
+	struct serial_parser *parser = &s->parser;
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	unsigned int nframes;
+	ssize_t n;
+
+	n = recvfrom(s->fd, buffer, sizeof(buffer), 0,
+		     (struct sockaddr *)&addr, &addrlen);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		WARN("net: %s: recv() failed: %s", s->name, strerror(errno));
+	}
+
+	if (n <= 0) {
+		if (s->type == NET_UDP)
+			return;
+
+		NOTICE("net: %s: connection to %s closed", s->name, s->host);
+		net_disconnect(s);
+		return;
+	}
+
+	if (s->type == NET_UDP) {
+		parser = net_peer_parser(s, &addr, addrlen);
+		if (!parser)
+			return;
+	}
+
+	nframes = serial_parse(parser, buffer, n, clock_usecs(), 0, cb);
+
+	s->rx_bytes += n;
+	s->frames += nframes;
+	if (s->listener) {
+		s->listener->rx_bytes += n;
+		s->listener->frames += nframes;
+	}
+}
+
+void net_read(fd_set *rfds, fd_set *wfds, serial_cb_t cb)
+{
+	struct net_source **ps = &sources;
+	struct net_source *s;
+
+	for (s = sources; s; s = s->next) {
+		if (s->fd == -1)
+			continue;
+
+		if (s->connecting) {
+			if (FD_ISSET(s->fd, wfds))
+				net_connected(s);
+			continue;
+		}
+
+		if (!FD_ISSET(s->fd, rfds))
+			continue;
+
+		if (s->type == NET_LISTEN)
+			net_accept(s);
+		else
+			net_recv(s, cb);
+	}
+
+	/* release closed client connections */
+	while ((s = *ps)) {
+		if (s->type == NET_CLIENT && s->fd == -1) {
+			*ps = s->next;
+			s->listener->clients--;
+			net_source_free(s);
+		} else {
+			ps = &s->next;
+		}
+	}
+}
+
+void net_close(void)
+{
+	struct net_source *s;
+
+	while ((s = sources)) {
+		sources = s->next;
+		if (s->fd != -1)
+			close(s->fd);
+		net_source_free(s);
+	}
+}
+
+unsigned int net_count(void)
+{
+	struct net_source *s;
+	unsigned int count = 0;
+
+	for (s = sources; s; s = s->next)
+		if (s->type != NET_CLIENT)
+			count++;
+	return count;
+}
+
+int net_print(char *buffer, size_t len)
+{
+	struct net_source *s;
+	int n = 0;
+
+	for (s = sources; s; s = s->next) {
+		n += snprintf(buffer + n, len - n,
+			      "%-12s %-6s %s:%d %s rx:%lu frames:%lu cnx:%lu\n",
+			      s->name, net_type_names[s->type],
+			      s->host ? s->host : "*", s->port,
+			      s->fd == -1 ? "down" :
+			      s->connecting ? "connecting" : "up",
+			      s->rx_bytes, s->frames, s->reconnects);
+		if ((size_t)n >= len)
+			return len - 1;
+	}
+	return n;
+}
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef EDFINFO_NET_H
+#define EDFINFO_NET_H
+
+#include <sys/select.h>
+
+#include "serial.h"
+
+/*
+ * Network sources of raw TIC data, as forwarded by ser2net like
+ * serial servers. They are configured with [net:<name>] sections.
+ */
+extern int net_configure(const char *name, const char *key,
+			 const char *value);
+extern int net_open(void);
+extern void net_remove(const char *name);
+extern int net_start(const char *name);
+extern int net_fd_set(fd_set *rfds, fd_set *wfds, int max);
+extern void net_read(fd_set *rfds, fd_set *wfds, serial_cb_t cb);
+extern void net_close(void);
+extern int net_print(char *buffer, size_t len);
+extern unsigned int net_count(void);
+
+#endif
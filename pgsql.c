@@ -0,0 +1,757 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <libpq-fe.h>
+
+#include "log.h"
+#include "edfinfo.h"
+#include "frame.h"
+#include "backend.h"
+#include "stats.h"
+
+#define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
+#define BIT(nr)		(1U << (nr))
+
+static struct pgsql_config {
+	const char	*host;
+	const char	*port;
+	const char	*db;
+	const char	*user;
+	const char	*password;
+	const char	*table;
+	int		ratelimit;
+	int		size;		/* bytes buffered before a COPY */
+	int		interval;	/* seconds between COPYs */
+	int		retry;		/* seconds between reconnects */
+} pgsql_config = {
+	.host		= "localhost",
+	.port		= "5432",
+	.db		= "home",
+	.user		= "edfinfo",
+	.password	= NULL,
+	.table		= "edfinfo",
+	.ratelimit	= 0,
+	.size		= 65536,
+	.interval	= 60,
+	.retry		= 10,
+};
+
+#define MATCH(n) (strcmp(name, n) == 0)
+
+static int pgsql_configure(const char *name, const char *value)
+{
+	if (MATCH("host")) {
+		pgsql_config.host = strdup(value);
+	} else if (MATCH("port")) {
+		pgsql_config.port = strdup(value);
+	} else if (MATCH("db")) {
+		pgsql_config.db = strdup(value);
+	} else if (MATCH("user")) {
+		pgsql_config.user = strdup(value);
+	} else if (MATCH("password")) {
+		pgsql_config.password = strdup(value);
+	} else if (MATCH("table")) {
+		pgsql_config.table = strdup(value);
+	} else if (MATCH("ratelimit")) {
+		pgsql_config.ratelimit = atoi(value);
+	} else if (MATCH("size")) {
+		pgsql_config.size = atoi(value);
+	} else if (MATCH("interval")) {
+		pgsql_config.interval = atoi(value);
+	} else if (MATCH("retry")) {
+		pgsql_config.retry = atoi(value);
+	} else {
+		fprintf(stderr, "unknown config name pgsql/%s\n", name);
+		return 0;  /* unknown section/name, error */
+	}
+
+	/* success */
+	return 1;
+}
+
+/*
+ * Same columns as the MySQL table, see README.mysql. The binary COPY
+ * format needs the exact column types : text or bigint.
+ */
+static const struct pgsql_column {
+	const char	*name;
+	int		text;
+} pgsql_columns[] = {
+	{ "ADCO",	1 },
+	{ "OPTARIF",	1 },
+	{ "ISOUSC",	0 },
+	{ "BASE",	0 },
+	{ "HCHC",	0 },
+	{ "HCHP",	0 },
+	{ "EJPHN",	0 },
+	{ "EJPHPM",	0 },
+	{ "BBRHCJB",	0 },
+	{ "BBRHPJB",	0 },
+	{ "BBRHCJW",	0 },
+	{ "BBRHPJW",	0 },
+	{ "BBRHCJR",	0 },
+	{ "BBRHPJR",	0 },
+	{ "PEJP",	1 },
+	{ "PTEC",	1 },
+	{ "DEMAIN",	1 },
+	{ "IINST1",	0 },
+	{ "IINST2",	0 },
+	{ "IINST3",	0 },
+	{ "ADPS",	0 },
+	{ "IMAX1",	0 },
+	{ "IMAX2",	0 },
+	{ "IMAX3",	0 },
+	{ "HHPHC",	1 },
+	{ "PMAX",	0 },
+	{ "PAPP",	0 },
+	{ "MOTDETAT",	1 },
+	{ "PPOT",	0 },
+};
+
+#define PGSQL_COLUMNS	ARRAY_SIZE(pgsql_columns)
+
+/* column of each frame info, -1 if none */
+static int pgsql_column_of[FRAME_INFO_MAX];
+
+/*
+ * Frames are queued by the main loop and encoded by a writer thread
+ * in a COPY buffer, which is sent to the server in one COPY when it
+ * reaches 'size' bytes or is 'interval' seconds old. The buffer is
+ * kept while the server is unreachable and sent again after a
+ * reconnect. Connecting or a slow server never stall the serial line.
+ */
+#define PGSQL_QUEUE		256
+#define PGSQL_BUFFER_MAX	(16 << 20)
+
+/*
+ * The writer checks for a stop while connecting and is given a few
+ * seconds to send its last COPY, after which its connection is shut
+ * down. A restart or an exit is never held by the server.
+ */
+#define PGSQL_CONNECT_TIMEOUT	10	/* seconds */
+#define PGSQL_STOP_TIMEOUT	2	/* seconds */
+#define PGSQL_POLL_MSECS	100
+
+struct pgsql_row {
+	time_t		date;
+	uint32_t	mask;	/* columns set */
+	char		values[PGSQL_COLUMNS][16];
+};
+
+static struct pgsql_row queue[PGSQL_QUEUE];
+static unsigned int queue_head;
+static unsigned int queue_count;
+static unsigned int queue_buffered;	/* rows in the COPY buffer */
+static bool writer_stop;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static bool writer_running;
+static int writer_fd = -1;	/* socket of the connection */
+
+/* only used by the writer */
+static PGconn *conn;
+static int pgsql_retries;
+static char copy_sql[1024];
+static char *copy_buf;
+static size_t copy_len;
+static size_t copy_alloc;
+static unsigned int copy_rows;
+
+static struct backend *pgsql_backend;
+
+/*
+ * Binary COPY : a signature, the flags and the header extension
+ * length, then each tuple and a -1 field count as a trailer. All
+ * integers are in network order.
+ */
+static const char copy_header[19] = "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0";
+static const char copy_trailer[2] = "\377\377";
+
+/* timestamps are in microseconds since 2000-01-01 00:00:00 UTC */
+#define PGSQL_EPOCH	946684800LL
+
+static int pgsql_exec(const char *sql)
+{
+	PGresult *res = PQexec(conn, sql);
+	int ret = 0;
+
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		ERROR("PostgreSQL: \"%s\" failed : %s", sql,
+		      PQerrorMessage(conn));
+		ret = -1;
+	}
+	PQclear(res);
+	return ret;
+}
+
+static int pgsql_schema(void)
+{
+	char sql[1024];
+	unsigned int i;
+	int n;
+
+	n = snprintf(sql, sizeof(sql),
+		     "CREATE TABLE IF NOT EXISTS %s "
+		     "(id bigserial PRIMARY KEY, DATE timestamptz",
+		     pgsql_config.table);
+	for (i = 0; i < PGSQL_COLUMNS; i++)
+		n += snprintf(sql + n, sizeof(sql) - n, ", %s %s",
+			      pgsql_columns[i].name,
+			      pgsql_columns[i].text ? "text" : "bigint");
+	n += snprintf(sql + n, sizeof(sql) - n,
+		      "); CREATE INDEX IF NOT EXISTS %s_search ON %s "
+		      "(ADCO, DATE);", pgsql_config.table,
+		      pgsql_config.table);
+	if ((size_t)n >= sizeof(sql))
+		return -1;
+
+	return pgsql_exec(sql);
+}
+
+static int pgsql_copy_init(void)
+{
+	unsigned int i;
+	int n;
+
+	n = snprintf(copy_sql, sizeof(copy_sql), "COPY %s (DATE",
+		     pgsql_config.table);
+	for (i = 0; i < PGSQL_COLUMNS; i++)
+		n += snprintf(copy_sql + n, sizeof(copy_sql) - n, ",%s",
+			      pgsql_columns[i].name);
+	n += snprintf(copy_sql + n, sizeof(copy_sql) - n,
+		      ") FROM STDIN (FORMAT binary)");
+	return (size_t)n < sizeof(copy_sql) ? 0 : -1;
+}
+
+/*
+ * Same conversion as the MySQL backend for single phase meters :
+ *
+ *	IINST	-> IINST1
+ *	IMAX	-> IMAX1
+ */
+static void pgsql_columns_init(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < FRAME_INFO_MAX; i++) {
+		const char *label = frame_info_label(i);
+		char name[16];
+
+		snprintf(name, sizeof(name), "%s%s", label,
+			 (!strcmp(label, "IINST") || !strcmp(label, "IMAX")) ?
+			 "1" : "");
+
+		pgsql_column_of[i] = -1;
+		for (j = 0; j < PGSQL_COLUMNS; j++) {
+			if (!strcmp(pgsql_columns[j].name, name)) {
+				pgsql_column_of[i] = j;
+				break;
+			}
+		}
+	}
+}
+
+static void pgsql_deadline(struct timespec *ts, int secs)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += secs;
+}
+
+static bool pgsql_expired(const struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec > ts->tv_sec ||
+		(now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
+}
+
+static bool pgsql_stopping(void)
+{
+	bool stop;
+
+	pthread_mutex_lock(&queue_lock);
+	stop = writer_stop;
+	pthread_mutex_unlock(&queue_lock);
+	return stop;
+}
+
+static void pgsql_disconnect(void)
+{
+	pthread_mutex_lock(&queue_lock);
+	writer_fd = -1;
+	pthread_mutex_unlock(&queue_lock);
+
+	PQfinish(conn);
+	conn = NULL;
+}
+
+/*
+ * Poll the connection until it is established, the writer is
+ * stopped or the timeout expires
+ */
+static const char *pgsql_connect_poll(void)
+{
+	PostgresPollingStatusType status = PGRES_POLLING_WRITING;
+	struct timespec deadline;
+
+	if (PQstatus(conn) == CONNECTION_BAD)
+		return PQerrorMessage(conn);
+
+	pgsql_deadline(&deadline, PGSQL_CONNECT_TIMEOUT);
+	while (status != PGRES_POLLING_OK) {
+		struct pollfd pfd = {
+			.fd	= PQsocket(conn),
+			.events	= status == PGRES_POLLING_READING ?
+				  POLLIN : POLLOUT,
+		};
+		int ret;
+
+		if (status == PGRES_POLLING_FAILED)
+			return PQerrorMessage(conn);
+		if (pgsql_stopping())
+			return "stopped";
+		if (pgsql_expired(&deadline))
+			return "timeout";
+
+		ret = poll(&pfd, 1, PGSQL_POLL_MSECS);
+		if (ret < 0 && errno != EINTR)
+			return strerror(errno);
+		if (ret > 0)
+			status = PQconnectPoll(conn);
+	}
+	return NULL;
+}
+
+/*
+ * The writer is the only one waiting. Errors are only logged on the
+ * first failed attempt.
+ */
+static int pgsql_connect(void)
+{
+	const char *keywords[] = {
+		"host", "port", "dbname", "user", "password",
+		"application_name", NULL
+	};
+	const char *values[] = {
+		pgsql_config.host, pgsql_config.port, pgsql_config.db,
+		pgsql_config.user, pgsql_config.password,
+		"edfinfod", NULL
+	};
+	const char *err;
+
+	conn = PQconnectStartParams(keywords, values, 0);
+	if (!conn) {
+		ERROR("PostgreSQL: could not allocate connection");
+		return -1;
+	}
+
+	err = pgsql_connect_poll();
+	if (err) {
+		if (!pgsql_retries && !pgsql_stopping())
+			ERROR("PostgreSQL: connect failed : %s", err);
+		pgsql_retries++;
+		pgsql_disconnect();
+		return -1;
+	}
+
+	pthread_mutex_lock(&queue_lock);
+	writer_fd = PQsocket(conn);
+	pthread_mutex_unlock(&queue_lock);
+
+	if (pgsql_schema()) {
+		pgsql_disconnect();
+		return -1;
+	}
+
+	pgsql_retries = 0;
+	backend_stat_add(pgsql_backend, BACKEND_STAT_RECONNECTS, 1);
+	NOTICE("PostgreSQL: connected to server %s", pgsql_config.host);
+	return 0;
+}
+
+static char *copy_reserve(size_t size)
+{
+	char *p;
+
+	if (copy_len + size > copy_alloc) {
+		size_t alloc = copy_alloc ? copy_alloc * 2 : 65536;
+
+		while (alloc < copy_len + size)
+			alloc *= 2;
+		p = realloc(copy_buf, alloc);
+		if (!p)
+			return NULL;
+		copy_buf = p;
+		copy_alloc = alloc;
+	}
+
+	p = copy_buf + copy_len;
+	copy_len += size;
+	return p;
+}
+
+static void put16(char **p, uint16_t v)
+{
+	v = htobe16(v);
+	memcpy(*p, &v, sizeof(v));
+	*p += sizeof(v);
+}
+
+static void put32(char **p, uint32_t v)
+{
+	v = htobe32(v);
+	memcpy(*p, &v, sizeof(v));
+	*p += sizeof(v);
+}
+
+static void put64(char **p, uint64_t v)
+{
+	v = htobe64(v);
+	memcpy(*p, &v, sizeof(v));
+	*p += sizeof(v);
+}
+
+/*
+ * A tuple is the field count and, for each field, its length and its
+ * value, or a -1 length for a NULL.
+ */
+static int pgsql_encode(const struct pgsql_row *row)
+{
+	size_t size = 2 + 4 + 8;
+	unsigned int i;
+	char *p;
+
+	for (i = 0; i < PGSQL_COLUMNS; i++) {
+		size += 4;
+		if (row->mask & BIT(i))
+			size += pgsql_columns[i].text ?
+				strlen(row->values[i]) : 8;
+	}
+
+	if (!copy_len)
+		size += sizeof(copy_header);
+	if (copy_len + size > PGSQL_BUFFER_MAX)
+		return -1;
+
+	p = copy_reserve(size);
+	if (!p)
+		return -1;
+
+	if (p == copy_buf) {
+		memcpy(p, copy_header, sizeof(copy_header));
+		p += sizeof(copy_header);
+	}
+
+	put16(&p, 1 + PGSQL_COLUMNS);
+	put32(&p, 8);
+	put64(&p, (row->date - PGSQL_EPOCH) * 1000000);
+
+	for (i = 0; i < PGSQL_COLUMNS; i++) {
+		size_t len;
+
+		if (!(row->mask & BIT(i))) {
+			put32(&p, -1);
+			continue;
+		}
+
+		if (!pgsql_columns[i].text) {
+			put32(&p, 8);
+			put64(&p, strtoll(row->values[i], NULL, 10));
+			continue;
+		}
+
+		len = strlen(row->values[i]);
+		put32(&p, len);
+		memcpy(p, row->values[i], len);
+		p += len;
+	}
+
+	copy_rows++;
+	return 0;
+}
+
+static void pgsql_copy_reset(void)
+{
+	copy_len = 0;
+	copy_rows = 0;
+
+	pthread_mutex_lock(&queue_lock);
+	queue_buffered = 0;
+	backend_stat_set(pgsql_backend, BACKEND_STAT_QUEUE, queue_count);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * Send the buffer in one COPY. The buffer is kept if the connection
+ * is lost and dropped if the server rejects it, it would be rejected
+ * again.
+ */
+static int pgsql_flush(void)
+{
+	PGresult *res;
+	int ret = -1;
+
+	if (!conn && pgsql_connect())
+		return -1;
+
+	res = PQexec(conn, copy_sql);
+	if (PQresultStatus(res) != PGRES_COPY_IN) {
+		ERROR("PostgreSQL: COPY failed : %s", PQerrorMessage(conn));
+		goto out;
+	}
+	PQclear(res);
+
+	if (PQputCopyData(conn, copy_buf, copy_len) != 1 ||
+	    PQputCopyData(conn, copy_trailer, sizeof(copy_trailer)) != 1 ||
+	    PQputCopyEnd(conn, NULL) != 1) {
+		ERROR("PostgreSQL: COPY data failed : %s",
+		      PQerrorMessage(conn));
+		res = NULL;
+		goto out;
+	}
+
+	res = PQgetResult(conn);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		ERROR("PostgreSQL: COPY failed : %s", PQerrorMessage(conn));
+		goto out;
+	}
+
+	DEBUG("PostgreSQL: copied %u rows, %zu bytes", copy_rows, copy_len);
+	backend_stat_add(pgsql_backend, BACKEND_STAT_PUSHED, copy_rows);
+	backend_stat_add(pgsql_backend, BACKEND_STAT_BYTES, copy_len);
+	ret = 0;
+out:
+	PQclear(res);
+	while ((res = PQgetResult(conn)))
+		PQclear(res);
+
+	if (ret) {
+		backend_stat_add(pgsql_backend, BACKEND_STAT_ERRORS, 1);
+		if (PQstatus(conn) != CONNECTION_OK) {
+			pgsql_disconnect();
+			return -1;
+		}
+		backend_stat_add(pgsql_backend, BACKEND_STAT_DROPPED,
+				 copy_rows);
+	}
+
+	pgsql_copy_reset();
+	return ret;
+}
+
+static void *pgsql_writer(void *arg __unused)
+{
+	struct timespec deadline;
+	unsigned int tail, count, i;
+	bool stop;
+
+	pgsql_connect();
+
+	while (1) {
+		pthread_mutex_lock(&queue_lock);
+		while (!queue_count && !writer_stop) {
+			if (!copy_rows) {
+				pthread_cond_wait(&queue_cond, &queue_lock);
+			} else if (pthread_cond_timedwait(&queue_cond,
+							  &queue_lock,
+							  &deadline) ==
+				   ETIMEDOUT) {
+				break;
+			}
+		}
+		tail = (queue_head + PGSQL_QUEUE - queue_count) % PGSQL_QUEUE;
+		count = queue_count;
+		stop = writer_stop;
+		pthread_mutex_unlock(&queue_lock);
+
+		/* the rows are not reused before they are released */
+		for (i = 0; i < count; i++) {
+			if (!copy_rows)
+				pgsql_deadline(&deadline,
+					       pgsql_config.interval);
+
+			if (pgsql_encode(&queue[(tail + i) % PGSQL_QUEUE]))
+				backend_stat_add(pgsql_backend,
+						 BACKEND_STAT_DROPPED, 1);
+		}
+
+		pthread_mutex_lock(&queue_lock);
+		queue_count -= count;
+		queue_buffered = copy_rows;
+		backend_stat_set(pgsql_backend, BACKEND_STAT_QUEUE,
+				 queue_count + queue_buffered);
+		pthread_mutex_unlock(&queue_lock);
+
+		/*
+		 * A full buffer waits for the next reconnect when the
+		 * server is down. Nothing is sent when stopping without a
+		 * server.
+		 */
+		if (copy_rows &&
+		    ((stop && conn) || pgsql_expired(&deadline) ||
+		     (conn && copy_len >= (size_t)pgsql_config.size))) {
+			if (pgsql_flush())
+				pgsql_deadline(&deadline, pgsql_config.retry);
+		}
+
+		if (stop && !count)
+			break;
+	}
+
+	if (copy_rows) {
+		WARN("PostgreSQL: %u rows not sent", copy_rows);
+		backend_stat_add(pgsql_backend, BACKEND_STAT_DROPPED,
+				 copy_rows);
+		pgsql_copy_reset();
+	}
+	return NULL;
+}
+
+static int pgsql_init(void)
+{
+	int ret;
+
+	pgsql_backend = backend_get("pgsql");
+	pgsql_columns_init();
+
+	if (pgsql_copy_init()) {
+		ERROR("PostgreSQL: table name '%s' too long",
+		      pgsql_config.table);
+		return -1;
+	}
+
+	queue_head = queue_count = queue_buffered = 0;
+	writer_stop = false;
+	ret = pthread_create(&writer, NULL, pgsql_writer, NULL);
+	if (ret) {
+		ERROR("PostgreSQL: could not start writer : %s", strerror(ret));
+		return -1;
+	}
+	writer_running = true;
+
+	/*
+	 * return success whatever happens, the writer connects
+	 */
+	return 0;
+}
+
+static void pgsql_fini(void)
+{
+	struct timespec deadline;
+
+	if (!writer_running)
+		return;
+
+	pthread_mutex_lock(&queue_lock);
+	writer_stop = true;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	pgsql_deadline(&deadline, PGSQL_STOP_TIMEOUT);
+	if (pthread_timedjoin_np(writer, NULL, &deadline)) {
+		WARN("PostgreSQL: server is not responding, disconnecting");
+		pthread_mutex_lock(&queue_lock);
+		if (writer_fd != -1)
+			shutdown(writer_fd, SHUT_RDWR);
+		pthread_mutex_unlock(&queue_lock);
+		pthread_join(writer, NULL);
+	}
+	writer_running = false;
+
+	NOTICE("PostgreSQL: %lu rows copied, %lu dropped",
+	       stats_get(&pgsql_backend->stats[BACKEND_STAT_PUSHED]),
+	       stats_get(&pgsql_backend->stats[BACKEND_STAT_DROPPED]));
+
+	if (conn)
+		pgsql_disconnect();
+	free(copy_buf);
+	copy_buf = NULL;
+	copy_alloc = 0;
+}
+
+static int check_ratelimit(int ratelimit)
+{
+	static struct timeval prev;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	if (now.tv_sec - prev.tv_sec < ratelimit)
+		return 0;
+
+	prev = now;
+	return 1;
+}
+
+static int pgsql_push(const struct frame *frame)
+{
+	struct pgsql_row *row;
+	unsigned int i;
+
+	if (!writer_running || !check_ratelimit(pgsql_config.ratelimit))
+		return 0;
+
+	pthread_mutex_lock(&queue_lock);
+	if (queue_count == PGSQL_QUEUE) {
+		pthread_mutex_unlock(&queue_lock);
+		backend_stat_add(pgsql_backend, BACKEND_STAT_DROPPED, 1);
+		return 0;
+	}
+
+	row = &queue[queue_head];
+	row->date = frame->timestamp;
+	row->mask = 0;
+	for (i = 0; i < frame->ninfos; i++) {
+		int column = pgsql_column_of[frame->infos[i]->index];
+
+		if (column < 0)
+			continue;
+
+		snprintf(row->values[column], sizeof(row->values[column]),
+			 "%s", frame->infos[i]->value);
+		row->mask |= BIT(column);
+	}
+
+	queue_head = (queue_head + 1) % PGSQL_QUEUE;
+	queue_count++;
+	backend_stat_set(pgsql_backend, BACKEND_STAT_QUEUE,
+			 queue_count + queue_buffered);
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	return 0;
+}
+
+static const char * const pgsql_live[] = {
+	"ratelimit", "size", "interval", "retry", NULL
+};
+
+static struct backend_ops pgsql_ops = {
+	.configure = pgsql_configure,
+	.init = pgsql_init,
+	.push = pgsql_push,
+	.fini = pgsql_fini,
+	.live = pgsql_live,
+	.all_meters = 1,
+};
+
+backend_register("pgsql", &pgsql_ops)
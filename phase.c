@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "edfinfo.h"
+#include "frame.h"
+#include "stats.h"
+#include "window.h"
+#include "phase.h"
+
+#define PHASES		3
+
+static unsigned int lengths[PHASE_WINDOWS_MAX] = { 1 * 60, 15 * 60 };
+static unsigned int nwindows = 2;
+
+/* the last row is the imbalance */
+static struct window windows[PHASES + 1][PHASE_WINDOWS_MAX];
+static unsigned int nframes;
+
+/*
+ * Exported with the statistics : for each phase and the imbalance,
+ * the current value, then mean and max per window.
+ */
+#define PHASE_STATS	((PHASES + 1) * (1 + 2 * PHASE_WINDOWS_MAX))
+
+static struct stats_entry phase_stats[PHASE_STATS];
+static char phase_stats_names[PHASE_STATS][24];
+static struct stats_group phase_group = {
+	.name = "phase", .entries = phase_stats,
+};
+
+static const char *phase_names[PHASES + 1] = {
+	"i1", "i2", "i3", "imbalance"
+};
+
+#define MATCH(n) (strcmp(name, n) == 0)
+
+/*
+ * windows = 60,900
+ */
+int phase_configure(const char *name, const char *value)
+{
+	int ret;
+
+	if (!MATCH("windows")) {
+		fprintf(stderr, "unknown config name phase/%s\n", name);
+		return 0;
+	}
+
+	ret = window_parse(value, lengths, PHASE_WINDOWS_MAX);
+	if (ret < 0)
+		return 0;
+
+	nwindows = ret;
+	return 1;
+}
+
+static void phase_stats_add(unsigned int *n, const char *fmt,
+			    const char *phase, unsigned int length)
+{
+	snprintf(phase_stats_names[*n], sizeof(phase_stats_names[*n]), fmt,
+		 phase, length);
+	phase_stats[*n].name = phase_stats_names[*n];
+	phase_stats[*n].type = STATS_GAUGE;
+	(*n)++;
+}
+
+int phase_init(void)
+{
+	unsigned int n = 0;
+	unsigned int p, i;
+
+	for (p = 0; p < PHASES + 1; p++) {
+		phase_stats_add(&n, "%s", phase_names[p], 0);
+		for (i = 0; i < nwindows; i++) {
+			if (window_init(&windows[p][i], lengths[i]))
+				return -1;
+
+			phase_stats_add(&n, "%s.mean%d", phase_names[p],
+					lengths[i]);
+			phase_stats_add(&n, "%s.max%d", phase_names[p],
+					lengths[i]);
+		}
+	}
+
+	phase_group.count = n;
+	return 0;
+}
+
+/*
+ * Maximum deviation from the average current, in percent of the
+ * average (NEMA definition)
+ */
+unsigned int phase_imbalance(const struct frame *frame)
+{
+	unsigned int sum = 0;
+	unsigned int dev = 0;
+	unsigned int p;
+
+	for (p = 0; p < PHASES; p++)
+		sum += frame->current[p];
+
+	if (!sum)
+		return 0;
+
+	for (p = 0; p < PHASES; p++) {
+		unsigned int d = frame->current[p] * PHASES > sum ?
+			frame->current[p] * PHASES - sum :
+			sum - frame->current[p] * PHASES;
+
+		if (d > dev)
+			dev = d;
+	}
+	return dev * 100 / sum;
+}
+
+void phase_update(const struct frame *frame)
+{
+	struct stats_entry *e = phase_stats;
+	unsigned int p, i;
+
+	if (frame->phases != PHASES)
+		return;
+
+	/* only three phases meters are reported */
+	if (!nframes++)
+		stats_register(&phase_group);
+
+	for (p = 0; p < PHASES + 1; p++) {
+		unsigned int value = p < PHASES ? frame->current[p] :
+			phase_imbalance(frame);
+
+		stats_set(e++, value);
+		for (i = 0; i < nwindows; i++) {
+			unsigned int mean, max;
+
+			window_add(&windows[p][i], frame->timestamp, value);
+			window_get(&windows[p][i], NULL, &max, &mean);
+			stats_set(e++, mean);
+			stats_set(e++, max);
+		}
+	}
+}
+
+int phase_print(char *buffer, size_t len)
+{
+	unsigned int p, i;
+	int n;
+
+	if (!nframes)
+		return snprintf(buffer, len, "no three phases frames\n");
+
+	n = snprintf(buffer, len, "%-10s %6s", "phase", "last");
+	for (i = 0; i < nwindows; i++) {
+		char mean[16], max[16];
+
+		snprintf(mean, sizeof(mean), "mean%d", lengths[i]);
+		snprintf(max, sizeof(max), "max%d", lengths[i]);
+		n += snprintf(buffer + n, len - n, " %11s %11s", mean, max);
+	}
+	n += snprintf(buffer + n, len - n, "\n");
+
+	for (p = 0; p < PHASES + 1; p++) {
+		const struct stats_entry *e =
+			&phase_stats[p * (1 + 2 * nwindows)];
+
+		n += snprintf(buffer + n, len - n, "%-10s %6ld",
+			      phase_names[p], stats_get(e++));
+		for (i = 0; i < nwindows; i++) {
+			n += snprintf(buffer + n, len - n, " %11ld",
+				      stats_get(e++));
+			n += snprintf(buffer + n, len - n, " %11ld",
+				      stats_get(e++));
+		}
+		n += snprintf(buffer + n, len - n, "\n");
+	}
+
+	n += snprintf(buffer + n, len - n, "(Ampere, imbalance in %%)\n");
+	return (size_t)n < len ? n : (int)len - 1;
+}
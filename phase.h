@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef EDFINFO_PHASE_H
+#define EDFINFO_PHASE_H
+
+#include <stddef.h>
+
+struct frame;
+
+/*
+ * Per phase current aggregates of three phases meters : sliding
+ * mean/max over configurable windows and phase imbalance.
+ */
+#define PHASE_WINDOWS_MAX	4
+
+extern int phase_configure(const char *name, const char *value);
+extern int phase_init(void);
+extern void phase_update(const struct frame *frame);
+extern unsigned int phase_imbalance(const struct frame *frame);
+extern int phase_print(char *buffer, size_t len);
+
+#endif
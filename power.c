@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "edfinfo.h"
+#include "frame.h"
+#include "stats.h"
+#include "hist.h"
+#include "window.h"
+#include "power.h"
+
+static unsigned int lengths[POWER_WINDOWS_MAX] = { 1 * 60, 15 * 60, 60 * 60 };
+static struct window windows[POWER_WINDOWS_MAX];
+static unsigned int nwindows = 3;
+
+/*
+ * Quantiles of the current hour use the log-linear buckets of the
+ * histograms, which bound the relative error to 6.25%, with a constant
+ * update cost. Summaries of the previous hours are kept.
+ */
+static struct hist hour_hist = { .name = "power" };
+static time_t hour_start;
+static time_t hour_end;
+
+static struct power_summary hours[POWER_HOURS];
+static unsigned int hours_head;
+
+/* exported with the statistics, all gauges */
+static struct stats_entry power_stats[3 + 2 * POWER_WINDOWS_MAX];
+static struct stats_group power_group = {
+	.name = "power", .entries = power_stats,
+};
+static char power_stats_names[2 * POWER_WINDOWS_MAX][16];
+
+#define MATCH(n) (strcmp(name, n) == 0)
+
+/*
+ * windows = 60,900,3600
+ */
+int power_configure(const char *name, const char *value)
+{
+	int ret;
+
+	if (!MATCH("windows")) {
+		fprintf(stderr, "unknown config name power/%s\n", name);
+		return 0;
+	}
+
+	ret = window_parse(value, lengths, POWER_WINDOWS_MAX);
+	if (ret < 0)
+		return 0;
+
+	nwindows = ret;
+	return 1;
+}
+
+int power_init(void)
+{
+	struct stats_entry *e = power_stats;
+	unsigned int i;
+
+	for (i = 0; i < nwindows; i++)
+		if (window_init(&windows[i], lengths[i]))
+			return -1;
+
+	e++->name = "p50";
+	e++->name = "p95";
+	e++->name = "p99";
+	for (i = 0; i < nwindows; i++) {
+		snprintf(power_stats_names[2 * i], 16, "min%d", lengths[i]);
+		snprintf(power_stats_names[2 * i + 1], 16, "max%d",
+			 lengths[i]);
+		e++->name = power_stats_names[2 * i];
+		e++->name = power_stats_names[2 * i + 1];
+	}
+	power_group.count = e - power_stats;
+	for (e = power_stats; e < power_stats + power_group.count; e++)
+		e->type = STATS_GAUGE;
+	stats_register(&power_group);
+	return 0;
+}
+
+/*
+ * Close the current hour and keep its summary. The hour boundaries
+ * are only computed when the current hour is over.
+ */
+static void power_hour_update(time_t timestamp)
+{
+	struct tm tm;
+
+	if (timestamp >= hour_start && timestamp < hour_end)
+		return;
+
+	if (hour_hist.count) {
+		hours_head = (hours_head + 1) % POWER_HOURS;
+		power_current(&hours[hours_head]);
+		memset(hour_hist.buckets, 0, sizeof(hour_hist.buckets));
+		hour_hist.count = 0;
+		hour_hist.total = 0;
+		hour_hist.max = 0;
+	}
+
+	localtime_r(&timestamp, &tm);
+	tm.tm_min = 0;
+	tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	hour_start = mktime(&tm);
+	tm.tm_hour++;
+	tm.tm_isdst = -1;
+	hour_end = mktime(&tm);
+}
+
+void power_update(const struct frame *frame)
+{
+	struct stats_entry *e = power_stats;
+	unsigned int i;
+
+	power_hour_update(frame->timestamp);
+	hist_add(&hour_hist, frame->power);
+
+	stats_set(e++, hist_quantile(&hour_hist, 0.50));
+	stats_set(e++, hist_quantile(&hour_hist, 0.95));
+	stats_set(e++, hist_quantile(&hour_hist, 0.99));
+
+	for (i = 0; i < nwindows; i++) {
+		unsigned int min, max;
+
+		window_add(&windows[i], frame->timestamp, frame->power);
+		window_get(&windows[i], &min, &max, NULL);
+		stats_set(e++, min);
+		stats_set(e++, max);
+	}
+}
+
+unsigned int power_nwindows(void)
+{
+	return nwindows;
+}
+
+int power_window(unsigned int i, unsigned int *window, unsigned int *min,
+		 unsigned int *max)
+{
+	if (i >= nwindows)
+		return -1;
+
+	*window = lengths[i];
+	return window_get(&windows[i], min, max, NULL);
+}
+
+unsigned int power_quantile(double q)
+{
+	return hist_quantile(&hour_hist, q);
+}
+
+void power_current(struct power_summary *s)
+{
+	s->start = hour_start;
+	s->count = hour_hist.count;
+	s->p50 = hist_quantile(&hour_hist, 0.50);
+	s->p95 = hist_quantile(&hour_hist, 0.95);
+	s->p99 = hist_quantile(&hour_hist, 0.99);
+	s->max = hour_hist.max;
+}
+
+/*
+ * Summary of the i-th previous hour, NULL if none
+ */
+const struct power_summary *power_hour(unsigned int i)
+{
+	const struct power_summary *s;
+
+	if (i >= POWER_HOURS)
+		return NULL;
+
+	s = &hours[(hours_head + POWER_HOURS - i) % POWER_HOURS];
+	return s->start ? s : NULL;
+}
+
+static int power_print_summary(const struct power_summary *s, char *buffer,
+			       size_t len)
+{
+	char date[32];
+	struct tm tm;
+
+	localtime_r(&s->start, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm);
+	return snprintf(buffer, len, "%-16s %8lu %6u %6u %6u %6u\n", date,
+			s->count, s->p50, s->p95, s->p99, s->max);
+}
+
+int power_print(char *buffer, size_t len)
+{
+	struct power_summary current;
+	const struct power_summary *s;
+	unsigned int window, min, max;
+	unsigned int i;
+	int n = 0;
+
+	n += snprintf(buffer + n, len - n, "%-16s %6s %6s (Watt)\n", "window",
+		      "min", "max");
+	for (i = 0; i < nwindows; i++) {
+		if (power_window(i, &window, &min, &max))
+			continue;
+		n += snprintf(buffer + n, len - n, "%-16u %6u %6u\n",
+			      window, min, max);
+	}
+
+	n += snprintf(buffer + n, len - n, "%-16s %8s %6s %6s %6s %6s\n",
+		      "hour", "frames", "p50", "p95", "p99", "max");
+
+	power_current(&current);
+	if (current.count)
+		n += power_print_summary(&current, buffer + n, len - n);
+
+	for (i = 0; (s = power_hour(i)); i++) {
+		if ((size_t)n >= len)
+			break;
+		n += power_print_summary(s, buffer + n, len - n);
+	}
+
+	return (size_t)n < len ? n : (int)len - 1;
+}
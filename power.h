@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef EDFINFO_POWER_H
+#define EDFINFO_POWER_H
+
+#include <stddef.h>
+#include <time.h>
+
+struct frame;
+
+/*
+ * Power distribution : sliding min/max over configurable windows and
+ * quantiles per hour
+ */
+#define POWER_WINDOWS_MAX	8
+#define POWER_HOURS		24	/* summaries of the last hours */
+
+struct power_summary {
+	time_t		start;		/* 0 if unused */
+	unsigned long	count;
+	unsigned int	p50;
+	unsigned int	p95;
+	unsigned int	p99;
+	unsigned int	max;
+};
+
+extern int power_configure(const char *name, const char *value);
+extern int power_init(void);
+extern void power_update(const struct frame *frame);
+extern unsigned int power_nwindows(void);
+extern int power_window(unsigned int i, unsigned int *window,
+			unsigned int *min, unsigned int *max);
+extern unsigned int power_quantile(double q);
+extern void power_current(struct power_summary *summary);
+extern const struct power_summary *power_hour(unsigned int i);
+extern int power_print(char *buffer, size_t len);
+
+#endif
@@ -0,0 +1,320 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "edfinfo.h"
+#include "frame.h"
+#include "stats.h"
+#include "backend.h"
+#include "rule.h"
+
+#define BIT(nr)		(1ULL << (nr))
+
+enum rule_op {
+	RULE_NONE,
+	RULE_CHANGE,	/* any change of the value */
+	RULE_SET,	/* the info is present */
+	RULE_EQ,
+	RULE_NE,
+	RULE_GT,
+	RULE_LT,
+};
+
+static const char *rule_op_names[] = {
+	[RULE_NONE]	= "none",
+	[RULE_CHANGE]	= "change",
+	[RULE_SET]	= "set",
+	[RULE_EQ]	= "=",
+	[RULE_NE]	= "!=",
+	[RULE_GT]	= ">",
+	[RULE_LT]	= "<",
+};
+
+struct rule {
+	const char	*name;
+	int		index;		/* frame info */
+	enum rule_op	op;
+	char		value[16];	/* RULE_EQ, RULE_NE */
+	unsigned long	threshold;	/* RULE_GT, RULE_LT */
+	int		active;
+	struct rule	*next;		/* same frame info */
+};
+
+static struct rule rules[RULE_MAX];
+static unsigned int nrules;
+
+/* dispatch table, the rules of each frame info */
+static struct rule *table[FRAME_INFO_MAX];
+static unsigned long long table_mask;
+
+/* last values of the frame infos with rules */
+static char last[FRAME_INFO_MAX][16];
+static unsigned long long last_bitmap;
+
+/* events fired per rule */
+static struct stats_entry rule_stats[RULE_MAX];
+static struct stats_group rule_group = {
+	.name = "rule", .entries = rule_stats,
+};
+
+static struct rule *rule_get(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < nrules; i++)
+		if (!strcmp(rules[i].name, name))
+			return &rules[i];
+
+	if (nrules == RULE_MAX) {
+		fprintf(stderr, "too many rules, max is %d\n", RULE_MAX);
+		return NULL;
+	}
+
+	rules[nrules].name = strdup(name);
+	rules[nrules].index = -1;
+	return &rules[nrules++];
+}
+
+/*
+ * change, set, = VALUE, != VALUE, > NUMBER, < NUMBER
+ */
+static int rule_parse(struct rule *r, const char *value)
+{
+	char op[3], arg[16];
+	char *end;
+	unsigned int i;
+
+	if (!strcmp(value, "change")) {
+		r->op = RULE_CHANGE;
+		return 0;
+	}
+	if (!strcmp(value, "set")) {
+		r->op = RULE_SET;
+		return 0;
+	}
+
+	if (sscanf(value, "%2[=!<>] %15s", op, arg) != 2)
+		return -1;
+
+	for (i = RULE_EQ; i <= RULE_LT; i++)
+		if (!strcmp(op, rule_op_names[i]))
+			break;
+	if (i > RULE_LT)
+		return -1;
+
+	r->op = i;
+	if (r->op == RULE_GT || r->op == RULE_LT) {
+		r->threshold = strtoul(arg, &end, 10);
+		return *end ? -1 : 0;
+	}
+
+	strcpy(r->value, arg);
+	return 0;
+}
+
+#define MATCH(n) (strcmp(key, n) == 0)
+
+int rule_configure(const char *name, const char *key, const char *value)
+{
+	struct rule *r = rule_get(name);
+
+	if (!r)
+		return 0;
+
+	if (MATCH("label")) {
+		r->index = frame_info_lookup(value);
+		if (r->index < 0) {
+			fprintf(stderr, "unknown label '%s' in rule %s\n",
+				value, name);
+			return 0;
+		}
+	} else if (MATCH("when")) {
+		if (rule_parse(r, value)) {
+			fprintf(stderr, "invalid condition '%s' in rule %s\n",
+				value, name);
+			return 0;
+		}
+	} else {
+		fprintf(stderr, "unknown config name rule:%s/%s\n", name, key);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Build the dispatch table
+ */
+int rule_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nrules; i++) {
+		struct rule *r = &rules[i];
+
+		if (r->index < 0 || r->op == RULE_NONE) {
+			ERROR("rule %s: label or condition missing", r->name);
+			return -1;
+		}
+
+		r->next = table[r->index];
+		table[r->index] = r;
+		table_mask |= BIT(r->index);
+
+		rule_stats[i].name = r->name;
+		rule_stats[i].type = STATS_COUNTER;
+	}
+
+	if (!nrules)
+		return 0;
+
+	rule_group.count = nrules;
+	stats_register(&rule_group);
+	NOTICE("%d rules on %d frame infos", nrules,
+	       __builtin_popcountll(table_mask));
+	return 0;
+}
+
+static int rule_eval(const struct rule *r, const char *value)
+{
+	if (!value)
+		return 0;
+
+	switch (r->op) {
+	case RULE_EQ:
+		return !strcmp(value, r->value);
+	case RULE_NE:
+		return strcmp(value, r->value) != 0;
+	case RULE_GT:
+		return strtoul(value, NULL, 10) > r->threshold;
+	case RULE_LT:
+		return strtoul(value, NULL, 10) < r->threshold;
+	default:
+		return 1;
+	}
+}
+
+static void rule_fire(struct rule *r, const char *value, int active)
+{
+	struct rule_event event = {
+		.rule = r->name,
+		.label = frame_info_label(r->index),
+		.value = value,
+		.active = active,
+	};
+
+	NOTICE("rule %s: %s %s%s", r->name, event.label,
+	       value ? value : "gone", active ? "" : ", cleared");
+	stats_inc(&rule_stats[r - rules]);
+	backend_push_event(&event);
+}
+
+/*
+ * The value of frame info @index changed to @value, NULL if gone
+ */
+static void rule_dispatch(unsigned int index, const char *value)
+{
+	struct rule *r;
+
+	for (r = table[index]; r; r = r->next) {
+		int active;
+
+		if (r->op == RULE_CHANGE) {
+			rule_fire(r, value, 1);
+			continue;
+		}
+
+		active = rule_eval(r, value);
+		if (active == r->active)
+			continue;
+
+		r->active = active;
+		rule_fire(r, value, active);
+	}
+}
+
+/*
+ * Only the frame infos with rules are compared to their last value,
+ * and only the changed ones are dispatched
+ */
+void rule_update(const struct frame *frame)
+{
+	unsigned long long gone;
+	unsigned int i;
+
+	if (!table_mask)
+		return;
+
+	for (i = 0; i < frame->ninfos; i++) {
+		const struct frame_info *finfo = frame->infos[i];
+		unsigned int index = finfo->index;
+
+		if (!(table_mask & BIT(index)))
+			continue;
+
+		if ((last_bitmap & BIT(index)) &&
+		    !strcmp(last[index], finfo->value))
+			continue;
+
+		snprintf(last[index], sizeof(last[index]), "%s", finfo->value);
+		rule_dispatch(index, finfo->value);
+	}
+
+	/* overload short frames only carry a few infos */
+	if (frame->overload) {
+		last_bitmap |= frame->infos_bitmap & table_mask;
+		return;
+	}
+
+	gone = last_bitmap & ~frame->infos_bitmap;
+	while (gone) {
+		i = __builtin_ctzll(gone);
+		gone &= gone - 1;
+		rule_dispatch(i, NULL);
+	}
+	last_bitmap = frame->infos_bitmap & table_mask;
+}
+
+int rule_print(char *buffer, size_t len)
+{
+	unsigned int i;
+	int n;
+
+	n = snprintf(buffer, len, "%-16s %-8s %-16s %-6s %s\n", "rule",
+		     "label", "condition", "state", "events");
+
+	for (i = 0; i < nrules && (size_t)n < len; i++) {
+		const struct rule *r = &rules[i];
+		char cond[32];
+
+		if (r->op == RULE_GT || r->op == RULE_LT)
+			snprintf(cond, sizeof(cond), "%s %lu",
+				 rule_op_names[r->op], r->threshold);
+		else if (r->op == RULE_EQ || r->op == RULE_NE)
+			snprintf(cond, sizeof(cond), "%s %s",
+				 rule_op_names[r->op], r->value);
+		else
+			snprintf(cond, sizeof(cond), "%s",
+				 rule_op_names[r->op]);
+
+		n += snprintf(buffer + n, len - n, "%-16s %-8s %-16s %-6s %lu\n",
+			      r->name, r->index < 0 ? "-" :
+			      frame_info_label(r->index), cond,
+			      r->op == RULE_CHANGE ? "-" :
+			      r->active ? "on" : "off",
+			      stats_get(&rule_stats[i]));
+	}
+
+	return (size_t)n < len ? n : (int)len - 1;
+}
@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef EDFINFO_RULE_H
+#define EDFINFO_RULE_H
+
+#include <stddef.h>
+
+struct frame;
+
+/*
+ * Event rules on frame infos, configured with [rule:<name>]
+ * sections. Rules are only evaluated when the value of their frame
+ * info changes and fire when their condition changes.
+ */
+#define RULE_MAX	32
+
+struct rule_event {
+	const char	*rule;
+	const char	*label;
+	const char	*value;		/* NULL if the info is gone */
+	int		active;		/* condition became true or false */
+};
+
+extern int rule_configure(const char *name, const char *key,
+			  const char *value);
+extern int rule_init(void);
+extern void rule_update(const struct frame *frame);
+extern int rule_print(char *buffer, size_t len);
+
+#endif
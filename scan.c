@@ -0,0 +1,423 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "log.h"
+#include "edfinfo.h"
+#include "scan.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+static size_t scalar_ctrl(const char *buffer, size_t len, unsigned char max)
+{
+	const unsigned char *p = (const unsigned char *)buffer;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (p[i] <= max)
+			break;
+	return i;
+}
+
+static unsigned int scalar_delims(const char *buffer, size_t len,
+				  unsigned char max, unsigned short *offsets,
+				  unsigned int count)
+{
+	const unsigned char *p = (const unsigned char *)buffer;
+	unsigned int n = 0;
+	size_t i;
+
+	for (i = 0; i < len && n < count; i++)
+		if (p[i] <= max)
+			offsets[n++] = i;
+	return n;
+}
+
+static unsigned int scalar_sum(const char *buffer, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)buffer;
+	unsigned int sum = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sum += p[i];
+	return sum;
+}
+
+/*
+ * Store the offsets of the bits set in @mask, one bit per char
+ */
+static inline unsigned int scan_mask(unsigned long long mask, size_t base,
+				     unsigned int shift,
+				     unsigned short *offsets,
+				     unsigned int count)
+{
+	unsigned int n = 0;
+
+	while (mask && n < count) {
+		offsets[n++] = base + (__builtin_ctzll(mask) >> shift);
+		mask &= mask - 1;
+	}
+	return n;
+}
+
+#ifdef SCAN_X86
+/*
+ * Unsigned compare : c <= max if min(c, max) == c
+ */
+__attribute__((target("sse2")))
+static inline unsigned int sse2_mask(const char *buffer, __m128i vmax)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)buffer);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, vmax), v));
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_ctrl(const char *buffer, size_t len, unsigned char max)
+{
+	__m128i vmax = _mm_set1_epi8(max);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		unsigned int mask = sse2_mask(buffer + i, vmax);
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + scalar_ctrl(buffer + i, len - i, max);
+}
+
+__attribute__((target("sse2")))
+static unsigned int sse2_delims(const char *buffer, size_t len,
+				unsigned char max, unsigned short *offsets,
+				unsigned int count)
+{
+	__m128i vmax = _mm_set1_epi8(max);
+	unsigned int n = 0;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		n += scan_mask(sse2_mask(buffer + i, vmax), i, 0,
+			       offsets + n, count - n);
+
+	for (; i < len && n < count; i++)
+		if ((unsigned char)buffer[i] <= max)
+			offsets[n++] = i;
+	return n;
+}
+
+/*
+ * psadbw against zero sums 8 chars in each 64-bit lane
+ */
+__attribute__((target("sse2")))
+static unsigned int sse2_sum(const char *buffer, size_t len)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buffer + i));
+
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+	}
+	return _mm_cvtsi128_si32(acc) +
+		_mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc)) +
+		scalar_sum(buffer + i, len - i);
+}
+
+/*
+ * The AVX2 kernels finish with the scalar code, mixing with the SSE
+ * encoded kernels would stall on the transitions.
+ */
+__attribute__((target("avx2")))
+static inline unsigned int avx2_mask(const char *buffer, __m256i vmax)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)buffer);
+
+	return _mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(_mm256_min_epu8(v, vmax), v));
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_ctrl(const char *buffer, size_t len, unsigned char max)
+{
+	__m256i vmax = _mm256_set1_epi8(max);
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		unsigned int mask = avx2_mask(buffer + i, vmax);
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + scalar_ctrl(buffer + i, len - i, max);
+}
+
+__attribute__((target("avx2")))
+static unsigned int avx2_delims(const char *buffer, size_t len,
+				unsigned char max, unsigned short *offsets,
+				unsigned int count)
+{
+	__m256i vmax = _mm256_set1_epi8(max);
+	unsigned int n = 0;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32)
+		n += scan_mask(avx2_mask(buffer + i, vmax), i, 0,
+			       offsets + n, count - n);
+
+	for (; i < len && n < count; i++)
+		if ((unsigned char)buffer[i] <= max)
+			offsets[n++] = i;
+	return n;
+}
+
+__attribute__((target("avx2")))
+static unsigned int avx2_sum(const char *buffer, size_t len)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc = zero;
+	__m128i sum;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buffer + i));
+
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+	}
+	sum = _mm_add_epi64(_mm256_castsi256_si128(acc),
+			    _mm256_extracti128_si256(acc, 1));
+	return _mm_cvtsi128_si32(sum) +
+		_mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum)) +
+		scalar_sum(buffer + i, len - i);
+}
+#endif
+
+#ifdef __ARM_NEON
+/*
+ * There is no movemask on NEON. The compare result is narrowed to 4
+ * bits per char, in a 64-bit mask.
+ */
+static inline unsigned long long neon_mask(const char *buffer,
+					   uint8x16_t vmax)
+{
+	uint8x16_t v = vld1q_u8((const uint8_t *)buffer);
+	uint8x8_t m = vshrn_n_u16(vreinterpretq_u16_u8(vcleq_u8(v, vmax)), 4);
+
+	return vget_lane_u64(vreinterpret_u64_u8(m), 0);
+}
+
+static size_t neon_ctrl(const char *buffer, size_t len, unsigned char max)
+{
+	uint8x16_t vmax = vdupq_n_u8(max);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		unsigned long long mask = neon_mask(buffer + i, vmax);
+
+		if (mask)
+			return i + (__builtin_ctzll(mask) >> 2);
+	}
+	return i + scalar_ctrl(buffer + i, len - i, max);
+}
+
+static unsigned int neon_delims(const char *buffer, size_t len,
+				unsigned char max, unsigned short *offsets,
+				unsigned int count)
+{
+	uint8x16_t vmax = vdupq_n_u8(max);
+	unsigned int n = 0;
+	size_t i;
+
+	/* keep one bit of each nibble */
+	for (i = 0; i + 16 <= len; i += 16)
+		n += scan_mask(neon_mask(buffer + i, vmax) &
+			       0x1111111111111111ULL, i, 2,
+			       offsets + n, count - n);
+
+	for (; i < len && n < count; i++)
+		if ((unsigned char)buffer[i] <= max)
+			offsets[n++] = i;
+	return n;
+}
+
+static unsigned int neon_sum(const char *buffer, size_t len)
+{
+	uint32x4_t acc = vdupq_n_u32(0);
+	uint64x2_t sum;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)(buffer + i));
+
+		acc = vpadalq_u16(acc, vpaddlq_u8(v));
+	}
+	sum = vpaddlq_u32(acc);
+	return vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1) +
+		scalar_sum(buffer + i, len - i);
+}
+#endif
+
+/*
+ * In order of preference. Frames are a few hundred chars long and the
+ * 32 chars loops of AVX2 decode them slower than SSE2. They can still
+ * be selected by name.
+ */
+static const struct scan_ops scan_kernels[] = {
+#ifdef SCAN_X86
+	{ "sse2",	sse2_ctrl,	sse2_delims,	sse2_sum	},
+	{ "avx2",	avx2_ctrl,	avx2_delims,	avx2_sum	},
+#endif
+#ifdef __ARM_NEON
+	{ "neon",	neon_ctrl,	neon_delims,	neon_sum	},
+#endif
+	{ "scalar",	scalar_ctrl,	scalar_delims,	scalar_sum	},
+};
+
+#define scan_scalar (&scan_kernels[ARRAY_SIZE(scan_kernels) - 1])
+
+const struct scan_ops *scan = scan_scalar;
+
+static int scan_supported(const struct scan_ops *ops)
+{
+#ifdef SCAN_X86
+	if (!strcmp(ops->name, "avx2"))
+		return __builtin_cpu_supports("avx2");
+	if (!strcmp(ops->name, "sse2"))
+		return __builtin_cpu_supports("sse2");
+#endif
+	/* NEON is a build option */
+	return 1;
+}
+
+/*
+ * Check a kernel against the scalar code, on alignments and lengths
+ * covering the vector loops and the tails. A few delimiters or 8-bit
+ * chars are moved along printable data.
+ */
+#define SCAN_CHECK_SIZE		256
+
+static const struct {
+	unsigned char	c;	/* 0 for an 8-bit char */
+	unsigned char	max;
+} scan_checks[] = {
+	{ 0x03,	0x04 },		/* ETX */
+	{ '\n',	'\r' },
+	{ 0,	0x04 },
+};
+
+static int scan_check_one(const struct scan_ops *ops, const char *buffer,
+			  unsigned char max)
+{
+	size_t start, len;
+
+	for (start = 0; start < 32; start += 5) {
+		for (len = 0; start + len <= SCAN_CHECK_SIZE;
+		     len += len < 72 ? 1 : 29) {
+			const char *p = buffer + start;
+			unsigned short o1[4], o2[4];
+			unsigned int n;
+
+			if (ops->ctrl(p, len, max) != scalar_ctrl(p, len, max) ||
+			    ops->sum(p, len) != scalar_sum(p, len))
+				return -1;
+
+			/* also check the truncation to @count */
+			n = ops->delims(p, len, max, o1, 2);
+			if (n != scalar_delims(p, len, max, o2, 2) ||
+			    memcmp(o1, o2, n * sizeof(*o1)))
+				return -1;
+
+			n = ops->delims(p, len, max, o1, 4);
+			if (n != scalar_delims(p, len, max, o2, 4) ||
+			    memcmp(o1, o2, n * sizeof(*o1)))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static int scan_check(const struct scan_ops *ops)
+{
+	char buffer[SCAN_CHECK_SIZE];
+	unsigned int i, pos;
+
+	for (i = 0; i < ARRAY_SIZE(scan_checks); i++) {
+		for (pos = 0; pos < sizeof(buffer); pos += 11) {
+			unsigned int j;
+
+			for (j = 0; j < sizeof(buffer); j++)
+				buffer[j] = 0x20 + (j * 7) % 0x5f;
+
+			buffer[pos] = scan_checks[i].c ? scan_checks[i].c :
+				0x80 + pos % 0x80;
+			buffer[(pos * 5 + 3) % sizeof(buffer)] = buffer[pos];
+			buffer[(pos + 13) % sizeof(buffer)] = buffer[pos];
+
+			if (scan_check_one(ops, buffer, scan_checks[i].max))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Select the best kernels supported by the CPU or the ones named by
+ * @name. Kernels failing the check are skipped.
+ */
+int scan_init(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(scan_kernels); i++) {
+		const struct scan_ops *ops = &scan_kernels[i];
+
+		if (name && strcmp(name, ops->name))
+			continue;
+
+		if (!scan_supported(ops)) {
+			if (name)
+				break;
+			continue;
+		}
+
+		if (ops != scan_scalar && scan_check(ops)) {
+			ERROR("scan: %s kernels differ from scalar code",
+			      ops->name);
+			continue;
+		}
+
+		scan = ops;
+		NOTICE("scan: using %s kernels", scan->name);
+		return 0;
+	}
+
+	if (name) {
+		ERROR("scan: %s kernels are not available", name);
+		return -1;
+	}
+
+	scan = scan_scalar;
+	return 0;
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef EDFINFO_SCAN_H
+#define EDFINFO_SCAN_H
+
+#include <stddef.h>
+
+/*
+ * Decoding kernels. The frame delimiters (STX, ETX, EOT) and the
+ * group delimiters (LF, CR) are all control chars, the data is
+ * printable ASCII. The kernels are selected at startup depending on
+ * the CPU.
+ */
+struct scan_ops {
+	const char *name;
+	/* offset of the first char <= @max, @len if none */
+	size_t (*ctrl)(const char *buffer, size_t len, unsigned char max);
+	/* offsets of all the chars <= @max, at most @count */
+	unsigned int (*delims)(const char *buffer, size_t len,
+			       unsigned char max, unsigned short *offsets,
+			       unsigned int count);
+	/* sum of the chars, for the group checksums */
+	unsigned int (*sum)(const char *buffer, size_t len);
+};
+
+extern const struct scan_ops *scan;
+
+extern int scan_init(const char *name);
+
+static inline size_t scan_ctrl(const char *buffer, size_t len,
+			       unsigned char max)
+{
+	return scan->ctrl(buffer, len, max);
+}
+
+static inline unsigned int scan_delims(const char *buffer, size_t len,
+				       unsigned char max,
+				       unsigned short *offsets,
+				       unsigned int count)
+{
+	return scan->delims(buffer, len, max, offsets, count);
+}
+
+/*
+ * Most groups are shorter than a vector, these are summed inline
+ */
+#define SCAN_SUM_MIN	16
+
+static inline unsigned int scan_sum(const char *buffer, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)buffer;
+	unsigned int sum = 0;
+
+	if (len >= SCAN_SUM_MIN)
+		return scan->sum(buffer, len);
+
+	while (len--)
+		sum += *p++;
+	return sum;
+}
+
+#endif
@@ -9,6 +9,7 @@
  */
 
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -21,6 +22,8 @@
 #include "frame.h"
 #include "serial.h"
 #include "stats.h"
+#include "trace.h"
+#include "scan.h"
 
 /*
  * serial line speed is 1200 bps, which is approximately 150 B/s,
@@ -30,18 +33,50 @@
 
 #define SERIAL_BUFFER_SIZE	256 /* depends on SERIAL_MIN_CHAR */
 
+/* mapped input decoded per read, the main loop runs in between */
+#define SERIAL_MAP_SLICE	(64 << 10)
+
+static unsigned int char_usecs;
+
 static struct termios oldtermios;
 
 static int lograw = -1;
 
+/*
+ * Regular files given on stdin are mapped and decoded in place :
+ * frames are handed to the callback from the mapping.
+ */
+static struct serial_map {
+	const char	*base;
+	size_t		len;
+	size_t		offset;
+	const char	*frame;		/* after STX, NULL if none */
+	const char	*prev;		/* previous frame, for duplicates */
+	size_t		prev_len;
+} serial_map;
+
 void serial_close(int fd)
 {
+	if (serial_map.base)
+		munmap((void *)serial_map.base, serial_map.len);
 	tcsetattr(fd, TCSANOW | TCSAFLUSH, &oldtermios);
 	close(fd);
 	if (lograw != -1)
 		close(lograw);
 }
 
+/*
+ * After a configuration change. The raw data file is kept.
+ */
+int serial_reopen(int fd, const char *port)
+{
+	if (fd != -1) {
+		tcsetattr(fd, TCSANOW | TCSAFLUSH, &oldtermios);
+		close(fd);
+	}
+	return serial_open(port);
+}
+
 int serial_open_lograw(const char *filename)
 {
 	lograw = open(filename, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0666);
@@ -95,12 +130,15 @@ int serial_open(const char *port)
 	termios.c_cflag |= CLOCAL;
 
 	/* VMIN: wait for enough bytes to be queued in the driver
-	 * before waking up read(), or select() in our case.
+	 * before waking up read(), or select() in our case. In low
+	 * latency mode, wake up as soon as a char is available. The
+	 * ETX char of a frame is then seen within a few milliseconds
+	 * at the cost of many more wakeups.
 	 *
 	 * VTIME: no interbyte timer. It will be handled by the
 	 * select() timeout.
 	 */
-	termios.c_cc[VMIN]  = SERIAL_MIN_CHAR;
+	termios.c_cc[VMIN]  = config.serial_lowlatency ? 1 : SERIAL_MIN_CHAR;
 	termios.c_cc[VTIME] = 0;
 
 	if (tcsetattr(fd, TCSANOW | TCSAFLUSH, &termios) == -1) {
@@ -108,63 +146,81 @@ int serial_open(const char *port)
 		return -1;
 	}
 
+	char_usecs = SERIAL_CHAR_USEC;
 	return fd;
 }
 
-static int check_duplicate(const char *buffer, size_t len)
+static int check_duplicate(struct serial_parser *p)
 {
-	static char prev_buffer[MAX_FRAME_LENGTH];
-	static size_t prev_len;
+	if (serial_overload(p->buffer, p->len))
+		return 0;
 
-	if (len == prev_len && memcmp(prev_buffer, buffer, len) == 0) {
+	if (p->len == p->prev_len &&
+	    memcmp(p->prev_buffer, p->buffer, sizeof(p->buffer)) == 0) {
 		INFO("dropping duplicate frame");
 		stats.frame_dup++;
 		return 1;
 	}
-	prev_len = len;
-	memcpy(prev_buffer, buffer, sizeof(prev_buffer));
+	p->prev_len = p->len;
+	memcpy(p->prev_buffer, p->buffer, sizeof(p->prev_buffer));
 	return 0;
 }
 
-#define STX 0x02 /* start frame */
-#define ETX 0x03 /* end frame */
-#define EOT 0x04 /* frame interrupt for out of band data */
-
-static int read_buffer(unsigned char c,
-		       void (*cb)(const char *buffer, size_t len))
+/*
+ * Copy a run of data chars, which contains no frame delimiter
+ */
+static void read_data(struct serial_parser *p, const char *data, size_t len)
 {
-	static char buffer[MAX_FRAME_LENGTH];
-	static size_t len;
-	static int fillbuffer;
+	if (!p->fillbuffer)
+		return;
+
+	if (p->len + len > sizeof(p->buffer)) {
+		ERROR("max buffer len reached : %d. dropping frame",
+		      sizeof(p->buffer));
+		p->fillbuffer = 0;
+		return;
+	}
+
+	memcpy(p->buffer + p->len, data, len);
+	p->len += len;
+}
 
+/*
+ * Returns 1 when a frame is completed, -1 on error
+ */
+static int read_buffer(struct serial_parser *p, unsigned char c,
+		       unsigned long long rx_time, serial_cb_t cb)
+{
 	switch (c) {
 	case STX:
-		fillbuffer = 1;
-		len = 0;
-		memset(&buffer, 0, sizeof(buffer));
+		TRACE(frame_start, p, rx_time);
+		p->fillbuffer = 1;
+		p->len = 0;
+		memset(&p->buffer, 0, sizeof(p->buffer));
 		break;
 	case ETX:
-		if (!fillbuffer)
+		if (!p->fillbuffer)
 			break;
-		fillbuffer = 0;
+		p->fillbuffer = 0;
 
-		if (!check_duplicate(buffer, sizeof(buffer)))
-			cb(buffer, len);
-		break;
+		TRACE(frame_end, p, p->len, rx_time);
+		if (!check_duplicate(p))
+			cb(p->buffer, p->len, rx_time);
+		return 1;
 	case EOT:
-		fillbuffer = 0;
+		p->fillbuffer = 0;
 		ERROR("received an interrupt !? dropping frame");
 		break;
 	default:
-		if (!fillbuffer)
+		if (!p->fillbuffer)
 			break;
 
-		if (len < sizeof(buffer)) {
-			buffer[len++] = c;
+		if (p->len < sizeof(p->buffer)) {
+			p->buffer[p->len++] = c;
 		} else {
 			ERROR("max buffer len reached : %d. dropping frame",
-			      len);
-			fillbuffer = 0;
+			      p->len);
+			p->fillbuffer = 0;
 			return -1;
 		}
 		break;
@@ -172,13 +228,175 @@ static int read_buffer(unsigned char c,
 	return 0;
 }
 
-int serial_read(int fd, void (*cb)(const char *buffer, size_t len))
+/*
+ * Feed the decoder with @n chars received at @now. @usecs_per_char is
+ * the transmission time of one char, if known, and is used to
+ * estimate the ETX arrival time. Returns the number of completed
+ * frames.
+ */
+int serial_parse(struct serial_parser *p, const char *buffer, size_t n,
+		 unsigned long long now, unsigned int usecs_per_char,
+		 serial_cb_t cb)
+{
+	unsigned int nframes = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		unsigned long long rx_time = now;
+		size_t run;
+
+		/* data chars are copied in bulk up to the next delimiter */
+		run = scan_ctrl(buffer + i, n - i, EOT);
+		if (run) {
+			read_data(p, buffer + i, run);
+			i += run;
+			if (i == n)
+				break;
+		}
+
+		/*
+		 * chars queued after a delimiter were received after it.
+		 * This is the delay introduced by VMIN. STX and ETX get
+		 * the same correction, so that the frame_start and
+		 * frame_end tracepoints are comparable.
+		 */
+		if (usecs_per_char) {
+			rx_time -= (unsigned long long)(n - 1 - i) *
+				usecs_per_char;
+			if (buffer[i] == ETX)
+				latency_update(&stats.serial_wakeup,
+					       now - rx_time);
+		}
+		if (read_buffer(p, buffer[i], rx_time, cb) == 1)
+			nframes++;
+	}
+	return nframes;
+}
+
+static struct serial_parser serial_parser;
+
+/*
+ * Returns 1 if @fd was mapped, 0 if it is not a regular file
+ */
+int serial_map_open(int fd)
+{
+	struct stat st;
+	void *base;
+
+	if (fstat(fd, &st) < 0) {
+		ERROR("fstat() failed: %s", strerror(errno));
+		return -1;
+	}
+
+	if (!S_ISREG(st.st_mode) || !st.st_size)
+		return 0;
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) {
+		ERROR("mmap() failed: %s", strerror(errno));
+		return -1;
+	}
+	madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+	serial_map.base = base;
+	serial_map.len = st.st_size;
+	NOTICE("mapped %ld bytes of input", st.st_size);
+	return 1;
+}
+
+static void serial_map_frame(struct serial_map *m, const char *end,
+			     unsigned long long rx_time, serial_cb_t cb)
+{
+	size_t len = end - m->frame;
+
+	TRACE(frame_end, m, len, rx_time);
+
+	if (len > MAX_FRAME_LENGTH) {
+		ERROR("max buffer len reached : %d. dropping frame",
+		      MAX_FRAME_LENGTH);
+		return;
+	}
+
+	if (!serial_overload(m->frame, len)) {
+		if (len == m->prev_len && !memcmp(m->frame, m->prev, len)) {
+			INFO("dropping duplicate frame");
+			stats.frame_dup++;
+			return;
+		}
+		m->prev = m->frame;
+		m->prev_len = len;
+	}
+
+	cb(m->frame, len, rx_time);
+}
+
+/*
+ * Same framing as read_buffer(), without copying the data chars
+ */
+static int serial_map_read(serial_cb_t cb)
+{
+	struct serial_map *m = &serial_map;
+	unsigned long long now = clock_usecs();
+	const char *start = m->base + m->offset;
+	const char *end;
+	const char *p;
+	size_t n;
+
+	n = m->len - m->offset;
+	if (!n) {
+		WARN("nothing to read !?");
+		return -1;
+	}
+	if (n > SERIAL_MAP_SLICE)
+		n = SERIAL_MAP_SLICE;
+	end = start + n;
+
+	for (p = start; p < end; p++) {
+		p += scan_ctrl(p, end - p, EOT);
+		if (p == end)
+			break;
+
+		switch (*p) {
+		case STX:
+			TRACE(frame_start, m, now);
+			m->frame = p + 1;
+			break;
+		case ETX:
+			if (!m->frame)
+				break;
+			serial_map_frame(m, p, now, cb);
+			m->frame = NULL;
+			break;
+		case EOT:
+			m->frame = NULL;
+			ERROR("received an interrupt !? dropping frame");
+			break;
+		default:
+			break;
+		}
+	}
+
+	DEBUG("read %d bytes", n);
+	m->offset += n;
+
+	if (lograw != -1)
+		if (write(lograw, start, n) < 0)
+			ERROR("write() failed: %s", strerror(errno));
+
+	return n;
+}
+
+int serial_read(int fd, serial_cb_t cb)
 {
 	char buffer[SERIAL_BUFFER_SIZE];
+	unsigned long long now;
 	ssize_t n;
-	int i;
+
+	if (serial_map.base)
+		return serial_map_read(cb);
 
 	n = read(fd, buffer, sizeof(buffer));
+	now = clock_usecs();
 	if (n < 0) {
 		ERROR("read() failed: %s", strerror(errno));
 		return -1;
@@ -193,8 +411,7 @@ int serial_read(int fd, void (*cb)(const char *buffer, size_t len))
 	if (n > stats.serial_rx_bytes_max)
 		stats.serial_rx_bytes_max = n;
 
-	for (i = 0; i < n; i++)
-		read_buffer(buffer[i], cb);
+	serial_parse(&serial_parser, buffer, n, now, char_usecs, cb);
 
 	if (lograw != -1)
 		if (write(lograw, buffer, n) < 0)
@@ -202,4 +419,3 @@ int serial_read(int fd, void (*cb)(const char *buffer, size_t len))
 
 	return n;
 }
-
@@ -11,14 +11,65 @@
 #ifndef EDFINFO_SERIAL_H
 #define EDFINFO_SERIAL_H
 
+#include <stddef.h>
+#include <string.h>
+
+#include "frame.h"
+
 /*
  * for select() in seconds
  */
 #define SERIAL_TIMEOUT	config.serial_timeout
 
+#define STX 0x02 /* start frame */
+#define ETX 0x03 /* end frame */
+#define EOT 0x04 /* frame interrupt for out of band data */
+
+/*
+ * 7E1 framing: start bit + 7 data bits + parity + stop bit. This is
+ * used to estimate when the ETX char of a frame was received from the
+ * number of chars queued after it, and to date the frames of a raw
+ * capture.
+ */
+#define SERIAL_CHAR_USEC	(10 * USEC_PER_SEC / 1200)
+
+/*
+ * Overload short frames repeat on purpose, they are not duplicates
+ */
+static inline int serial_overload(const char *buffer, size_t len)
+{
+	return memmem(buffer, len, "\nADIR", 5) != NULL;
+}
+
+/*
+ * Frame callback. @rx_time is the time (monotonic, usecs) at which
+ * the ETX char was received.
+ */
+typedef void (*serial_cb_t)(const char *buffer, size_t len,
+			    unsigned long long rx_time);
+
+/*
+ * Frame decoder state. One per input source.
+ */
+struct serial_parser {
+	char	buffer[MAX_FRAME_LENGTH];
+	size_t	len;
+	int	fillbuffer;
+
+	/* previous frame, to filter duplicates */
+	char	prev_buffer[MAX_FRAME_LENGTH];
+	size_t	prev_len;
+};
+
+extern int serial_parse(struct serial_parser *p, const char *buffer,
+			size_t n, unsigned long long now,
+			unsigned int usecs_per_char, serial_cb_t cb);
+
 extern void serial_close(int fd);
 extern int serial_open(const char *port);
-extern int serial_read(int fd, void (*cb)(const char *buffer, size_t len));
+extern int serial_reopen(int fd, const char *port);
+extern int serial_read(int fd, serial_cb_t cb);
+extern int serial_map_open(int fd);
 extern int serial_open_lograw(const char *filename);
 
 #endif
@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "edfinfo.h"
+#include "frame.h"
+#include "stats.h"
+#include "snapshot.h"
+#include "power.h"
+#include "phase.h"
+
+/*
+ * The raw frames are saved, not the decoded ones, so that the layout
+ * does not depend on the decoder. A frame is about 200 bytes and one
+ * is received every 1-2 seconds, the ring covers the frame stack.
+ */
+#define SNAPSHOT_MAGIC		0x45444653 /* "EDFS" */
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_SLOTS		FRAME_STACK_DEPTH
+
+struct snapshot_hdr {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	slot_size;
+	uint32_t	nslots;
+	uint32_t	head;	/* last saved frame */
+	uint32_t	used;
+	uint32_t	pad;
+	int64_t		updated;
+} __attribute__((packed));
+
+struct snapshot_slot {
+	int64_t		timestamp;
+	uint16_t	len;
+	char		buffer[MAX_FRAME_LENGTH];
+} __attribute__((packed));
+
+static struct snapshot_hdr *hdr;
+static struct snapshot_slot *slots;
+static size_t snapshot_size;
+
+static int snapshot_valid(void)
+{
+	return hdr->magic == SNAPSHOT_MAGIC &&
+		hdr->version == SNAPSHOT_VERSION &&
+		hdr->slot_size == sizeof(*slots) &&
+		hdr->nslots == SNAPSHOT_SLOTS && hdr->head < SNAPSHOT_SLOTS &&
+		hdr->used <= SNAPSHOT_SLOTS;
+}
+
+static void snapshot_reset(void)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = SNAPSHOT_MAGIC;
+	hdr->version = SNAPSHOT_VERSION;
+	hdr->slot_size = sizeof(*slots);
+	hdr->nslots = SNAPSHOT_SLOTS;
+}
+
+/*
+ * Rebuild the frame stack with the frames which are not too old. The
+ * downtime is reported to the stack so that the power averages are
+ * not extrapolated over it.
+ */
+static unsigned int snapshot_restore(void)
+{
+	time_t now = time(NULL);
+	unsigned int count = 0;
+	unsigned int i;
+
+	if (!hdr->used)
+		return 0;
+
+	for (i = 0; i < hdr->used; i++) {
+		struct snapshot_slot *slot = &slots[(hdr->head + SNAPSHOT_SLOTS -
+						     hdr->used + 1 + i) %
+						    SNAPSHOT_SLOTS];
+		struct frame *frame;
+
+		if (slot->len > MAX_FRAME_LENGTH ||
+		    now - slot->timestamp > FRAME_STACK_DEPTH ||
+		    slot->timestamp > now)
+			continue;
+
+		frame = frame_new(slot->buffer, slot->len);
+		if (!frame)
+			continue;
+
+		frame->timestamp = slot->timestamp;
+		stats.frame_stack = frame_stack_add(frame);
+		power_update(frame);
+		phase_update(frame);
+		count++;
+	}
+
+	if (frame_stack)
+		frame_stack_set_gap(frame_stack->timestamp, now);
+	return count;
+}
+
+int snapshot_open(const char *dir)
+{
+	unsigned long long start = clock_usecs();
+	unsigned int count;
+	char path[256];
+	void *addr;
+	int fd;
+
+	if (!*dir)
+		return 0;
+
+	snprintf(path, sizeof(path), "%s/frames.snapshot", dir);
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ERROR("snapshot: open(%s) failed: %s", path, strerror(errno));
+		return -1;
+	}
+
+	snapshot_size = sizeof(*hdr) + SNAPSHOT_SLOTS * sizeof(*slots);
+	if (ftruncate(fd, snapshot_size) < 0) {
+		ERROR("snapshot: ftruncate(%s) failed: %s", path,
+		      strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	addr = mmap(NULL, snapshot_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		ERROR("snapshot: mmap(%s) failed: %s", path, strerror(errno));
+		return -1;
+	}
+
+	hdr = addr;
+	slots = (void *)(hdr + 1);
+
+	if (!snapshot_valid()) {
+		if (hdr->magic)
+			WARN("snapshot: %s: unknown layout. resetting", path);
+		snapshot_reset();
+		return 0;
+	}
+
+	count = snapshot_restore();
+	NOTICE("snapshot: restored %d frames in %lld us, gap of %ld seconds",
+	       count, clock_usecs() - start, (long)(time(NULL) - hdr->updated));
+	return 0;
+}
+
+void snapshot_save(const char *buffer, size_t len, const struct frame *frame)
+{
+	struct snapshot_slot *slot;
+
+	if (!hdr || len > MAX_FRAME_LENGTH)
+		return;
+
+	if (hdr->used)
+		hdr->head = (hdr->head + 1) % SNAPSHOT_SLOTS;
+	if (hdr->used < SNAPSHOT_SLOTS)
+		hdr->used++;
+
+	slot = &slots[hdr->head];
+	slot->timestamp = frame->timestamp;
+	slot->len = len;
+	memcpy(slot->buffer, buffer, len);
+	hdr->updated = frame->timestamp;
+}
+
+void snapshot_close(void)
+{
+	if (!hdr)
+		return;
+
+	msync(hdr, snapshot_size, MS_SYNC);
+	munmap(hdr, snapshot_size);
+	hdr = NULL;
+}
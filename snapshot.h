@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef EDFINFO_SNAPSHOT_H
+#define EDFINFO_SNAPSHOT_H
+
+#include <stddef.h>
+
+struct frame;
+
+/*
+ * Snapshot of the frame stack, kept in a memory mapped file under the
+ * data directory, from which the stack and the power averages are
+ * rebuilt on startup.
+ */
+extern int snapshot_open(const char *dir);
+extern void snapshot_save(const char *buffer, size_t len,
+			  const struct frame *frame);
+extern void snapshot_close(void);
+
+#endif
@@ -0,0 +1,475 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sqlite3.h>
+
+#include "log.h"
+#include "edfinfo.h"
+#include "frame.h"
+#include "backend.h"
+#include "stats.h"
+
+#define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
+#define BIT(nr)		(1U << (nr))
+
+static struct sqlite_config {
+	const char	*db;
+	const char	*table;
+	int		ratelimit;
+	int		batch;		/* frames per transaction */
+	int		interval;	/* seconds between commits */
+} sqlite_config = {
+	.db		= "/var/lib/edfinfo/edfinfo.db",
+	.table		= "edfinfo",
+	.ratelimit	= 0,
+	.batch		= 300,
+	.interval	= 300,
+};
+
+#define MATCH(n) (strcmp(name, n) == 0)
+
+static int sqlite_configure(const char *name, const char *value)
+{
+	if (MATCH("db")) {
+		sqlite_config.db = strdup(value);
+	} else if (MATCH("table")) {
+		sqlite_config.table = strdup(value);
+	} else if (MATCH("ratelimit")) {
+		sqlite_config.ratelimit = atoi(value);
+	} else if (MATCH("batch")) {
+		sqlite_config.batch = atoi(value);
+	} else if (MATCH("interval")) {
+		sqlite_config.interval = atoi(value);
+	} else {
+		fprintf(stderr, "unknown config name sqlite/%s\n", name);
+		return 0;  /* unknown section/name, error */
+	}
+
+	/* success */
+	return 1;
+}
+
+/*
+ * Same columns as the MySQL table, see README.mysql
+ */
+static const struct sqlite_column {
+	const char	*name;
+	int		text;
+} sqlite_columns[] = {
+	{ "ADCO",	1 },
+	{ "OPTARIF",	1 },
+	{ "ISOUSC",	0 },
+	{ "BASE",	0 },
+	{ "HCHC",	0 },
+	{ "HCHP",	0 },
+	{ "EJPHN",	0 },
+	{ "EJPHPM",	0 },
+	{ "BBRHCJB",	0 },
+	{ "BBRHPJB",	0 },
+	{ "BBRHCJW",	0 },
+	{ "BBRHPJW",	0 },
+	{ "BBRHCJR",	0 },
+	{ "BBRHPJR",	0 },
+	{ "PEJP",	1 },
+	{ "PTEC",	1 },
+	{ "DEMAIN",	1 },
+	{ "IINST1",	0 },
+	{ "IINST2",	0 },
+	{ "IINST3",	0 },
+	{ "ADPS",	0 },
+	{ "IMAX1",	0 },
+	{ "IMAX2",	0 },
+	{ "IMAX3",	0 },
+	{ "HHPHC",	1 },
+	{ "PMAX",	0 },
+	{ "PAPP",	0 },
+	{ "MOTDETAT",	1 },
+	{ "PPOT",	0 },
+};
+
+#define SQLITE_COLUMNS	ARRAY_SIZE(sqlite_columns)
+
+/* column of each frame info, -1 if none */
+static int sqlite_column_of[FRAME_INFO_MAX];
+
+/*
+ * Frames are queued by the main loop and inserted by a writer thread,
+ * which also does the commits and the WAL checkpoints. Disk writes
+ * never stall the serial line.
+ */
+#define SQLITE_QUEUE	256
+
+struct sqlite_row {
+	time_t		date;
+	uint32_t	mask;	/* columns set */
+	char		values[SQLITE_COLUMNS][16];
+};
+
+static struct sqlite_row queue[SQLITE_QUEUE];
+static unsigned int queue_head;
+static unsigned int queue_count;
+static bool writer_stop;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+
+static sqlite3 *db;
+static sqlite3_stmt *insert;
+static struct backend *sqlite_backend;
+
+static int sqlite_exec(const char *sql)
+{
+	char *err = NULL;
+
+	if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+		ERROR("SQLite: \"%s\" failed : %s", sql, err);
+		sqlite3_free(err);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The rowid is the primary key, AUTOINCREMENT would cost an extra
+ * write per insert.
+ */
+static int sqlite_schema(void)
+{
+	char sql[1024];
+	unsigned int i;
+	int n;
+
+	n = snprintf(sql, sizeof(sql),
+		     "CREATE TABLE IF NOT EXISTS %s "
+		     "(id INTEGER PRIMARY KEY, DATE TEXT",
+		     sqlite_config.table);
+	for (i = 0; i < SQLITE_COLUMNS; i++)
+		n += snprintf(sql + n, sizeof(sql) - n, ", %s %s",
+			      sqlite_columns[i].name,
+			      sqlite_columns[i].text ? "TEXT" : "INTEGER");
+	n += snprintf(sql + n, sizeof(sql) - n,
+		      "); CREATE INDEX IF NOT EXISTS %s_search ON %s "
+		      "(ADCO, DATE);", sqlite_config.table,
+		      sqlite_config.table);
+	if ((size_t)n >= sizeof(sql))
+		return -1;
+
+	return sqlite_exec(sql);
+}
+
+static int sqlite_prepare(void)
+{
+	char sql[1024];
+	unsigned int i;
+	int n;
+
+	n = snprintf(sql, sizeof(sql), "INSERT INTO %s (DATE",
+		     sqlite_config.table);
+	for (i = 0; i < SQLITE_COLUMNS; i++)
+		n += snprintf(sql + n, sizeof(sql) - n, ",%s",
+			      sqlite_columns[i].name);
+	n += snprintf(sql + n, sizeof(sql) - n, ") VALUES (?");
+	for (i = 0; i < SQLITE_COLUMNS; i++)
+		n += snprintf(sql + n, sizeof(sql) - n, ",?");
+	n += snprintf(sql + n, sizeof(sql) - n, ");");
+	if ((size_t)n >= sizeof(sql))
+		return -1;
+
+	if (sqlite3_prepare_v2(db, sql, -1, &insert, NULL) != SQLITE_OK) {
+		ERROR("SQLite: prepare failed : %s", sqlite3_errmsg(db));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Same conversion as the MySQL backend for single phase meters :
+ *
+ *	IINST	-> IINST1
+ *	IMAX	-> IMAX1
+ */
+static void sqlite_columns_init(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < FRAME_INFO_MAX; i++) {
+		const char *label = frame_info_label(i);
+		char name[16];
+
+		snprintf(name, sizeof(name), "%s%s", label,
+			 (!strcmp(label, "IINST") || !strcmp(label, "IMAX")) ?
+			 "1" : "");
+
+		sqlite_column_of[i] = -1;
+		for (j = 0; j < SQLITE_COLUMNS; j++) {
+			if (!strcmp(sqlite_columns[j].name, name)) {
+				sqlite_column_of[i] = j;
+				break;
+			}
+		}
+	}
+}
+
+static int sqlite_insert(const struct sqlite_row *row)
+{
+	char date[32];
+	struct tm tm;
+	unsigned int i;
+	int ret;
+
+	localtime_r(&row->date, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+	sqlite3_reset(insert);
+	sqlite3_clear_bindings(insert);
+	sqlite3_bind_text(insert, 1, date, -1, SQLITE_TRANSIENT);
+
+	for (i = 0; i < SQLITE_COLUMNS; i++) {
+		if (!(row->mask & BIT(i)))
+			continue;
+
+		if (sqlite_columns[i].text)
+			sqlite3_bind_text(insert, i + 2, row->values[i], -1,
+					  SQLITE_STATIC);
+		else
+			sqlite3_bind_int64(insert, i + 2,
+					   strtoll(row->values[i], NULL, 10));
+	}
+
+	ret = sqlite3_step(insert);
+	if (ret != SQLITE_DONE) {
+		ERROR("SQLite: insert failed : %s", sqlite3_errmsg(db));
+		return -1;
+	}
+	return 0;
+}
+
+static void sqlite_deadline(struct timespec *ts)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += sqlite_config.interval;
+}
+
+static bool sqlite_expired(const struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec > ts->tv_sec ||
+		(now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
+}
+
+static void sqlite_commit(unsigned int *pending)
+{
+	if (sqlite_exec("COMMIT"))
+		backend_stat_add(sqlite_backend, BACKEND_STAT_ERRORS, 1);
+	DEBUG("SQLite: committed %d rows", *pending);
+	*pending = 0;
+}
+
+/*
+ * Rows are inserted in a transaction which is committed every 'batch'
+ * rows or 'interval' seconds, and when stopping.
+ */
+static void *sqlite_writer(void *arg __unused)
+{
+	struct timespec deadline;
+	unsigned int pending = 0;
+	unsigned int tail, count, i;
+	bool stop;
+
+	while (1) {
+		pthread_mutex_lock(&queue_lock);
+		while (!queue_count && !writer_stop) {
+			if (!pending) {
+				pthread_cond_wait(&queue_cond, &queue_lock);
+			} else if (pthread_cond_timedwait(&queue_cond,
+							  &queue_lock,
+							  &deadline) ==
+				   ETIMEDOUT) {
+				break;
+			}
+		}
+		tail = (queue_head + SQLITE_QUEUE - queue_count) % SQLITE_QUEUE;
+		count = queue_count;
+		stop = writer_stop;
+		pthread_mutex_unlock(&queue_lock);
+
+		/* the rows are not reused before they are released */
+		for (i = 0; i < count; i++) {
+			if (!pending) {
+				if (sqlite_exec("BEGIN")) {
+					backend_stat_add(sqlite_backend,
+							 BACKEND_STAT_DROPPED,
+							 count - i);
+					break;
+				}
+				sqlite_deadline(&deadline);
+			}
+			pending++;
+
+			if (sqlite_insert(&queue[(tail + i) % SQLITE_QUEUE]))
+				backend_stat_add(sqlite_backend,
+						 BACKEND_STAT_ERRORS, 1);
+			else
+				backend_stat_add(sqlite_backend,
+						 BACKEND_STAT_PUSHED, 1);
+
+			if (pending >= (unsigned int)sqlite_config.batch)
+				sqlite_commit(&pending);
+		}
+
+		pthread_mutex_lock(&queue_lock);
+		queue_count -= count;
+		backend_stat_set(sqlite_backend, BACKEND_STAT_QUEUE,
+				 queue_count);
+		pthread_mutex_unlock(&queue_lock);
+
+		if (pending && (stop || sqlite_expired(&deadline)))
+			sqlite_commit(&pending);
+
+		if (stop && !count)
+			break;
+	}
+	return NULL;
+}
+
+static int sqlite_init(void)
+{
+	int ret;
+
+	sqlite_backend = backend_get("sqlite");
+	sqlite_columns_init();
+
+	ret = sqlite3_open_v2(sqlite_config.db, &db, SQLITE_OPEN_READWRITE |
+			      SQLITE_OPEN_CREATE, NULL);
+	if (ret != SQLITE_OK) {
+		ERROR("SQLite: could not open '%s' : %s", sqlite_config.db,
+		      db ? sqlite3_errmsg(db) : sqlite3_errstr(ret));
+		goto fail;
+	}
+
+	/*
+	 * With WAL, a commit appends to the log and only the
+	 * checkpoints are synced
+	 */
+	if (sqlite_exec("PRAGMA journal_mode=WAL") ||
+	    sqlite_exec("PRAGMA synchronous=NORMAL") ||
+	    sqlite_schema() || sqlite_prepare())
+		goto fail;
+
+	queue_head = queue_count = 0;
+	writer_stop = false;
+	ret = pthread_create(&writer, NULL, sqlite_writer, NULL);
+	if (ret) {
+		ERROR("SQLite: could not start writer : %s", strerror(ret));
+		goto fail;
+	}
+
+	NOTICE("SQLite: writing to '%s'", sqlite_config.db);
+	return 0;
+fail:
+	sqlite3_finalize(insert);
+	insert = NULL;
+	sqlite3_close(db);
+	db = NULL;
+	return -1;
+}
+
+static void sqlite_fini(void)
+{
+	if (!db)
+		return;
+
+	pthread_mutex_lock(&queue_lock);
+	writer_stop = true;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	pthread_join(writer, NULL);
+
+	sqlite3_finalize(insert);
+	insert = NULL;
+	sqlite3_close(db);
+	db = NULL;
+}
+
+static int check_ratelimit(int ratelimit)
+{
+	static struct timeval prev;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	if (now.tv_sec - prev.tv_sec < ratelimit)
+		return 0;
+
+	prev = now;
+	return 1;
+}
+
+static int sqlite_push(const struct frame *frame)
+{
+	struct sqlite_row *row;
+	unsigned int i;
+
+	if (!db || !check_ratelimit(sqlite_config.ratelimit))
+		return 0;
+
+	pthread_mutex_lock(&queue_lock);
+	if (queue_count == SQLITE_QUEUE) {
+		pthread_mutex_unlock(&queue_lock);
+		backend_stat_add(sqlite_backend, BACKEND_STAT_DROPPED, 1);
+		return 0;
+	}
+
+	row = &queue[queue_head];
+	row->date = frame->timestamp;
+	row->mask = 0;
+	for (i = 0; i < frame->ninfos; i++) {
+		int column = sqlite_column_of[frame->infos[i]->index];
+
+		if (column < 0)
+			continue;
+
+		snprintf(row->values[column], sizeof(row->values[column]),
+			 "%s", frame->infos[i]->value);
+		row->mask |= BIT(column);
+	}
+
+	queue_head = (queue_head + 1) % SQLITE_QUEUE;
+	queue_count++;
+	backend_stat_set(sqlite_backend, BACKEND_STAT_QUEUE, queue_count);
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	return 0;
+}
+
+static const char * const sqlite_live[] = {
+	"ratelimit", "batch", "interval", NULL
+};
+
+static struct backend_ops sqlite_ops = {
+	.configure = sqlite_configure,
+	.init = sqlite_init,
+	.push = sqlite_push,
+	.fini = sqlite_fini,
+	.live = sqlite_live,
+	.all_meters = 1,
+};
+
+backend_register("sqlite", &sqlite_ops)
@@ -10,6 +10,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "config.h"
 #include "stats.h"
@@ -17,13 +18,39 @@
 #include "frame.h"
 #include "serial.h"
 
-#define USEC_PER_SEC	1000000
-
 struct stats stats = {
 	.power_min = 999999,
 	.min_timeout = 100 * USEC_PER_SEC,
 };
 
+unsigned long long clock_usecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+void latency_update(struct latency *l, unsigned long long usecs)
+{
+	if (!l->count || usecs < l->min)
+		l->min = usecs;
+	if (usecs > l->max)
+		l->max = usecs;
+	l->last = usecs;
+	l->total += usecs;
+	l->count++;
+}
+
+int latency_print(const char *name, const struct latency *l, char *buffer,
+		  size_t len)
+{
+	return snprintf(buffer, len,
+			"%-16s: %llu/%llu/%llu/%llu us (%lu)\n", name, l->last,
+			l->min, l->count ? l->total / l->count : 0, l->max,
+			l->count);
+}
+
 void stats_update_min_timeout(struct stats *s, struct timeval *tv)
 {
 	useconds_t timeout = tv->tv_sec * USEC_PER_SEC + tv->tv_usec;
@@ -32,6 +59,8 @@ void stats_update_min_timeout(struct stats *s, struct timeval *tv)
 		s->min_timeout = timeout;
 }
 
+static int stats_print_groups(char *buffer, size_t len);
+
 int stats_print(struct stats *s, char *buffer, size_t len)
 {
 	struct frame *top = frame_stack_top();
@@ -45,63 +74,171 @@ int stats_print(struct stats *s, char *buffer, size_t len)
 		     "    pushed            : %ld\n"
 		     "    duplicate         : %ld\n"
 		     "    error             : %ld\n"
-		     "    checksum errors   : %ld\n",
+		     "    checksum errors   : %ld\n"
+		     "    overload          : %ld\n"
+		     "    other meters      : %ld\n",
 		     s->frame_pushed,
 		     s->frame_dup,
 		     s->frame_error,
-		     s->badchecksum);
-
-	n += snprintf(buffer + n, len - n,
-		      "    max len           : %zd\n"
-		      "    stack\n"
-		      "        count         : %d\n"
-		      "        max           : %d\n",
-		      s->frame_maxlen,
-		      s->frame_stack,
-		      s->frame_stack_max);
-
-	n += snprintf(buffer + n, len - n,
-		      "MySQL\n"
-		      "    pushed            : %ld\n"
-		      "    errors            : %ld\n"
-		      "MQTT\n"
-		      "    pushed            : %ld\n"
-		      "    dropped           : %ld\n"
-		      "Controller\n"
-		      "    requests          : %ld\n",
-		      s->mysql_pushed,
-		      s->mysql_error,
-		      s->mqtt_pushed,
-		      s->mqtt_dropped,
-		      s->control_requests);
-
-	n += snprintf(buffer + n, len - n,
-		      "Serial\n"
-		      "    errors            : %ld\n"
-		      "    data loss         : %d secs\n"
-		      "    max read bytes    : %zd\n"
-		      "    timeout           : %d/%d us\n",
-		      s->serial_rx_errors,
-		      s->serial_data_loss,
-		      s->serial_rx_bytes_max,
-		      s->min_timeout, SERIAL_TIMEOUT * USEC_PER_SEC);
-
-	n += snprintf(buffer + n, len - n,
-		      "Power (Watt)\n"
-		      "    current           : %d\n"
-		      "    min/max           : %d/%d\n"
-		      "    averages 1/5/30   : %d/%d/%d\n",
-		      top ? top->power : 0,
-		      s->power_min,
-		      s->power_max,
-		      avg_one, avg_five, avg_thirty);
-
-	return n;
+		     s->badchecksum,
+		     s->frame_overload,
+		     s->frame_other);
+
+	if ((size_t)n < len)
+		n += snprintf(buffer + n, len - n,
+			      "    max len           : %zd\n"
+			      "    stack\n"
+			      "        count         : %d\n"
+			      "        max           : %d\n",
+			      s->frame_maxlen,
+			      s->frame_stack,
+			      s->frame_stack_max);
+
+	if ((size_t)n < len)
+		n += stats_print_groups(buffer + n, len - n);
+
+	if ((size_t)n < len)
+		n += snprintf(buffer + n, len - n,
+			      "Controller\n"
+			      "    requests          : %ld\n"
+			      "    subscribers       : %d\n"
+			      "    pushed/errors     : %ld/%ld\n",
+			      s->control_requests,
+			      s->control_subscribers,
+			      s->control_pushed,
+			      s->control_send_errors);
+
+	if ((size_t)n < len)
+		n += snprintf(buffer + n, len - n,
+			      "Serial\n"
+			      "    errors            : %ld\n"
+			      "    data loss         : %d secs\n"
+			      "    max read bytes    : %zd\n"
+			      "    timeout           : %d/%d us\n"
+			      "Log\n"
+			      "    written/dropped   : %ld/%ld\n",
+			      s->serial_rx_errors,
+			      s->serial_data_loss,
+			      s->serial_rx_bytes_max,
+			      s->min_timeout, SERIAL_TIMEOUT * USEC_PER_SEC,
+			      log_written, log_dropped);
+
+	if ((size_t)n < len)
+		n += snprintf(buffer + n, len - n,
+			      "Power (Watt)\n"
+			      "    current           : %d\n"
+			      "    min/max           : %d/%d\n"
+			      "    averages 1/5/30   : %d/%d/%d\n",
+			      top ? top->power : 0,
+			      s->power_min,
+			      s->power_max,
+			      avg_one, avg_five, avg_thirty);
+
+	return (size_t)n < len ? n : (int)len - 1;
+}
+
+static struct stats_group *groups;
+
+void stats_register(struct stats_group *group)
+{
+	struct stats_group **pg = &groups;
+
+	while (*pg)
+		pg = &(*pg)->next;
+	*pg = group;
+}
+
+void stats_unregister(struct stats_group *group)
+{
+	struct stats_group **pg = &groups;
+
+	while (*pg && *pg != group)
+		pg = &(*pg)->next;
+	if (*pg)
+		*pg = group->next;
+	group->next = NULL;
+}
+
+static int stats_print_groups(char *buffer, size_t len)
+{
+	struct stats_group *g;
+	unsigned int i;
+	int n = 0;
+
+	for (g = groups; g && (size_t)n < len; g = g->next) {
+		n += snprintf(buffer + n, len - n, "%s\n", g->name);
+		for (i = 0; i < g->count && (size_t)n < len; i++)
+			n += snprintf(buffer + n, len - n,
+				      "    %-18s: %ld\n", g->entries[i].name,
+				      stats_get(&g->entries[i]));
+	}
+	return (size_t)n < len ? n : (int)len - 1;
+}
+
+static void stats_export_groups(void (*cb)(const char *name,
+					   unsigned long long value,
+					   void *data), void *data)
+{
+	struct stats_group *g;
+	unsigned int i;
+	char name[64];
+
+	for (g = groups; g; g = g->next) {
+		for (i = 0; i < g->count; i++) {
+			snprintf(name, sizeof(name), "%s.%s", g->name,
+				 g->entries[i].name);
+			cb(name, stats_get(&g->entries[i]), data);
+		}
+	}
+}
+
+/*
+ * Report all statistics as name/value pairs, for the binary control
+ * protocol or any other exporter.
+ */
+void stats_export(struct stats *s,
+		  void (*cb)(const char *name, unsigned long long value,
+			     void *data), void *data)
+{
+	struct frame *top = frame_stack_top();
+
+	cb("frame.pushed",		s->frame_pushed, data);
+	cb("frame.duplicate",		s->frame_dup, data);
+	cb("frame.error",		s->frame_error, data);
+	cb("frame.badchecksum",		s->badchecksum, data);
+	cb("frame.overload",		s->frame_overload, data);
+	cb("frame.other",		s->frame_other, data);
+	cb("frame.maxlen",		s->frame_maxlen, data);
+	cb("frame.stack",		s->frame_stack, data);
+	cb("frame.stack_max",		s->frame_stack_max, data);
+
+	stats_export_groups(cb, data);
+
+	cb("control.requests",		s->control_requests, data);
+	cb("control.bin_requests",	s->control_bin_requests, data);
+	cb("control.subscribers",	s->control_subscribers, data);
+	cb("control.pushed",		s->control_pushed, data);
+	cb("control.send_errors",	s->control_send_errors, data);
+
+	cb("serial.errors",		s->serial_rx_errors, data);
+	cb("serial.data_loss",		s->serial_data_loss, data);
+	cb("serial.rx_bytes_max",	s->serial_rx_bytes_max, data);
+	cb("serial.min_timeout",	s->min_timeout, data);
+
+	cb("log.written",		log_written, data);
+	cb("log.dropped",		log_dropped, data);
+
+	cb("power.current",		top ? top->power : 0, data);
+	cb("power.min",			s->power_min, data);
+	cb("power.max",			s->power_max, data);
+	cb("power.avg1",		frame_stack_average(1 * 60), data);
+	cb("power.avg5",		frame_stack_average(5 * 60), data);
+	cb("power.avg30",		frame_stack_average(30 * 60), data);
 }
 
 void stats_log(struct stats *s)
 {
-	char buffer[1024];
+	static char buffer[16384];
 	char *line = buffer;
 	char *ptr = buffer;
 
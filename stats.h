@@ -11,20 +11,86 @@
 #ifndef EDFINFO_STATS_H
 #define EDFINFO_STATS_H
 
+#include <sys/time.h>
+
+#define USEC_PER_SEC	1000000
+
+/*
+ * Latency accounting in micro seconds
+ */
+struct latency {
+	unsigned long long	last;
+	unsigned long long	min;
+	unsigned long long	max;
+	unsigned long long	total;
+	unsigned long		count;
+};
+
+/*
+ * Statistics registry. Modules, backends in particular, declare
+ * groups of counters and gauges which are rendered generically.
+ * Updates are atomic and can be done from any thread.
+ */
+enum stats_type {
+	STATS_COUNTER,
+	STATS_GAUGE,
+};
+
+struct stats_entry {
+	const char		*name;
+	enum stats_type		type;
+	unsigned long		value;
+};
+
+#define STATS_COUNTER(n)	{ .name = n, .type = STATS_COUNTER }
+#define STATS_GAUGE(n)		{ .name = n, .type = STATS_GAUGE }
+
+struct stats_group {
+	const char		*name;
+	struct stats_entry	*entries;
+	unsigned int		count;
+	struct stats_group	*next;
+};
+
+static inline void stats_add(struct stats_entry *e, unsigned long value)
+{
+	__atomic_fetch_add(&e->value, value, __ATOMIC_RELAXED);
+}
+
+static inline void stats_inc(struct stats_entry *e)
+{
+	stats_add(e, 1);
+}
+
+static inline void stats_set(struct stats_entry *e, unsigned long value)
+{
+	__atomic_store_n(&e->value, value, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long stats_get(const struct stats_entry *e)
+{
+	return __atomic_load_n(&e->value, __ATOMIC_RELAXED);
+}
+
+extern void stats_register(struct stats_group *group);
+extern void stats_unregister(struct stats_group *group);
+
 extern struct stats {
 	unsigned int	frame_stack;
 	unsigned int	frame_stack_max;
 	unsigned long	frame_pushed;
 	unsigned long	frame_error;
 	unsigned long	frame_dup;
+	unsigned long	frame_overload;
+	unsigned long	frame_other;	/* meters not aggregated */
 	size_t		frame_maxlen;
 	unsigned long	badchecksum;
 
-	unsigned long	mysql_pushed;
-	unsigned long	mysql_error;
-	unsigned long	mqtt_pushed;
-	unsigned long	mqtt_dropped;
 	unsigned long	control_requests;
+	unsigned long	control_bin_requests;
+	unsigned int	control_subscribers;
+	unsigned long	control_pushed;
+	unsigned long	control_send_errors;
 
 	unsigned int	power_min;
 	unsigned int	power_max;
@@ -34,10 +100,22 @@ extern struct stats {
 	unsigned long	serial_rx_errors;
 	ssize_t		serial_rx_bytes_max;
 	useconds_t	min_timeout;
+
+	/* ETX arrival -> read() wakeup, ETX arrival -> frame stacked */
+	struct latency	serial_wakeup;
+	struct latency	frame_decode;
 } stats;
 
+extern unsigned long long clock_usecs(void);
+extern void latency_update(struct latency *l, unsigned long long usecs);
+extern int latency_print(const char *name, const struct latency *l,
+			 char *buffer, size_t len);
+
 extern void stats_update_min_timeout(struct stats *s, struct timeval *tv);
 extern int stats_print(struct stats *stats, char *buffer, size_t len);
 extern void stats_log(struct stats *stats);
+extern void stats_export(struct stats *s,
+			 void (*cb)(const char *name, unsigned long long value,
+				    void *data), void *data);
 
 #endif
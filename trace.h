@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef EDFINFO_TRACE_H
+#define EDFINFO_TRACE_H
+
+/*
+ * Static tracepoints (USDT) of the frame pipeline, under the
+ * "edfinfo" provider. When not attached, a probe is a single nop
+ * instruction. See edfinfo.bt for an example of use with bpftrace.
+ *
+ *   frame_start(parser, rx_time)
+ *   frame_end(parser, len, rx_time)
+ *   frame_checksum(info, csum, expected)
+ *   frame_accept(num, ninfos, power)
+ *   frame_reject(len)
+ *   stack_add(num, count)
+ *   stack_evict(count)
+ *   push_begin(backend, num, rx_time)
+ *   push_end(backend, num, ret)
+ *
+ * rx_time values are CLOCK_MONOTONIC usecs, as returned by
+ * clock_usecs().
+ */
+#ifdef CONFIG_SDT
+#include <sys/sdt.h>
+
+#define TRACE(probe, ...)	STAP_PROBEV(edfinfo, probe, ##__VA_ARGS__)
+#else
+#define TRACE(probe, ...)	do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "window.h"
+
+/*
+ * "60,900,3600" -> lengths in seconds. Returns the number of windows
+ * or -1.
+ */
+int window_parse(const char *value, unsigned int *lengths, unsigned int max)
+{
+	char *str, *token, *saveptr;
+	unsigned int count = 0;
+
+	str = strdup(value);
+	for (token = strtok_r(str, ", ", &saveptr); token;
+	     token = strtok_r(NULL, ", ", &saveptr)) {
+		if (count == max || atoi(token) <= 0) {
+			fprintf(stderr, "invalid window '%s'\n", token);
+			free(str);
+			return -1;
+		}
+		lengths[count++] = atoi(token);
+	}
+	free(str);
+	return count;
+}
+
+static int deque_init(struct window_deque *d, unsigned int length)
+{
+	/* frames are received every 1-2 seconds, more grows the deque */
+	d->size = length + 16;
+	d->samples = calloc(d->size, sizeof(*d->samples));
+	if (!d->samples) {
+		ERROR("could not allocate window : %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int window_init(struct window *w, unsigned int length)
+{
+	w->length = length;
+	w->sum = 0;
+	return deque_init(&w->min, length) || deque_init(&w->max, length) ||
+		deque_init(&w->all, length) ? -1 : 0;
+}
+
+static inline struct window_sample *deque_at(const struct window_deque *d,
+					     unsigned int i)
+{
+	return &d->samples[(d->head + i) % d->size];
+}
+
+static inline void deque_pop_front(struct window_deque *d)
+{
+	d->head = (d->head + 1) % d->size;
+	d->count--;
+}
+
+/*
+ * Several sources or a replay send more than a frame per second. The
+ * window must keep all its samples, the front of the min and max
+ * deques being the result.
+ */
+static int deque_grow(struct window_deque *d)
+{
+	unsigned int size = d->size * 2;
+	struct window_sample *samples;
+	unsigned int i;
+
+	samples = malloc(size * sizeof(*samples));
+	if (!samples) {
+		ERROR("could not grow window : %s", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < d->count; i++)
+		samples[i] = *deque_at(d, i);
+
+	free(d->samples);
+	d->samples = samples;
+	d->size = size;
+	d->head = 0;
+	return 0;
+}
+
+static void deque_push_back(struct window_deque *d, time_t timestamp,
+			    unsigned int value)
+{
+	*deque_at(d, d->count) = (struct window_sample) { timestamp, value };
+	d->count++;
+}
+
+/*
+ * The min deque holds increasing values, the max deque decreasing
+ * values, and the front is the result. Each sample is pushed and
+ * popped once.
+ */
+static void deque_push_mono(struct window_deque *d, time_t timestamp,
+			    unsigned int value, int max)
+{
+	/* drop the samples which can not be the result anymore */
+	while (d->count) {
+		unsigned int back = deque_at(d, d->count - 1)->value;
+
+		if (max ? back > value : back < value)
+			break;
+		d->count--;
+	}
+
+	/* out of memory, lose the oldest */
+	if (d->count == d->size && deque_grow(d))
+		deque_pop_front(d);
+
+	deque_push_back(d, timestamp, value);
+}
+
+static void deque_expire(struct window_deque *d, time_t oldest)
+{
+	while (d->count && deque_at(d, 0)->timestamp < oldest)
+		deque_pop_front(d);
+}
+
+void window_add(struct window *w, time_t timestamp, unsigned int value)
+{
+	time_t oldest = timestamp - w->length + 1;
+
+	deque_push_mono(&w->min, timestamp, value, 0);
+	deque_push_mono(&w->max, timestamp, value, 1);
+
+	if (w->all.count == w->all.size && deque_grow(&w->all)) {
+		w->sum -= deque_at(&w->all, 0)->value;
+		deque_pop_front(&w->all);
+	}
+	deque_push_back(&w->all, timestamp, value);
+	w->sum += value;
+
+	deque_expire(&w->min, oldest);
+	deque_expire(&w->max, oldest);
+	while (w->all.count && deque_at(&w->all, 0)->timestamp < oldest) {
+		w->sum -= deque_at(&w->all, 0)->value;
+		deque_pop_front(&w->all);
+	}
+}
+
+int window_get(const struct window *w, unsigned int *min, unsigned int *max,
+	       unsigned int *mean)
+{
+	if (!w->all.count)
+		return -1;
+
+	if (min)
+		*min = deque_at(&w->min, 0)->value;
+	if (max)
+		*max = deque_at(&w->max, 0)->value;
+	if (mean)
+		*mean = w->sum / w->all.count;
+	return 0;
+}
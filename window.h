@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * edfinfo - read information from electricity meter (France)
+ *
+ * Copyright (C) 2022, Cédric Le Goater <clg@kaod.org>
+ *
+ * This code is licensed under the GPL version 2 or later. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef EDFINFO_WINDOW_H
+#define EDFINFO_WINDOW_H
+
+#include <time.h>
+
+/*
+ * Sliding window aggregates (min, max, mean) of timestamped values,
+ * in O(1) amortized per value.
+ */
+struct window_sample {
+	time_t		timestamp;
+	unsigned int	value;
+};
+
+struct window_deque {
+	struct window_sample	*samples;
+	unsigned int		size;
+	unsigned int		head;	/* front */
+	unsigned int		count;
+};
+
+struct window {
+	unsigned int		length;	/* seconds */
+	struct window_deque	min;
+	struct window_deque	max;
+	struct window_deque	all;
+	unsigned long long	sum;
+};
+
+extern int window_parse(const char *value, unsigned int *lengths,
+			unsigned int max);
+extern int window_init(struct window *w, unsigned int length);
+extern void window_add(struct window *w, time_t timestamp,
+		       unsigned int value);
+extern int window_get(const struct window *w, unsigned int *min,
+		      unsigned int *max, unsigned int *mean);
+
+#endif